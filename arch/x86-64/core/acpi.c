@@ -34,6 +34,9 @@
 #include <arch/memlayout.h>
 #include <acpi.h>
 
+#include "ioapic.h"
+#include "smp.h"
+
 #define KPREFIX		"acpi:"
 
 #include <akari/log.h>
@@ -228,12 +231,32 @@ static void INIT
 ApicParseIoapic(MADT_IOAPIC *ioapic)
 {
 	KLOG("IOAPIC%d at %p\n", ioapic->IoapicId, ioapic->IoapicAddr);
+
+	IoapicRegister(ioapic->IoapicId, ioapic->IoapicAddr, ioapic->IntrBase);
+}
+
+static void INIT
+ApicParseIso(MADT_ISO *iso)
+{
+	if (iso->Bus != 0)
+	{
+		return;
+	}
+
+	IoapicOverride(iso->Source, iso->Gsi, iso->Flags);
 }
 
 static void INIT
 ApicParseLocalX2apic(MADT_LOCAL_X2APIC *x2apic)
 {
-	KLOG("x2apic Processor %d found %d %d\n", x2apic->X2apicId, x2apic->AcpiId, x2apic->Flags);
+	if (!(x2apic->Flags & 1))
+	{
+		return;
+	}
+
+	KLOG("x2apic Processor %d(%d) found\n", x2apic->AcpiId, x2apic->X2apicId);
+
+	SmpAddCpu(x2apic->X2apicId);
 }
 
 static void INIT
@@ -245,6 +268,8 @@ ApicParseLocalapic(MADT_LOCALAPIC *apic)
 	}
 
 	KLOG("Processor %d(%d) found\n", apic->ProcId, apic->ApicId);
+
+	SmpAddCpu(apic->ApicId);
 }
 
 static void INIT
@@ -275,6 +300,9 @@ AcpiMadtInit(void)
 		case APIC_TYPE_IOAPIC:
 			ApicParseIoapic((MADT_IOAPIC *)ent);
 			break;
+		case APIC_TYPE_ISO:
+			ApicParseIso((MADT_ISO *)ent);
+			break;
 		case APIC_TYPE_LOCAL_X2APIC:
 			ApicParseLocalX2apic((MADT_LOCAL_X2APIC *)ent);
 			break;
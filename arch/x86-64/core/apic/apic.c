@@ -33,15 +33,19 @@
 #include <akari/timer.h>
 #include <akari/sysmem.h>
 #include <akari/irqsource.h>
+#include <akari/irq.h>
+#include <arch/irq.h>
 
 #define KPREFIX		"apic:"
 
 #include <akari/log.h>
 #include <cpuid.h>
+#include <msr.h>
 
 #include <arch/cpu.h>
 
 #include "apic.h"
+#include "../tsc.h"
 
 #define ID		0x020
 
@@ -49,7 +53,7 @@
 
 #define TPR		0x080
 
-#define EOI		0x0b0
+#define EOIR		0x0b0
 
 #define SPIV		0x0f0
 #define SPIV_APIC_ENABLED	(1 << 8)
@@ -71,7 +75,13 @@
 #define TM_CURRENT	0x390
 
 #define TM_DIV		0x3e0
+#define TM_DIV_1		0xb
 
+#define CALIBRATE_USEC		1000
+#define CALIBRATE_NWIN		5
+#define CALIBRATE_MAXDEV_PPM	1000	// windows further off the median are dropped
+
+#define APIC_TIMER_VECTOR	0x40
 
 typedef struct LAPICTIMER	LAPICTIMER;
 
@@ -81,9 +91,20 @@ struct LAPICTIMER
 
 	uint Freq;
 	uint Periodms;
+	ulong TscKhz;	// TSC-deadline mode if not 0
+
+	// ns to counts of the one-shot clock, the TSC in deadline mode
+	u32 RevMult;
+	u32 RevShift;
 };
 
 APIC *Apic PERCPU;
+static u32 apicid PERCPU;
+
+// LAPIC timer frequency, measured once and shared by all CPUs
+static uint lapicfreq;
+
+static bool usex2apic;
 
 static bool
 XapicSupported(void)
@@ -105,28 +126,166 @@ X2apicSupported(void)
 	return !!(c & CPUID_1_ECX_X2APIC);
 }
 
-static int
-ApicTimerMeasureFreq(LAPICTIMER *lt)
+static bool
+TscDeadlineSupported(void)
 {
-	APIC *apic = lt->Apic;
+	u32 a, b, c, d;
+
+	Cpuid(CPUID_1, &a, &b, &c, &d);
+
+	return !!(c & CPUID_1_ECX_TSC_DEADLINE);
+}
+
+/*
+ *  The LAPIC timer runs from the core crystal clock (leaf 0x15), or the
+ *  bus clock reported in leaf 0x16.
+ */
+static uint
+ApicTimerCpuidFreq(void)
+{
+	u32 max, a, b, c, d;
+
+	Cpuid(CPUID_0, &max, &b, &c, &d);
+
+	if (max >= CPUID_15)
+	{
+		Cpuid(CPUID_15, &a, &b, &c, &d);
+
+		if (c)
+		{
+			return c;
+		}
+	}
+
+	if (max >= CPUID_16)
+	{
+		Cpuid(CPUID_16, &a, &b, &c, &d);
+
+		if (c & 0xffff)
+		{
+			return (c & 0xffff) * 1000000;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ *  Count LAPIC timer ticks over one short window of STimer
+ */
+static ulong
+ApicTimerWindow(APIC *apic, TIMER *tm)
+{
+	ulong start, end;
 	u32 cnt, cnt2;
 
+	// start on a fresh STimer count
+	start = tm->ReadCounterRaw(tm);
+	while (tm->ReadCounterRaw(tm) == start)
+		;
+
+	end = start + 1 + TimerUsec2Period(tm, CALIBRATE_USEC);
+
 	cnt = apic->Read(TM_CURRENT);
 
-	// sleep 1s
-	mSleep(1000);
+	while (tm->ReadCounterRaw(tm) < end)
+		;
 
 	cnt2 = apic->Read(TM_CURRENT);
 
-	if (cnt <= cnt2)
+	return cnt > cnt2 ? (ulong)(cnt - cnt2) * (1000000 / CALIBRATE_USEC) : 0;
+}
+
+/*
+ *  Measure over a few short windows, drop the ones far from the median
+ *  and average the rest.
+ */
+static int
+ApicTimerMeasureFreq(LAPICTIMER *lt)
+{
+	APIC *apic = lt->Apic;
+	TIMER *tm = STimer;
+	ulong f[CALIBRATE_NWIN], tmp, median, dev, maxdev = 0, sum = 0;
+	int n = 0;
+
+	if (!tm)
+	{
+		KWARN("no timer to calibrate against\n");
+		return -1;
+	}
+
+	for (int i = 0; i < CALIBRATE_NWIN; i++)
+	{
+		f[i] = ApicTimerWindow(apic, tm);
+
+		for (int j = i; j > 0 && f[j - 1] > f[j]; j--)
+		{
+			tmp = f[j];
+			f[j] = f[j - 1];
+			f[j - 1] = tmp;
+		}
+	}
+
+	median = f[CALIBRATE_NWIN / 2];
+
+	if (median == 0)
 	{
 		KWARN("lapic timer?");
 		return -1;
 	}
 
-	lt->Freq = cnt - cnt2;
+	for (int i = 0; i < CALIBRATE_NWIN; i++)
+	{
+		dev = f[i] > median ? f[i] - median : median - f[i];
+
+		if (dev * 1000000 / median > CALIBRATE_MAXDEV_PPM)
+		{
+			continue;
+		}
+
+		maxdev = MAX(maxdev, dev);
+		sum += f[i];
+		n++;
+	}
+
+	lt->Freq = sum / n;
+
+	KLOG("lapic timer %u Hz against %s, %d/%d windows, +-%lu ppm\n",
+	     lt->Freq, tm->Name, n, CALIBRATE_NWIN, maxdev * 1000000 / median);
+
+	return 0;
+}
+
+static int
+ApicTimerCalibrate(LAPICTIMER *lt)
+{
+	u64 t0;
+
+	if (lapicfreq)
+	{
+		lt->Freq = lapicfreq;
+		return 0;
+	}
+
+	t0 = Rdtsc();
+
+	lt->Freq = ApicTimerCpuidFreq();
+
+	if (lt->Freq)
+	{
+		KLOG("lapic timer %u Hz (cpuid)\n", lt->Freq);
+	}
+	else if (ApicTimerMeasureFreq(lt) < 0)
+	{
+		return -1;
+	}
+
+	if (TscKhz())
+	{
+		KLOG("calibration took %lu us\n", (Rdtsc() - t0) * 1000 / TscKhz());
+	}
 
-	KDBG ("lapic timer %x -> %x freq:%d\n", cnt, cnt2, lt->Freq);
+	lapicfreq = lt->Freq;
 
 	return 0;
 }
@@ -142,30 +301,38 @@ ApicTimerProbe(EVENTTIMER *et)
 	KDBG ("Probe lapic timer: %s\n", et->Name);
 
 	lvt |= LVT_TIMER_INT_MASK;
-	lvt |= 0x40;
+	lvt |= APIC_TIMER_VECTOR;
 
 	apic->Write(LVT_TIMER, lvt);
 
+	// count the timer clock undivided
+	apic->Write(TM_DIV, TM_DIV_1);
+
 	// Enable Timer
 	apic->Write(TM_INIT, 0xffffffff);
 
-	err = ApicTimerMeasureFreq(lt);
+	err = ApicTimerCalibrate(lt);
 
 	if (err)
 	{
 		return -1;
 	}
 
-	lvt = LVT_TIMER_PERIODIC;
-	// lvt |= LVT_TIMER_INT_MASK;
-	lvt |= 0x40;		// periodic mode, vector is 0x20
+	// stop the timer until a mode is set
+	apic->Write(TM_INIT, 0);
 
-	apic->Write(LVT_TIMER, lvt);
+	et->Features = ET_FEAT_PERIODIC | ET_FEAT_ONESHOT;
 
-	// test
-	apic->Write(TM_INIT, lt->Freq * 3);
+	if (TscDeadlineSupported() && TscKhz())
+	{
+		lt->TscKhz = TscKhz();
+		et->Features |= ET_FEAT_DEADLINE;
+	}
 
-	err = NewEventTimerIrq(et, 0x40);
+	TimerCalcRevMult(lt->TscKhz ? lt->TscKhz * 1000 : lt->Freq,
+			 &lt->RevMult, &lt->RevShift);
+
+	err = NewEventTimerIrq(et, APIC_TIMER_VECTOR);
 
 	if (err)
 	{
@@ -216,39 +383,113 @@ static void
 ApicTimerSetPeriod(EVENTTIMER *et, uint ms)
 {
 	LAPICTIMER *lt = et->Device;
+	APIC *apic = lt->Apic;
 
 	lt->Periodms = ms;
+
+	if (et->Mode == ET_MODE_PERIODIC)
+	{
+		apic->Write(TM_INIT, (ulong)lt->Freq * ms / 1000);
+	}
+}
+
+static int
+ApicTimerSetMode(EVENTTIMER *et, int mode)
+{
+	LAPICTIMER *lt = et->Device;
+	APIC *apic = lt->Apic;
+	u32 lvt;
+
+	// keep the timer masked while switching
+	lvt = LVT_TIMER_INT_MASK | APIC_TIMER_VECTOR;
+
+	apic->Write(LVT_TIMER, lvt);
+	apic->Write(TM_INIT, 0);
+
+	switch (mode)
+	{
+	case ET_MODE_OFF:
+		break;
+	case ET_MODE_PERIODIC:
+		apic->Write(LVT_TIMER, lvt | LVT_TIMER_PERIODIC);
+		apic->Write(TM_INIT, (ulong)lt->Freq * lt->Periodms / 1000);
+		break;
+	case ET_MODE_ONESHOT:
+		if (lt->TscKhz)
+		{
+			apic->Write(LVT_TIMER, lvt | LVT_TIMER_TSC_DEADLINE);
+			// order the LVT write before the first IA32_TSC_DEADLINE write
+			asm volatile ("mfence" ::: "memory");
+		}
+		else
+		{
+			apic->Write(LVT_TIMER, lvt | LVT_TIMER_ONE_TIME);
+		}
+		break;
+	default:
+		return -1;
+	}
+
+	et->Mode = mode;
+
+	return 0;
+}
+
+static int
+ApicTimerSetNextEvent(EVENTTIMER *et, ulong ns)
+{
+	LAPICTIMER *lt = et->Device;
+	APIC *apic = lt->Apic;
+	ulong count;
+
+	count = Ns2Cycles(ns, lt->RevMult, lt->RevShift);
+
+	if (lt->TscKhz)
+	{
+		Wrmsr64(IA32_TSC_DEADLINE, Rdtsc() + count);
+		return 0;
+	}
+
+	apic->Write(TM_INIT, MAX(MIN(count, 0xffffffff), 1));
+
+	return 0;
 }
 
 static int
 ApicTimerIrq(EVENTTIMER *et)
 {
-	KLOG("APIC TIMER IRQ\n");
+	TimerEvent(et);
 
-	// TODO
-	return -1;
+	return 0;
 }
 
-static EVENTTIMER lapictimer = {
-	.Global = true,
+static const EVENTTIMER lapictimertemplate = {
+	.Global = false,
+	.Rating = 100,
 	.GetPeriod = ApicTimerGetPeriod,
 	.SetPeriod = ApicTimerSetPeriod,
 	.Probe = ApicTimerProbe,
 	.On = ApicTimerOn,
 	.Off = ApicTimerOff,
+	.SetMode = ApicTimerSetMode,
+	.SetNextEvent = ApicTimerSetNextEvent,
 	.IRQHandler = ApicTimerIrq,
 };
 
+// each CPU owns its LAPIC timer
+static EVENTTIMER lapictimer PERCPU;
+static LAPICTIMER lapictimerdev PERCPU;
+
 static void
 EnableApic(void)
 {
 	u32 spiv;
 
-	spiv = Apic->Read(SPIV);
+	spiv = MYCPU(Apic)->Read(SPIV);
 
 	spiv |= SPIV_APIC_ENABLED;
 
-	Apic->Write(SPIV, spiv);
+	MYCPU(Apic)->Write(SPIV, spiv);
 }
 
 static void
@@ -256,75 +497,205 @@ DisableApic(void)
 {
 	u32 spiv;
 
-	spiv = Apic->Read(SPIV);
+	spiv = MYCPU(Apic)->Read(SPIV);
 
 	spiv &= ~SPIV_APIC_ENABLED;
 
-	Apic->Write(SPIV, spiv);
+	MYCPU(Apic)->Write(SPIV, spiv);
 }
 
-static void INIT
-ApicSetSpiv(void)
+void
+ApicEOI(void)
 {
-	u32 spiv;
+	MYCPU(Apic)->EOI();
+}
 
-	spiv = 0x20;	// vector is 0x20
+static void
+ApicChipEOI(IRQ *irq)
+{
+	ApicEOI();
+}
+
+// every vector arrives through the local APIC of the CPU taking it
+static IRQCHIP apicchip = {
+	.Name = "LAPIC",
+	.EOI = ApicChipEOI,
+};
 
-	Apic->Write(SPIV, spiv);
+/*
+ *  Local APIC ID of this CPU
+ */
+u32
+ApicId(void)
+{
+	return MYCPU(Apic)->Id();
 }
 
-void INIT
-ApicInit0(void)
+/*
+ *  The IOAPIC and MSI destination fields hold an 8 bit APIC ID: a CPU
+ *  with a larger x2APIC ID cannot take device interrupts
+ */
+bool
+ArchIrqCpuTargetable(int cpu)
 {
-	LAPICTIMER *timer;
+	return ApicIdOf(cpu) <= 0xff;
+}
 
-	if (X2apicSupported())
-	{
-		KDBG("Kernel use x2apic\n");
+/*
+ *  MSI message delivering @vector to @cpu: fixed delivery, physical
+ *  destination, edge triggered.  @cpu must be ArchIrqCpuTargetable().
+ */
+void
+ArchMsiCompose(int vector, int cpu, u64 *addr, u32 *data)
+{
+	*addr = 0xfee00000ul | (ApicIdOf(cpu) << 12);
+	*data = vector;
+}
 
-		// Apic = X2apicInit();
-	}
+/*
+ *  Fixed IPI of @vector to @cpu
+ */
+void
+ArchSendIPI(int cpu, int vector)
+{
+	MYCPU(Apic)->SendIPI(ApicIdOf(cpu), ICR_FIXED | ICR_ASSERT | vector);
+}
 
-	if (!Apic && XapicSupported())
+void
+ArchSendIPIMask(ulong mask, int vector)
+{
+	for (int cpu = 0; mask; cpu++, mask >>= 1)
 	{
-		KDBG("Kernel use xapic\n");
-
-		Apic = XapicInit();
+		if (mask & 1)
+		{
+			ArchSendIPI(cpu, vector);
+		}
 	}
+}
 
-	if (!Apic)
-	{
-		Panic("No apic");
-	}
+/*
+ *  One ICR write reaches every other CPU
+ */
+void
+ArchSendIPIAllButSelf(int vector)
+{
+	MYCPU(Apic)->SendIPI(0, ICR_DEST_OTHERS | ICR_FIXED | ICR_ASSERT | vector);
+}
 
+/*
+ *  INIT and STARTUP IPIs go by APIC ID: the APs have no cpu number yet
+ */
+void INIT
+ApicSendInit(u32 apicid)
+{
+	MYCPU(Apic)->SendIPI(apicid, ICR_INIT | ICR_ASSERT | ICR_LEVEL);
+}
+
+/*
+ *  Start @apicid in real mode at @entry, a page below 1MB
+ */
+void INIT
+ApicSendStartup(u32 apicid, PHYSADDR entry)
+{
+	MYCPU(Apic)->SendIPI(apicid, ICR_STARTUP | (entry >> 12));
+}
+
+/*
+ *  Local APIC ID of @cpu, once it has set up its APIC
+ */
+u32
+ApicIdOf(int cpu)
+{
+	return CPU_VAR(apicid, cpu);
+}
+
+static void INIT
+ApicSetSpiv(void)
+{
+	u32 spiv;
+
+	spiv = APIC_SPURIOUS_VECTOR;
+
+	MYCPU(Apic)->Write(SPIV, spiv);
+}
+
+/*
+ *  Register the LAPIC timer of this CPU
+ */
+static void INIT
+ApicTimerInit(void)
+{
+	EVENTTIMER *et = &MYCPU(lapictimer);
+	LAPICTIMER *lt = &MYCPU(lapictimerdev);
+
+	lt->Apic = MYCPU(Apic);
+
+	*et = lapictimertemplate;
+	et->Device = lt;
+	sprintf(et->Name, "LAPICTimer%d", CpuId());
+
+	NewEventTimer(et);
+}
+
+static void INIT
+ApicSetupCpu(void)
+{
 	// Set Sprious Interrupt Vector
 	ApicSetSpiv();
 
 	// Clear Error Status
-	Apic->Write(ESR, 0);
+	MYCPU(Apic)->Write(ESR, 0);
 
-	Apic->Write(TPR, 0);
+	MYCPU(Apic)->Write(TPR, 0);
 
 	EnableApic();
 
-	timer = BootmemAlloc(sizeof *timer, _Alignof(*timer));
+	MYCPU(apicid) = ApicId();
+
+	ApicTimerInit();
+}
+
+void INIT
+ApicInit0(void)
+{
+	IrqSetDefaultChip(&apicchip);
 
-	if (!timer)
+	if (X2apicSupported())
 	{
-		KWARN("cannot initialize lapic timer\n");
-		return;
+#ifdef KBENCH
+		// measure the xAPIC now: there is no way back from x2APIC
+		MYCPU(Apic) = XapicInit();
+		ApicSetSpiv();
+		EnableApic();
+		ApicBenchXapic(MYCPU(Apic));
+#endif	// KBENCH
+
+		MYCPU(Apic) = X2apicInit();
+		usex2apic = true;
 	}
 
-	timer->Apic = Apic;
+	if (!MYCPU(Apic) && XapicSupported())
+	{
+		MYCPU(Apic) = XapicInit();
+	}
 
-	lapictimer.Device = timer;
-	sprintf(lapictimer.Name, "LAPICTimer%d", 0);	// TODO: CPUID
+	if (!MYCPU(Apic))
+	{
+		Panic("No apic");
+	}
+
+	KLOG("use %s\n", MYCPU(Apic)->Name);
 
-	NewEventTimer(&lapictimer);
+	ApicSetupCpu();
 }
 
+/*
+ *  APs use the mode the boot CPU picked
+ */
 void INIT
 ApicInitAp(void)
 {
-	;
+	MYCPU(Apic) = usex2apic ? X2apicInitAp() : XapicInitAp();
+
+	ApicSetupCpu();
 }
@@ -31,17 +31,54 @@
 #define X86_CORE_APIC_APIC_H
 
 #include <akari/types.h>
+#include <akari/compiler.h>
+
+#define APIC_SPURIOUS_VECTOR	0x20
+#define APIC_BENCH_VECTOR	0xfd	// self IPIs of the KBENCH benchmark
+
+// low half of the ICR, the destination is passed apart
+#define ICR_FIXED		(0 << 8)
+#define ICR_NMI			(4 << 8)
+#define ICR_INIT		(5 << 8)
+#define ICR_STARTUP		(6 << 8)
+#define ICR_DELIVS		(1 << 12)	// xAPIC only: send pending
+#define ICR_ASSERT		(1 << 14)
+#define ICR_LEVEL		(1 << 15)
+#define ICR_DEST_SELF		(1 << 18)
+#define ICR_DEST_ALL		(2 << 18)
+#define ICR_DEST_OTHERS		(3 << 18)
 
 typedef struct APIC	APIC;
 
 struct APIC
 {
+	const char *Name;
+
+	// registers by their xAPIC MMIO offset
 	u32 (*Read)(u32 reg);
 	void (*Write)(u32 reg, u32 val);
+
+	u32 (*Id)(void);
+	void (*EOI)(void);
+	void (*SendIPI)(u32 dest, u32 icr);
 };
 
 extern APIC *Apic;
 
+u32 ApicId(void);
+u32 ApicIdOf(int cpu);
+void ApicEOI(void);
+void ApicSendInit(u32 apicid) INIT;
+void ApicSendStartup(u32 apicid, PHYSADDR entry) INIT;
+
+void ApicInit0(void) INIT;
+void ApicInitAp(void) INIT;
+
 APIC *XapicInit(void);
+APIC *XapicInitAp(void);
+APIC *X2apicInit(void);
+APIC *X2apicInitAp(void);
+
+void ApicBenchXapic(APIC *apic) INIT;
 
 #endif	// X86_CORE_APIC_APIC_H
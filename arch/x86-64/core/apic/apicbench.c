@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2024, akarilab.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Local APIC EOI and IPI cost, xAPIC against x2APIC
+
+#include <akari/types.h>
+#include <akari/compiler.h>
+#include <akari/bench.h>
+#include <akari/irqsource.h>
+#include <arch/cpu.h>
+#include <arch/asm.h>
+
+#define KPREFIX		"bench/apic:"
+
+#include <akari/log.h>
+
+#include "apic.h"
+
+#define NEOI		100000
+#define NIPI		10000
+
+typedef struct APICCOST		APICCOST;
+
+struct APICCOST
+{
+	const char *Name;
+	ulong Eoi;
+	ulong Send;		// ICR write(s)
+	ulong Roundtrip;	// send to the handler having run
+};
+
+static APICCOST xapiccost;
+static IRQSOURCE *benchirq;
+static volatile ulong nbenchipi;
+
+static int
+ApicBenchIrq(IRQSOURCE *src)
+{
+	nbenchipi++;
+
+	return 0;
+}
+
+static void
+ApicMeasure(APIC *apic, APICCOST *c)
+{
+	u64 t0, t1, send = 0, rt = 0;
+	ulong n;
+
+	if (!benchirq)
+	{
+		benchirq = NewIRQSource(NULL, ApicBenchIrq, APIC_BENCH_VECTOR, true);
+		if (!benchirq)
+		{
+			KWARN("no bench vector\n");
+			return;
+		}
+	}
+
+	c->Name = apic->Name;
+
+	// nothing is in service, so this is the cost of the write alone
+	t0 = RdtscOrdered();
+	for (int i = 0; i < NEOI; i++)
+	{
+		apic->EOI();
+	}
+	c->Eoi = (RdtscOrdered() - t0) / NEOI;
+
+	for (int i = 0; i < NIPI; i++)
+	{
+		n = nbenchipi;
+
+		t0 = RdtscOrdered();
+		apic->SendIPI(0, ICR_DEST_SELF | ICR_ASSERT | ICR_FIXED | APIC_BENCH_VECTOR);
+		t1 = RdtscOrdered();
+
+		INTR_ENABLE;
+		while (nbenchipi == n)
+		{
+			Pause();
+		}
+		INTR_DISABLE;
+
+		send += t1 - t0;
+		rt += RdtscOrdered() - t0;
+	}
+
+	c->Send = send / NIPI;
+	c->Roundtrip = rt / NIPI;
+}
+
+static void
+Report(APICCOST *c)
+{
+	KLOG("%s: EOI %lu, IPI send %lu, self IPI round trip %lu cycles\n",
+	     c->Name, c->Eoi, c->Send, c->Roundtrip);
+}
+
+/*
+ *  Called by ApicInit0() on the enabled xAPIC, before it switches to
+ *  x2APIC for good
+ */
+void INIT
+ApicBenchXapic(APIC *apic)
+{
+	ApicMeasure(apic, &xapiccost);
+}
+
+static void
+ApicBench(void)
+{
+	APICCOST c;
+
+	if (xapiccost.Name)
+	{
+		Report(&xapiccost);
+	}
+
+	ApicMeasure(MYCPU(Apic), &c);
+	Report(&c);
+}
+
+DEFINE_BENCH(Apic, ApicBench);
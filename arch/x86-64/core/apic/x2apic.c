@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2024, akarilab.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// x2APIC: the local APIC registers as MSRs
+
+#include <akari/types.h>
+#include <akari/compiler.h>
+#include <akari/panic.h>
+
+#define KPREFIX		"x2apic:"
+
+#include <akari/log.h>
+#include <cpuid.h>
+#include <msr.h>
+
+#include "apic.h"
+
+// MSR of the register at xAPIC offset @off
+#define X2APIC_MSR(_off)	(0x800 + ((_off) >> 4))
+
+#define X2APIC_ID		X2APIC_MSR(0x020)
+#define X2APIC_EOI		X2APIC_MSR(0x0b0)
+#define X2APIC_ICR		X2APIC_MSR(0x300)	// 64-bit, no ICR_HIGH
+
+static u32
+X2apicRead(u32 reg)
+{
+	return Rdmsr32(X2APIC_MSR(reg));
+}
+
+static void
+X2apicWrite(u32 reg, u32 val)
+{
+	// MSR writes complete in order, no read back needed
+	Wrmsr32(X2APIC_MSR(reg), val);
+}
+
+/*
+ *  The full 32-bit x2APIC ID, not the 8-bit xAPIC one
+ */
+static u32
+X2apicId(void)
+{
+	return Rdmsr32(X2APIC_ID);
+}
+
+static void
+X2apicEOI(void)
+{
+	Wrmsr32(X2APIC_EOI, 0);
+}
+
+/*
+ *  One 64-bit write sends, and there is no delivery status to wait for.
+ *  x2APIC MSR writes are not serializing, so order earlier stores first.
+ */
+static void
+X2apicSendIPI(u32 dest, u32 icr)
+{
+	asm volatile ("mfence; lfence" ::: "memory");
+
+	Wrmsr64(X2APIC_ICR, ((u64)dest << 32) | icr);
+}
+
+/*
+ *  xAPIC to x2APIC: the APIC must be enabled before EXTD is set
+ */
+static void
+EnableX2apic(void)
+{
+	ulong apicbase;
+
+	apicbase = Rdmsr64(IA32_APIC_BASE);
+
+	if (!(apicbase & IA32_APIC_BASE_APIC_GLOBAL_ENABLE))
+	{
+		apicbase |= IA32_APIC_BASE_APIC_GLOBAL_ENABLE;
+		Wrmsr64(IA32_APIC_BASE, apicbase);
+	}
+
+	if (!(apicbase & IA32_APIC_BASE_ENABLE_X2APIC))
+	{
+		apicbase |= IA32_APIC_BASE_ENABLE_X2APIC;
+		Wrmsr64(IA32_APIC_BASE, apicbase);
+	}
+}
+
+static APIC X2apicOps = {
+	.Name = "x2APIC",
+	.Read = X2apicRead,
+	.Write = X2apicWrite,
+	.Id = X2apicId,
+	.EOI = X2apicEOI,
+	.SendIPI = X2apicSendIPI,
+};
+
+APIC *
+X2apicInit(void)
+{
+	EnableX2apic();
+
+	return &X2apicOps;
+}
+
+APIC *
+X2apicInitAp(void)
+{
+	EnableX2apic();
+
+	return &X2apicOps;
+}
@@ -38,6 +38,7 @@
 #include <akari/log.h>
 #include <cpuid.h>
 #include <msr.h>
+#include <arch/asm.h>
 
 #include "apic.h"
 
@@ -100,10 +101,35 @@ EnableXapic(void)
 	Wrmsr64(IA32_APIC_BASE, apicbase);
 }
 
+static u32
+XapicId(void)
+{
+	return XapicReadRaw(XAPIC_ID) >> 24;
+}
+
+/*
+ *  No completion read: nothing depends on the EOI having landed
+ */
+static void
+XapicEOI(void)
+{
+	XapicWriteRaw(XAPIC_EOI, 0);
+}
+
+/*
+ *  Two MMIO writes, the low half sends.  Waits until the previous IPI
+ *  left so it is not overwritten.
+ */
 static void
-XapicSendIPI(uint n)
+XapicSendIPI(u32 dest, u32 icr)
 {
-	;
+	while (XapicReadRaw(XAPIC_ICR_LOW) & ICR_DELIVS)
+	{
+		Pause();
+	}
+
+	XapicWriteRaw(XAPIC_ICR_HIGH, dest << 24);
+	XapicWriteRaw(XAPIC_ICR_LOW, icr);
 }
 
 static u32
@@ -117,8 +143,12 @@ ApicBaseAddr(void)
 }
 
 static APIC XapicOps = {
+	.Name = "xAPIC",
 	.Read = XapicRead,
 	.Write = XapicWrite,
+	.Id = XapicId,
+	.EOI = XapicEOI,
+	.SendIPI = XapicSendIPI,
 };
 
 APIC *
@@ -136,3 +166,14 @@ XapicInit(void)
 
 	return &XapicOps;
 }
+
+/*
+ *  The register page is already mapped by the boot CPU
+ */
+APIC *
+XapicInitAp(void)
+{
+	EnableXapic();
+
+	return &XapicOps;
+}
@@ -35,29 +35,47 @@
 
 #include <arch/cpu.h>
 
+#include <msr.h>
+
 void *__PerCpuPtr[NCPU];
 
+// first word of the percpu data: see PerCpuBase()
+static void *percpuself SECTION(".data.percpu.first") USED;
+
+int __cpuid PERCPU;
+
 void INIT
 InitPerCpu(void)
 {
 	void *ptr;
 	u64 size = __percpu_data_e - __percpu_data;
 
-	if (size == 0)
-	{
-		return;
-	}
-
 	for (int i = 0; i < NCPU; i++)
 	{
 		ptr = BootmemAlloc(size, CACHELINE);
 		if (!ptr)
 		{
-			Panic("cannot init percpu %d");
+			Panic("cannot init percpu %d", i);
 		}
 
 		memcpy(ptr, __percpu_data, size);
 
 		__PerCpuPtr[i] = ptr;
+
+		*(void **)ptr = ptr;
+		CPU_VAR(__cpuid, i) = i;
 	}
+
+	PerCpuSetup(0);
+
+	CpuOnlineMask = 1ul << 0;
+}
+
+/*
+ *  Point GS base at the percpu data of @cpu, on that cpu
+ */
+void
+PerCpuSetup(int cpu)
+{
+	Wrmsr64(IA32_GS_BASE, (ulong)__PerCpuPtr[cpu]);
 }
@@ -34,106 +34,383 @@
 #include <akari/printk.h>
 #include <akari/kalloc.h>
 #include <akari/mm.h>
+#include <akari/irq.h>
+#include <akari/irqsource.h>
+#include <arch/irq.h>
+#include <arch/cpu.h>
 
 #define KPREFIX		"HPET:"
 
 #include <akari/log.h>
 
 #include "hpet.h"
+#include "apic/apic.h"
+#include "ioapic.h"
 
-#define HPET_MMIO_SIZE		1024
+// comparator n interrupts on HPET_VECTOR_BASE + n
+#define HPET_VECTOR_BASE	0x50
 
-#define HPET_ID			0x0
-#define HPET_CLK_PERIOD		0x4
-#define HPET_GCR		0x10
-#define HPET_MCR		0xf0
+// below this the comparator may already be passed when written
+#define HPET_MIN_DELTA		64
 
-typedef struct HPETDEV	HPETDEV;
+// IOAPIC inputs below this are the legacy ISA irqs
+#define NISAGSI			16
+
+static HPETDEV *hpetdev;
+
+static void
+HpetCtrl(HPETDEV *hpet, bool en)
+{
+	u32 gcr;
+
+	gcr = HpetRd32(hpet, HPET_GCR);
+
+	if (!!(gcr & 1) == en)
+	{
+		return;
+	}
+
+	if (en)
+	{
+		gcr |= 1;
+	}
+	else
+	{
+		gcr &= ~1;
+	}
+
+	HpetWr32(hpet, HPET_GCR, gcr);
+}
+
+static ulong
+HpetReadCounterRaw(TIMER *tm)
+{
+	return HpetGetCounter(tm->Device);
+}
+
+static bool
+HpetIsDead(HPETDEV *hpet)
+{
+	u64 now, after;
+
+	now = HpetGetCounter(hpet);
+
+	for (int i = 0; i < 1000; i++)	// busy loop
+		;
+
+	after = HpetGetCounter(hpet);
+
+	return now >= after;
+}
+
+static void
+HpetChannelWrConf(HPETCHANNEL *ch, u32 set, u32 clear)
+{
+	HPETDEV *hpet = ch->Hpet;
+	u32 conf;
+
+	conf = HpetRd32(hpet, HPET_TCONF(ch->N));
+	conf = (conf & ~clear) | set;
+	HpetWr32(hpet, HPET_TCONF(ch->N), conf);
+}
+
+static void
+HpetChannelWrComp(HPETCHANNEL *ch, ulong val)
+{
+	HPETDEV *hpet = ch->Hpet;
+
+	// 32-bit comparators match the low half of the counter
+	HpetWr64(hpet, HPET_TCOMP(ch->N), val);
+}
 
 /*
- * HPET Device
+ *  Deliver the comparator interrupt as an MSI write to the local APIC
+ *  of the current CPU, bypassing the IOAPIC
  */
-struct HPETDEV
-{
-	void *Base;
-	PHYSADDR BasePa;
-	
-	bool Cnt64;
-	uint nChannel;
-	uint Periodfs;	// 10(^-15) s	
-};
+static int
+HpetChannelFsb(HPETCHANNEL *ch)
+{
+	HPETDEV *hpet = ch->Hpet;
+	u64 addr;
+	u32 data;
+
+	ch->Vector = HPET_VECTOR_BASE + ch->N;
+
+	ArchMsiCompose(ch->Vector, CpuId(), &addr, &data);
+
+	// address in the upper half, data in the lower
+	HpetWr64(hpet, HPET_TFSB(ch->N), (addr << 32) | data);
+
+	HpetChannelWrConf(ch, TCONF_FSB_EN, TCONF_LEVEL);
+
+	return NewEventTimerIrq(&ch->Et, ch->Vector);
+}
+
+static int
+HpetChannelIoapicIrq(IRQSOURCE *irqsrc)
+{
+	EVENTTIMER *et = irqsrc->Device;
+
+	return et->IRQHandler(et);
+}
 
-static inline void
-HpetWr32(HPETDEV *hpet, ulong offset, u32 val)
+/*
+ *  Lowest input of @cap that nothing else uses, preferring those above
+ *  the ISA irqs.  -1 if none.
+ */
+static int
+HpetPickGsi(u32 cap)
 {
-	*(volatile u32 *)(hpet->Base + offset) = val;
+	for (int gsi = NISAGSI; gsi < 32; gsi++)
+	{
+		if ((cap & (1u << gsi)) && IoapicGsiFree(gsi))
+		{
+			return gsi;
+		}
+	}
+
+	for (int gsi = 0; gsi < NISAGSI; gsi++)
+	{
+		if ((cap & (1u << gsi)) && IoapicGsiFree(gsi))
+		{
+			return gsi;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ *  Route the comparator to an IOAPIC input no other channel or device
+ *  uses, so that the interrupt identifies the channel
+ */
+static int
+HpetChannelIoapic(HPETCHANNEL *ch)
+{
+	HPETDEV *hpet = ch->Hpet;
+	IRQSOURCE *irqsrc;
+	int gsi;
+
+	gsi = HpetPickGsi(ch->RouteCap & ~hpet->RouteUsed);
+	if (gsi < 0)
+	{
+		return -1;
+	}
+
+	HpetChannelWrConf(ch, gsi << TCONF_ROUTE_SHIFT, TCONF_FSB_EN | TCONF_LEVEL | TCONF_ROUTE_MASK);
+
+	irqsrc = IoapicNewIRQSource(&ch->Et, HpetChannelIoapicIrq, gsi, 0);
+	if (!irqsrc)
+	{
+		return -1;
+	}
+
+	hpet->RouteUsed |= 1u << gsi;
+
+	ch->Gsi = gsi;
+	ch->Vector = irqsrc->Irq->Irqno;
+	ch->Et.Irq = irqsrc;
+
+	return 0;
 }
 
-static inline u32
-HpetRd32(HPETDEV *hpet, ulong offset)
+static int
+HpetChannelProbe(EVENTTIMER *et)
 {
-	return *(volatile u32 *)(hpet->Base + offset);
+	HPETCHANNEL *ch = et->Device;
+	HPETDEV *hpet = ch->Hpet;
+	u32 conf;
+	int err;
+
+	conf = HpetRd32(hpet, HPET_TCONF(ch->N));
+
+	HpetChannelWrConf(ch, 0, TCONF_INT_EN | TCONF_PERIODIC);
+
+	if (conf & TCONF_FSB_CAP)
+	{
+		err = HpetChannelFsb(ch);
+	}
+	else
+	{
+		err = HpetChannelIoapic(ch);
+	}
+
+	if (err)
+	{
+		KLOG("%s: no interrupt route (IOAPIC inputs %x)\n", et->Name, ch->RouteCap);
+		return -1;
+	}
+
+	et->Features = ET_FEAT_ONESHOT;
+	if (conf & TCONF_PERIODIC_CAP)
+	{
+		et->Features |= ET_FEAT_PERIODIC;
+	}
+
+	KLOG("%s: vector %d%s%s\n", et->Name, ch->Vector,
+	     ch->Gsi < 0 ? " FSB" : " IOAPIC",
+	     et->Features & ET_FEAT_PERIODIC ? " periodic" : "");
+
+	return 0;
 }
 
-static inline u64
-HpetRd64(HPETDEV *hpet, ulong offset)
+static uint
+HpetChannelGetPeriod(EVENTTIMER *et)
 {
-	return *(volatile u64 *)(hpet->Base + offset);
+	HPETCHANNEL *ch = et->Device;
+
+	return ch->Periodms;
 }
 
 static void
-HpetCtrl(HPETDEV *hpet, bool en)
+HpetChannelSetPeriod(EVENTTIMER *et, uint ms)
 {
-	u32 gcr;
+	HPETCHANNEL *ch = et->Device;
 
-	gcr = HpetRd32(hpet, HPET_GCR);
+	ch->Periodms = ms;
+}
 
-	if (!!(gcr & 1) == en)
+static void
+HpetChannelOn(EVENTTIMER *et)
+{
+	HPETCHANNEL *ch = et->Device;
+	HPETDEV *hpet = ch->Hpet;
+	ulong period;
+
+	if (et->Mode == ET_MODE_PERIODIC)
 	{
-		return;
+		period = TimerUsec2Period(hpet->Timer, ch->Periodms * 1000);
+
+		// with VAL_SET the first write sets the comparator, the
+		// second the period added on every match
+		HpetChannelWrConf(ch, TCONF_PERIODIC | TCONF_VAL_SET, 0);
+		HpetChannelWrComp(ch, HpetGetCounter(hpet) + period);
+		HpetChannelWrComp(ch, period);
 	}
 
-	gcr |= en ? 1 : 0;
+	HpetChannelWrConf(ch, TCONF_INT_EN, 0);
+}
 
-	HpetWr32(hpet, HPET_GCR, gcr);
+static void
+HpetChannelOff(EVENTTIMER *et)
+{
+	HPETCHANNEL *ch = et->Device;
+
+	HpetChannelWrConf(ch, 0, TCONF_INT_EN);
 }
 
-#define USEC2FSEC	1000000000
-static ulong
-HpetuSec2Period(TIMER *tm, uint usec)
+static int
+HpetChannelSetMode(EVENTTIMER *et, int mode)
 {
-	HPETDEV *hpet = tm->Device;
-	ulong fsec = (ulong)usec * USEC2FSEC;
-	ulong period = fsec / hpet->Periodfs;
+	HPETCHANNEL *ch = et->Device;
 
-	return period;
+	switch (mode)
+	{
+	case ET_MODE_OFF:
+		HpetChannelWrConf(ch, 0, TCONF_INT_EN | TCONF_PERIODIC);
+		break;
+	case ET_MODE_PERIODIC:
+		if (!(et->Features & ET_FEAT_PERIODIC))
+		{
+			return -1;
+		}
+		break;
+	case ET_MODE_ONESHOT:
+		HpetChannelWrConf(ch, 0, TCONF_PERIODIC);
+		break;
+	default:
+		return -1;
+	}
+
+	et->Mode = mode;
+
+	return 0;
 }
 
-static ulong
-HpetGetCounter(HPETDEV *hpet)
+/*
+ *  The comparator only fires on an exact match, so an expiry that is
+ *  already behind the counter once written would be lost.  Retry
+ *  further out until the write lands ahead of it.
+ */
+static int
+HpetChannelSetNextEvent(EVENTTIMER *et, ulong ns)
 {
-	return HpetRd64(hpet, HPET_MCR);
+	HPETCHANNEL *ch = et->Device;
+	HPETDEV *hpet = ch->Hpet;
+	ulong delta, cmp;
+
+	delta = MAX(TimerNs2Cycles(hpet->Timer, ns), HPET_MIN_DELTA);
+
+	for (;;)
+	{
+		cmp = HpetGetCounter(hpet) + delta;
+		HpetChannelWrComp(ch, cmp);
+
+		if ((long)(cmp - HpetGetCounter(hpet)) > 0)
+		{
+			return 0;
+		}
+
+		delta *= 2;
+	}
 }
 
-static ulong
-HpetReadCounterRaw(TIMER *tm)
+static int
+HpetChannelIrq(EVENTTIMER *et)
 {
-	return HpetGetCounter(tm->Device);
+	TimerEvent(et);
+
+	return 0;
 }
 
-static bool
-HpetIsDead(HPETDEV *hpet)
+static const EVENTTIMER hpetettemplate = {
+	.Global = true,
+	.Rating = 50,
+	.Probe = HpetChannelProbe,
+	.GetPeriod = HpetChannelGetPeriod,
+	.SetPeriod = HpetChannelSetPeriod,
+	.On = HpetChannelOn,
+	.Off = HpetChannelOff,
+	.SetMode = HpetChannelSetMode,
+	.SetNextEvent = HpetChannelSetNextEvent,
+	.IRQHandler = HpetChannelIrq,
+};
+
+/*
+ *  Register every comparator as an event timer.  Their interrupts are
+ *  off until a mode is set.
+ */
+static void INIT
+HpetChannelInit(HPETDEV *hpet)
 {
-	u64 now, after;
+	HPETCHANNEL *ch;
 
-	now = HpetGetCounter(hpet);
+	for (uint n = 0; n < hpet->nChannel; n++)
+	{
+		ch = &hpet->Channel[n];
 
-	for (int i = 0; i < 1000; i++)	// busy loop
-		;
+		ch->Hpet = hpet;
+		ch->N = n;
+		ch->Gsi = -1;
+		ch->RouteCap = HpetRd64(hpet, HPET_TCONF(n)) >> 32;
 
-	after = HpetGetCounter(hpet);
+		HpetChannelWrConf(ch, 0, TCONF_INT_EN | TCONF_PERIODIC);
 
-	return now >= after;
+		ch->Et = hpetettemplate;
+		ch->Et.Device = ch;
+		sprintf(ch->Et.Name, "%s.%d", hpet->Timer->Name, n);
+
+		NewEventTimer(&ch->Et);
+	}
+}
+
+/*
+ *  The HPET, if it probed successfully
+ */
+HPETDEV *
+HpetDevice(void)
+{
+	return hpetdev;
 }
 
 int INIT
@@ -159,9 +436,12 @@ HpetProbe(TIMER *tm)
 	clkperiod = HpetRd32(hpet, HPET_CLK_PERIOD);
 
 	hpet->Cnt64 = !!(id & (1 << 13));
-	hpet->nChannel = (id >> 8) & 0x1f;
+	hpet->nChannel = ((id >> 8) & 0x1f) + 1;
 	hpet->Periodfs = clkperiod;
 
+	TimerSetFreq(tm, 1000000000000000ul / clkperiod);
+	hpet->Timer = tm;
+
 	KLOG("%s: %d channel(s) clock period: %d ns %d bit counter\n",
 	     tm->Name, hpet->nChannel, clkperiod / 1000000, hpet->Cnt64 ? 64 : 32);
 
@@ -177,6 +457,10 @@ HpetProbe(TIMER *tm)
 		goto err;
 	}
 
+	hpetdev = hpet;
+
+	HpetChannelInit(hpet);
+
 	return 0;
 
 err:
@@ -186,9 +470,9 @@ err:
 
 static TIMER tmhpet = {
 	.Global = true,
+	.Rating = 250,
 	.Probe = HpetProbe,
 	.ReadCounterRaw = HpetReadCounterRaw,
-	.uSec2Period = HpetuSec2Period,
 };
 
 void INIT
@@ -32,6 +32,101 @@
 
 #include <akari/types.h>
 #include <akari/compiler.h>
+#include <akari/timer.h>
+
+#define HPET_MMIO_SIZE		1024
+
+#define HPET_ID			0x0
+#define HPET_CLK_PERIOD		0x4
+#define HPET_GCR		0x10
+#define HPET_GIS		0x20
+#define HPET_MCR		0xf0
+
+// comparator n
+#define HPET_TCONF(n)		(0x100 + (n) * 0x20)
+#define HPET_TCOMP(n)		(0x108 + (n) * 0x20)
+#define HPET_TFSB(n)		(0x110 + (n) * 0x20)
+
+#define TCONF_LEVEL		(1 << 1)
+#define TCONF_INT_EN		(1 << 2)
+#define TCONF_PERIODIC		(1 << 3)
+#define TCONF_PERIODIC_CAP	(1 << 4)
+#define TCONF_64BIT_CAP		(1 << 5)
+#define TCONF_VAL_SET		(1 << 6)
+#define TCONF_32BIT		(1 << 8)
+#define TCONF_ROUTE_SHIFT	9
+#define TCONF_ROUTE_MASK	(0x1f << 9)
+#define TCONF_FSB_EN		(1 << 14)
+#define TCONF_FSB_CAP		(1 << 15)
+
+#define HPET_MAX_CHANNEL	32
+
+typedef struct HPETDEV		HPETDEV;
+typedef struct HPETCHANNEL	HPETCHANNEL;
+
+/*
+ * HPET comparator, driven as an event timer
+ */
+struct HPETCHANNEL
+{
+	HPETDEV *Hpet;
+	uint N;
+	u32 RouteCap;	// IOAPIC inputs the channel can be routed to
+	int Gsi;	// IOAPIC input in use, -1 for FSB delivery
+	u32 Vector;
+	uint Periodms;
+
+	EVENTTIMER Et;
+};
+
+/*
+ * HPET Device
+ */
+struct HPETDEV
+{
+	void *Base;
+	PHYSADDR BasePa;
+	
+	bool Cnt64;
+	uint nChannel;
+	uint Periodfs;	// 10(^-15) s	
+
+	TIMER *Timer;
+	u32 RouteUsed;
+	HPETCHANNEL Channel[HPET_MAX_CHANNEL];
+};
+
+static inline void
+HpetWr32(HPETDEV *hpet, ulong offset, u32 val)
+{
+	*(volatile u32 *)(hpet->Base + offset) = val;
+}
+
+static inline u32
+HpetRd32(HPETDEV *hpet, ulong offset)
+{
+	return *(volatile u32 *)(hpet->Base + offset);
+}
+
+static inline void
+HpetWr64(HPETDEV *hpet, ulong offset, u64 val)
+{
+	*(volatile u64 *)(hpet->Base + offset) = val;
+}
+
+static inline u64
+HpetRd64(HPETDEV *hpet, ulong offset)
+{
+	return *(volatile u64 *)(hpet->Base + offset);
+}
+
+static inline ulong
+HpetGetCounter(HPETDEV *hpet)
+{
+	return HpetRd64(hpet, HPET_MCR);
+}
+
+HPETDEV *HpetDevice(void);
 
 void HpetInit(PHYSADDR baseaddr, int n) INIT;
 
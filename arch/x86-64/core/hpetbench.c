@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2024, akarilab.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// HPET comparator benchmarks
+
+#include <akari/types.h>
+#include <akari/compiler.h>
+#include <akari/bench.h>
+#include <akari/timer.h>
+#include <akari/irq.h>
+#include <akari/irqsource.h>
+
+#define KPREFIX		"bench/hpet:"
+
+#include <akari/log.h>
+
+#include "hpet.h"
+
+#define NSAMPLE		1000
+#define DELTA_USEC	100
+#define TIMEOUT_USEC	10000
+
+static HPETCHANNEL *
+IdleChannel(HPETDEV *hpet)
+{
+	for (uint n = 0; n < hpet->nChannel; n++)
+	{
+		if (hpet->Channel[n].Et.Mode == ET_MODE_OFF && hpet->Channel[n].Gsi >= 0)
+		{
+			return &hpet->Channel[n];
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ *  Arm a comparator DELTA_USEC ahead and poll its status bit: how far
+ *  the counter has run past the match when it is seen.  The channel is
+ *  switched to level triggered and its IOAPIC input is masked, so no
+ *  interrupt is taken and only the comparator itself is measured.
+ */
+static void
+HpetJitterBench(void)
+{
+	HPETDEV *hpet = HpetDevice();
+	HPETCHANNEL *ch;
+	IRQ *irq;
+	ulong delta, timeout, target, now, late;
+	ulong min = ~0ul, max = 0, sum = 0;
+	u32 conf, saved, bit;
+	int n;
+
+	if (!hpet)
+	{
+		KLOG("no HPET\n");
+		return;
+	}
+
+	ch = IdleChannel(hpet);
+	if (!ch)
+	{
+		KLOG("no idle comparator on the IOAPIC\n");
+		return;
+	}
+
+	delta = TimerUsec2Period(hpet->Timer, DELTA_USEC);
+	timeout = TimerUsec2Period(hpet->Timer, TIMEOUT_USEC);
+	bit = 1u << ch->N;
+
+	irq = ch->Et.Irq->Irq;
+	irq->Chip->Mask(irq);
+
+	saved = HpetRd32(hpet, HPET_TCONF(ch->N));
+
+	conf = saved & ~TCONF_PERIODIC;
+	conf |= TCONF_LEVEL | TCONF_INT_EN;
+
+	for (n = 0; n < NSAMPLE; n++)
+	{
+		HpetWr32(hpet, HPET_TCONF(ch->N), conf & ~TCONF_INT_EN);
+		HpetWr32(hpet, HPET_GIS, bit);
+
+		target = HpetGetCounter(hpet) + delta;
+		HpetWr64(hpet, HPET_TCOMP(ch->N), target);
+		HpetWr32(hpet, HPET_TCONF(ch->N), conf);
+
+		do
+		{
+			now = HpetGetCounter(hpet);
+		} while (!(HpetRd32(hpet, HPET_GIS) & bit) && now - target < timeout);
+
+		if (!(HpetRd32(hpet, HPET_GIS) & bit))
+		{
+			KLOG("%s: status never set\n", ch->Et.Name);
+			break;
+		}
+
+		late = TimerCycles2Ns(hpet->Timer, now - target);
+
+		min = MIN(min, late);
+		max = MAX(max, late);
+		sum += late;
+	}
+
+	HpetWr32(hpet, HPET_TCONF(ch->N), saved);
+	HpetWr32(hpet, HPET_GIS, bit);
+
+	irq->Chip->Unmask(irq);
+
+	if (n == 0)
+	{
+		return;
+	}
+
+	KLOG("%s: %d expiries %d us out, late min %lu avg %lu max %lu ns\n",
+	     ch->Et.Name, n, DELTA_USEC, min, sum / n, max);
+}
+
+DEFINE_BENCH(HpetJitter, HpetJitterBench);
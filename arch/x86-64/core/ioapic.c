@@ -29,9 +29,376 @@
 
 #include <akari/types.h>
 #include <akari/compiler.h>
+#include <akari/sysmem.h>
+#include <akari/mm.h>
+#include <akari/irq.h>
+#include <akari/irqsource.h>
+#include <akari/spinlock.h>
+#include <acpi.h>
 
+#define KPREFIX		"ioapic:"
+
+#include <akari/log.h>
+
+#include "ioapic.h"
+#include "apic/apic.h"
+
+#define IOREGSEL		0x00
+#define IOWIN			0x10
+
+#define IOAPICID		0x00
+#define IOAPICVER		0x01
+#define IOREDTBL(n)		(0x10 + (n) * 2)
+
+// redirection entry, low half
+#define REDIR_VECTOR_MASK	0xff
+#define REDIR_ACTIVE_LOW	(1 << 13)
+#define REDIR_LEVEL		(1 << 15)
+#define REDIR_MASKED		(1 << 16)
+// high half
+#define REDIR_DEST_SHIFT	24
+
+#define MAX_IOAPIC		8
+#define NISAIRQ			16
+#define MAX_GSI			256
+
+typedef struct IOAPIC	IOAPIC;
+typedef struct ISAIRQ	ISAIRQ;
+
+struct IOAPIC
+{
+	uint Id;
+	PHYSADDR BasePa;
+	void *Base;
+
+	uint GsiBase;
+	uint nPin;
+
+	// IOREGSEL and IOWIN are accessed in pairs
+	SPINLOCK Lock;
+};
+
+struct ISAIRQ
+{
+	bool Override;
+	uint Gsi;
+	uint Flags;
+};
+
+static IOAPIC ioapics[MAX_IOAPIC];
+static int nioapic;
+
+static ISAIRQ isairqs[NISAIRQ];
+
+// vector each GSI is routed to, 0 if none
+static u8 gsivector[MAX_GSI];
+
+static u32
+IoapicRead(IOAPIC *io, u32 reg)
+{
+	*(volatile u32 *)(io->Base + IOREGSEL) = reg;
+
+	return *(volatile u32 *)(io->Base + IOWIN);
+}
+
+static void
+IoapicWrite(IOAPIC *io, u32 reg, u32 val)
+{
+	*(volatile u32 *)(io->Base + IOREGSEL) = reg;
+	*(volatile u32 *)(io->Base + IOWIN) = val;
+}
+
+static IOAPIC *
+GsiIoapic(uint gsi, uint *pin)
+{
+	IOAPIC *io;
+
+	for (int i = 0; i < nioapic; i++)
+	{
+		io = &ioapics[i];
+
+		if (io->Base && gsi >= io->GsiBase && gsi < io->GsiBase + io->nPin)
+		{
+			*pin = gsi - io->GsiBase;
+			return io;
+		}
+	}
+
+	return NULL;
+}
+
+static void
+IoapicModify(IRQ *irq, u32 set, u32 clear)
+{
+	IOAPIC *io;
+	uint pin;
+	ulong flags;
+	u32 lo;
+
+	io = GsiIoapic(irq->Hwirq, &pin);
+	if (!io)
+	{
+		return;
+	}
+
+	flags = SpinLockIrqSave(&io->Lock);
+
+	lo = IoapicRead(io, IOREDTBL(pin));
+	IoapicWrite(io, IOREDTBL(pin), (lo & ~clear) | set);
+
+	SpinUnlockIrqRestore(&io->Lock, flags);
+}
+
+static int
+IoapicSetup(IRQ *irq)
+{
+	IOAPIC *io;
+	uint pin;
+	ulong flags;
+	u32 lo;
+
+	io = GsiIoapic(irq->Hwirq, &pin);
+	if (!io)
+	{
+		KWARN("no IOAPIC for GSI %d\n", irq->Hwirq);
+		return -1;
+	}
+
+	lo = irq->Irqno | REDIR_MASKED;
+
+	if (irq->Flags & IRQ_LEVEL)
+	{
+		lo |= REDIR_LEVEL;
+	}
+	if (irq->Flags & IRQ_ACTIVE_LOW)
+	{
+		lo |= REDIR_ACTIVE_LOW;
+	}
+
+	flags = SpinLockIrqSave(&io->Lock);
+
+	// physical destination, fixed delivery
+	IoapicWrite(io, IOREDTBL(pin) + 1, ApicIdOf(irq->Cpu) << REDIR_DEST_SHIFT);
+	IoapicWrite(io, IOREDTBL(pin), lo);
+
+	SpinUnlockIrqRestore(&io->Lock, flags);
+
+	gsivector[irq->Hwirq] = irq->Irqno;
+
+	KDBG("GSI %d -> vector %d cpu%d\n", irq->Hwirq, irq->Irqno, irq->Cpu);
+
+	return 0;
+}
+
+static void
+IoapicMask(IRQ *irq)
+{
+	IoapicModify(irq, REDIR_MASKED, 0);
+}
+
+static void
+IoapicUnmask(IRQ *irq)
+{
+	IoapicModify(irq, 0, REDIR_MASKED);
+}
+
+/*
+ *  Retarget the pin.  It is masked meanwhile, so the destination is
+ *  never seen half written.
+ */
+static int
+IoapicSetAffinity(IRQ *irq, int cpu)
+{
+	IOAPIC *io;
+	uint pin;
+	ulong flags;
+	u32 lo;
+
+	io = GsiIoapic(irq->Hwirq, &pin);
+	if (!io)
+	{
+		return -1;
+	}
+
+	flags = SpinLockIrqSave(&io->Lock);
+
+	lo = IoapicRead(io, IOREDTBL(pin));
+
+	IoapicWrite(io, IOREDTBL(pin), lo | REDIR_MASKED);
+	IoapicWrite(io, IOREDTBL(pin) + 1, ApicIdOf(cpu) << REDIR_DEST_SHIFT);
+	IoapicWrite(io, IOREDTBL(pin), lo);
+
+	SpinUnlockIrqRestore(&io->Lock, flags);
+
+	return 0;
+}
+
+/*
+ *  The local APIC EOI is broadcast to the IOAPICs, which also ends a
+ *  level-triggered interrupt there.
+ */
+static void
+IoapicEOI(IRQ *irq)
+{
+	ApicEOI();
+}
+
+static IRQCHIP ioapicchip = {
+	.Name = "IOAPIC",
+	.Setup = IoapicSetup,
+	.Mask = IoapicMask,
+	.Unmask = IoapicUnmask,
+	.SetAffinity = IoapicSetAffinity,
+	.EOI = IoapicEOI,
+};
+
+/*
+ *  Handle @gsi on a new vector, or share the one it already has.
+ *  @flags are IRQ_LEVEL and IRQ_ACTIVE_LOW.
+ */
+IRQSOURCE *
+IoapicNewIRQSource(void *device, int (*handler)(IRQSOURCE *), uint gsi, uint flags)
+{
+	int irqno;
+
+	if (gsi >= MAX_GSI)
+	{
+		return NULL;
+	}
+
+	irqno = gsivector[gsi] ? gsivector[gsi] : -1;
+
+	return NewChipIRQSource(device, handler, irqno, &ioapicchip, gsi, flags);
+}
+
+/*
+ *  GSI and trigger of ISA irq @isairq: identity mapped, edge and active
+ *  high unless the MADT overrides it
+ */
+uint
+IoapicIsaGsi(uint isairq, uint *flags)
+{
+	ISAIRQ *isa;
+
+	if (isairq >= NISAIRQ || !isairqs[isairq].Override)
+	{
+		*flags = 0;
+		return isairq;
+	}
+
+	isa = &isairqs[isairq];
+	*flags = isa->Flags;
+
+	return isa->Gsi;
+}
+
+/*
+ *  Whether @gsi has no handler yet and no ISA irq is overridden onto it
+ */
+bool
+IoapicGsiFree(uint gsi)
+{
+	if (gsi >= MAX_GSI || gsivector[gsi])
+	{
+		return false;
+	}
+
+	for (int i = 0; i < NISAIRQ; i++)
+	{
+		if (isairqs[i].Override && isairqs[i].Gsi == gsi)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ *  From the MADT, before IoapicInit()
+ */
+void INIT
+IoapicRegister(uint id, PHYSADDR pa, uint gsibase)
+{
+	IOAPIC *io;
+
+	if (nioapic == MAX_IOAPIC)
+	{
+		KWARN("too many IOAPICs\n");
+		return;
+	}
+
+	io = &ioapics[nioapic++];
+
+	io->Id = id;
+	io->BasePa = pa;
+	io->GsiBase = gsibase;
+
+	ReserveMem(pa, PAGESIZE);
+}
+
+/*
+ *  @flags: MADT interrupt source override flags
+ */
+void INIT
+IoapicOverride(uint isairq, uint gsi, uint flags)
+{
+	ISAIRQ *isa;
+
+	if (isairq >= NISAIRQ)
+	{
+		return;
+	}
+
+	isa = &isairqs[isairq];
+
+	isa->Override = true;
+	isa->Gsi = gsi;
+	isa->Flags = 0;
+
+	// "conforms to the bus" is edge, active high on ISA
+	if ((flags & MADT_ISO_TRIGGER_MASK) == MADT_ISO_TRIGGER_LEVEL)
+	{
+		isa->Flags |= IRQ_LEVEL;
+	}
+	if ((flags & MADT_ISO_POLARITY_MASK) == MADT_ISO_POLARITY_LOW)
+	{
+		isa->Flags |= IRQ_ACTIVE_LOW;
+	}
+
+	KLOG("ISA irq %d -> GSI %d%s%s\n", isairq, gsi,
+	     isa->Flags & IRQ_LEVEL ? " level" : "",
+	     isa->Flags & IRQ_ACTIVE_LOW ? " low" : "");
+}
+
+/*
+ *  Map the IOAPICs and mask every pin
+ */
 void INIT
-IoapicInit()
+IoapicInit(void)
 {
-	;
+	IOAPIC *io;
+	u32 ver;
+
+	for (int i = 0; i < nioapic; i++)
+	{
+		io = &ioapics[i];
+
+		io->Base = KIOmap(io->BasePa, PAGESIZE);
+		if (!io->Base)
+		{
+			KWARN("IOAPIC%d: cannot map\n", io->Id);
+			continue;
+		}
+
+		ver = IoapicRead(io, IOAPICVER);
+		io->nPin = ((ver >> 16) & 0xff) + 1;
+
+		for (uint pin = 0; pin < io->nPin; pin++)
+		{
+			IoapicWrite(io, IOREDTBL(pin), REDIR_MASKED);
+		}
+
+		KLOG("IOAPIC%d: GSI %d-%d\n", io->Id, io->GsiBase, io->GsiBase + io->nPin - 1);
+	}
 }
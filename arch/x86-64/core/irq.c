@@ -30,11 +30,15 @@
 #include <akari/types.h>
 #include <akari/compiler.h>
 #include <akari/irq.h>
+#include <akari/panic.h>
+#include <akari/softirq.h>
 #include <arch/irq.h>
 
 #include "apic/apic.h"
 #include "pic-8259a.h"
+#include "ioapic.h"
 #include "trap.h"
+#include "irqlat.h"
 
 #define KPREFIX		"x86/irq:"
 
@@ -47,16 +51,33 @@ ArchIrqInit(void)
 
 	// Init LocalAPIC
 	ApicInit0();
+
+	IoapicInit();
 }
 
-int
-X86Interrupt(X86TRAPFRAME *tf)
+/*
+ *  Called from IrqHandler with interrupts off
+ */
+void
+X86Interrupt(X86IRQFRAME *f)
 {
-	int irqno;
+	int irqno = f->Vector;
+	u64 start, end;
+
+	// not a real interrupt and must not be acknowledged
+	if (irqno == APIC_SPURIOUS_VECTOR)
+	{
+		return;
+	}
 
-	irqno = tf->Trapno;
+	start = IrqLatStamp();
+	if (HandleGenericIRQ(irqno))
+	{
+		Panic("unknown interrupt");
+	}
+	end = IrqLatStamp();
 
-	KDBG("IRQ from %d\n", irqno);
+	IrqLatRecord(f, start, end);
 
-	return HandleGenericIRQ(irqno);
+	IrqExit();
 }
@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2024, akarilab.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Interrupt entry and handler latency, per vector and per CPU
+
+#include <akari/types.h>
+#include <akari/compiler.h>
+#include <akari/cpu.h>
+
+#include <arch/cpu.h>
+
+#include "irqlat.h"
+#include "trap.h"
+#include "tsc.h"
+
+#define KPREFIX		"irqlat:"
+
+#include <akari/log.h>
+
+static IRQLATREC irqlat[NR_INTERRUPT] PERCPU;
+
+static const char *kindname[IRQLAT_NKIND] = {
+	[IRQLAT_ENTRY] = "entry",
+	[IRQLAT_HANDLER] = "handler",
+	[IRQLAT_TOTAL] = "total",
+};
+
+static inline int
+HistBucket(u64 cycles)
+{
+	int b;
+
+	if (cycles == 0)
+	{
+		return 0;
+	}
+
+	b = 63 - __builtin_clzl(cycles) - IRQLAT_HIST_SHIFT;
+	if (b < 0)
+	{
+		return 0;
+	}
+	if (b >= IRQLAT_NHIST)
+	{
+		return IRQLAT_NHIST - 1;
+	}
+
+	return b;
+}
+
+static inline void
+Sample(IRQLATREC *l, int kind, u64 cycles, ulong rip)
+{
+	l->Hist[kind][HistBucket(cycles)]++;
+
+	if (cycles > l->Worst[kind].Cycles)
+	{
+		l->Worst[kind].Cycles = cycles;
+		l->Worst[kind].Rip = rip;
+	}
+}
+
+/*
+ *  @start and @end bracket the handlers, the entry stamp was taken by
+ *  IrqHandler.  Called with interrupts off.
+ */
+void
+IrqLatRecord(X86IRQFRAME *f, u64 start, u64 end)
+{
+	IRQLATREC *l = &MYCPU(irqlat)[f->Vector];
+	u64 now = Rdtsc();
+
+	l->n++;
+
+	Sample(l, IRQLAT_ENTRY, start - f->Tsc, f->Rip);
+	Sample(l, IRQLAT_HANDLER, end - start, f->Rip);
+	Sample(l, IRQLAT_TOTAL, now - f->Tsc, f->Rip);
+}
+
+static ulong
+Cycles2Ns(u64 cycles)
+{
+	ulong khz = TscKhz();
+
+	return khz ? cycles * 1000000 / khz : 0;
+}
+
+void
+IrqLatReport(int cpu)
+{
+	IRQLATREC *l;
+	u32 *hist;
+
+	for (int v = 0; v < NR_INTERRUPT; v++)
+	{
+		l = &CPU_VAR(irqlat, cpu)[v];
+		if (!l->n)
+		{
+			continue;
+		}
+
+		KLOG("cpu%d vector %d: %lu interrupts\n", cpu, v, l->n);
+
+		for (int k = 0; k < IRQLAT_NKIND; k++)
+		{
+			KLOG("  %s: worst %lu cycles (%lu ns) at %p\n", kindname[k],
+			     l->Worst[k].Cycles, Cycles2Ns(l->Worst[k].Cycles),
+			     l->Worst[k].Rip);
+
+			hist = l->Hist[k];
+
+			for (int i = 0; i < IRQLAT_NHIST; i++)
+			{
+				if (hist[i])
+				{
+					KLOG("    < %lu cycles: %u\n",
+					     1ul << (i + IRQLAT_HIST_SHIFT + 1), hist[i]);
+				}
+			}
+		}
+	}
+}
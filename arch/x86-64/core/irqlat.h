@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2024, akarilab.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _X86_CORE_IRQLAT_H
+#define _X86_CORE_IRQLAT_H
+
+#include <akari/types.h>
+#include <akari/compiler.h>
+#include <arch/asm.h>
+
+#include "trap.h"
+
+#ifdef IRQLAT
+
+#define IRQLAT_ENTRY		0	// IrqHandler entry to the handlers
+#define IRQLAT_HANDLER		1	// handlers and EOI
+#define IRQLAT_TOTAL		2	// IrqHandler entry to softirqs
+#define IRQLAT_NKIND		3
+
+// bucket 0 counts < 128 cycles, bucket i [2^(i+6), 2^(i+7)), the last also beyond
+#define IRQLAT_NHIST		16
+#define IRQLAT_HIST_SHIFT	6
+
+typedef struct IRQLATREC	IRQLATREC;
+typedef struct IRQLATSAMPLE	IRQLATSAMPLE;
+
+struct IRQLATSAMPLE
+{
+	u64 Cycles;
+	ulong Rip;		// where the interrupt came in
+};
+
+/*
+ *  Per vector, per CPU latency record
+ */
+struct IRQLATREC
+{
+	ulong n;
+	u32 Hist[IRQLAT_NKIND][IRQLAT_NHIST];
+	IRQLATSAMPLE Worst[IRQLAT_NKIND];
+};
+
+void IrqLatRecord(X86IRQFRAME *f, u64 start, u64 end);
+void IrqLatReport(int cpu);
+
+static inline u64
+IrqLatStamp(void)
+{
+	return Rdtsc();
+}
+
+#else
+
+static inline void
+IrqLatRecord(X86IRQFRAME *f, u64 start, u64 end)
+{
+	;
+}
+
+static inline void
+IrqLatReport(int cpu)
+{
+	;
+}
+
+static inline u64
+IrqLatStamp(void)
+{
+	return 0;
+}
+
+#endif	// IRQLAT
+
+#endif	// _X86_CORE_IRQLAT_H
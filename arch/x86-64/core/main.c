@@ -47,6 +47,9 @@
 #include "multiboot.h"
 #include "mm.h"
 #include "trap.h"
+#include "tsc.h"
+#include "smp.h"
+#include "apic/apic.h"
 
 static void *xsdp = NULL;
 static void *rsdp = NULL;
@@ -161,18 +164,33 @@ x86Main(MULTIBOOT_INFO *mb)
 
 	AcpiInit();
 
+	// calibrated against HPET when the timers are probed
+	TscInit();
+
 	TrapInit();
 
 	KernelMain();
 	/* Never Return Here */
 }
 
-// ap main
-void NORETURN
+// ap main, entered from the trampoline on its own stack
+void NORETURN INIT
 X86MainAp(void)
 {
-	for (;;)
-	{
-		HLT;
-	}
+	X86mmInitAp();
+
+	GdtInit();
+
+	TrapInitAp();
+
+	// waits for its turn: the boot CPU finishes one AP at a time
+	SmpApEnter();
+
+	ApicInitAp();
+
+	TscInit();
+	TscSyncTarget();
+
+	ApMain();
+	/* Never Return Here */
 }
@@ -34,6 +34,7 @@
 #include <akari/kalloc.h>
 #include <arch/mm.h>
 #include <arch/memlayout.h>
+#include <arch/asm.h>
 #include <msr.h>
 
 #include "mm.h"
@@ -59,6 +60,34 @@ ArchSwitchVas(VAS *vas)
 	asm volatile ("mov %0, %%cr3" :: "r"(pgtpa));
 }
 
+/*
+ *  The kernel half is shared by every pgdir, so kernel mappings must be
+ *  flushed whichever address space is loaded.
+ */
+static bool
+VasLoaded(VAS *vas)
+{
+	return !vas->User || (Cr3() & PTE_PA_MASK) == V2P(vas->Pgdir);
+}
+
+void
+ArchFlushTlb(VAS *vas)
+{
+	if (VasLoaded(vas))
+	{
+		asm volatile ("mov %0, %%cr3" :: "r"(Cr3()) : "memory");
+	}
+}
+
+void
+ArchFlushTlbPage(VAS *vas, ulong va)
+{
+	if (VasLoaded(vas))
+	{
+		Invlpg(va);
+	}
+}
+
 void
 ArchInitKvas(VAS *kvas)
 {
@@ -67,12 +96,42 @@ ArchInitKvas(VAS *kvas)
 	kvas->LowestLevel = 1;
 }
 
+void
+ArchInitUvas(VAS *uvas)
+{
+	uvas->Level = 4;
+	uvas->LowestLevel = 1;
+}
+
 void INIT
 X86mmInit(void)
 {
 	u32 efer = Rdmsr32(IA32_EFER);
 
 	x86nxe = !!(efer & IA32_EFER_NXE);
+
+	// Honour read-only mappings in kernel mode too (needed for copy-on-write)
+	SetCr0(Cr0() | CR0_WP);
+}
+
+void INIT
+X86mmInitAp(void)
+{
+	asm volatile ("mov %0, %%cr3" :: "r"(V2P(kpml4)));
+
+	SetCr0(Cr0() | CR0_WP);
+}
+
+/*
+ *  The boot page table of the APs shares the kernel half of kpml4
+ */
+void INIT
+X86mmApPgdir(PTE *pml4)
+{
+	for (int i = PIDX(4, PAGE_OFFSET); i < 512; i++)
+	{
+		pml4[i] = kpml4[i];
+	}
 }
 
 void INIT
@@ -40,6 +40,8 @@
 
 void KillIdmap(void) INIT;
 void X86mmInit(void) INIT;
+void X86mmInitAp(void) INIT;
+void X86mmApPgdir(PTE *pml4) INIT;
 
 #endif	// __ASSEMBLER__
 
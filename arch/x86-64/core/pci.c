@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2024, akarilab.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <akari/types.h>
+#include <akari/compiler.h>
+#include <akari/pci.h>
+#include <akari/spinlock.h>
+#include <arch/asm.h>
+
+#define PCI_CONFIG_ADDRESS	0xcf8
+#define PCI_CONFIG_DATA		0xcfc
+
+// the address and data ports are used in pairs
+static SPINLOCK pcilock = SPINLOCK_INIT;
+
+static inline u32
+PciConfAddr(uint bus, uint dev, uint func, uint off)
+{
+	return 0x80000000 | (bus << 16) | (dev << 11) | (func << 8) | (off & 0xfc);
+}
+
+/*
+ *  Configuration mechanism #1
+ */
+u32
+ArchPciRead32(uint bus, uint dev, uint func, uint off)
+{
+	ulong flags;
+	u32 val;
+
+	flags = SpinLockIrqSave(&pcilock);
+
+	outl(PCI_CONFIG_ADDRESS, PciConfAddr(bus, dev, func, off));
+	val = inl(PCI_CONFIG_DATA);
+
+	SpinUnlockIrqRestore(&pcilock, flags);
+
+	return val;
+}
+
+void
+ArchPciWrite32(uint bus, uint dev, uint func, uint off, u32 val)
+{
+	ulong flags;
+
+	flags = SpinLockIrqSave(&pcilock);
+
+	outl(PCI_CONFIG_ADDRESS, PciConfAddr(bus, dev, func, off));
+	outl(PCI_CONFIG_DATA, val);
+
+	SpinUnlockIrqRestore(&pcilock, flags);
+}
@@ -0,0 +1,398 @@
+/*
+ * Copyright (c) 2024, akarilab.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <akari/types.h>
+#include <akari/compiler.h>
+#include <akari/string.h>
+#include <akari/kalloc.h>
+#include <akari/timer.h>
+#include <akari/atomic.h>
+#include <akari/cpu.h>
+#include <arch/memlayout.h>
+#include <arch/mm.h>
+#include <arch/asm.h>
+#include <arch/cpu.h>
+
+#define KPREFIX		"x86/smp:"
+
+#include <akari/log.h>
+#include <cpuid.h>
+#include <msr.h>
+
+#include "apic/apic.h"
+#include "mm.h"
+#include "tsc.h"
+#include "smp.h"
+
+typedef struct SMPCPU	SMPCPU;
+
+struct SMPCPU
+{
+	u32 ApicId;
+	volatile bool Alive;	// in long mode on its percpu data
+
+	// since the first INIT, as seen by the boot CPU
+	ulong AliveNs;
+	ulong OnlineNs;
+};
+
+// enabled processors of the MADT; the boot CPU is cpu 0
+static SMPCPU cputable[NCPU];
+static int ncpu;
+
+// the AP allowed to finish its bringup
+static volatile int apturn = -1;
+
+extern char ap_trampoline[], ap_trampoline_end[];
+extern char ap_ticket[], ap_nstacks[], ap_efer[], ap_stacks[];
+
+/*
+ *  @sym of the trampoline, in its copy at AP_TRAMPOLINE_PA
+ */
+static inline void *
+TrampVar(char *sym)
+{
+	return P2V(AP_TRAMPOLINE_PA) + (sym - ap_trampoline);
+}
+
+/*
+ *  APIC ID of this CPU, readable before its local APIC is set up.
+ *  Leaf 0xb has the full x2APIC ID.
+ */
+static u32
+CpuidApicId(void)
+{
+	u32 max, a, b, c, d;
+
+	Cpuid(CPUID_0, &max, &b, &c, &d);
+
+	if (max >= CPUID_B)
+	{
+		CpuidCount(CPUID_B, 0, &a, &b, &c, &d);
+
+		if (b)
+		{
+			return d;
+		}
+	}
+
+	Cpuid(CPUID_1, &a, &b, &c, &d);
+
+	return b >> 24;
+}
+
+static int
+SmpCpuIndex(u32 apicid)
+{
+	for (int i = 0; i < ncpu; i++)
+	{
+		if (cputable[i].ApicId == apicid)
+		{
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ *  Called for each enabled processor of the MADT.  A processor may be
+ *  listed by both its local APIC and local x2APIC entry.
+ */
+void INIT
+SmpAddCpu(u32 apicid)
+{
+	if (ncpu == 0)
+	{
+		cputable[0].ApicId = CpuidApicId();
+		cputable[0].Alive = true;
+		ncpu = 1;
+	}
+
+	if (SmpCpuIndex(apicid) >= 0)
+	{
+		return;
+	}
+
+	if (ncpu == NCPU)
+	{
+		KWARN("apic %u: more than %d cpus\n", apicid, NCPU);
+		return;
+	}
+
+	cputable[ncpu++].ApicId = apicid;
+}
+
+/*
+ *  Copy the trampoline down with its page table and the AP stacks.
+ *  The page table maps the first 2MiB 1:1 for the switch to long mode
+ *  and shares the kernel half of the kernel pgdir.
+ */
+static int INIT
+SmpSetupTrampoline(void)
+{
+	PTE *pml4 = P2V(AP_PML4_PA);
+	PTE *pdpt = P2V(AP_PDPT_PA);
+	PTE *pd = P2V(AP_PD_PA);
+	ulong *stacks = TrampVar(ap_stacks);
+	void *stack;
+	int n;
+
+	memcpy(P2V(AP_TRAMPOLINE_PA), ap_trampoline, ap_trampoline_end - ap_trampoline);
+
+	memset(pml4, 0, PAGESIZE);
+	memset(pdpt, 0, PAGESIZE);
+	memset(pd, 0, PAGESIZE);
+
+	pml4[0] = AP_PDPT_PA | PTE_P | PTE_W;
+	pdpt[0] = AP_PD_PA | PTE_P | PTE_W;
+	pd[0] = 0 | PTE_PS | PTE_P | PTE_W;
+
+	X86mmApPgdir(pml4);
+
+	for (n = 0; n < MIN(ncpu - 1, AP_NSTACKS); n++)
+	{
+		stack = AllocZeroPagesVa(AP_STACK_ORDER);
+		if (!stack)
+		{
+			break;
+		}
+
+		stacks[n] = (ulong)stack + (PAGESIZE << AP_STACK_ORDER);
+	}
+
+	*(u32 *)TrampVar(ap_ticket) = 0;
+	*(u32 *)TrampVar(ap_nstacks) = n;
+	*(u32 *)TrampVar(ap_efer) = Rdmsr32(IA32_EFER) &
+				    (IA32_EFER_LME | IA32_EFER_NXE | IA32_EFER_SCE);
+
+	return n;
+}
+
+/*
+ *  Whether @deadline, taken as KtimeGetNs() plus a timeout, passed at
+ *  @now.  Without a clock both are 0 plus the timeout, which is then
+ *  counted in wait loop iterations of roughly AP_SPIN_NS.
+ */
+static bool INIT
+SmpExpired(ulong now, ulong deadline, ulong *spins)
+{
+	if (now)
+	{
+		return now >= deadline;
+	}
+
+	return ++*spins * AP_SPIN_NS >= deadline;
+}
+
+/*
+ *  Stamp the APs that checked in since the last look, until all of them
+ *  did or @deadline passes.  Returns how many are still missing.
+ */
+static int INIT
+SmpWaitAlive(ulong t0, ulong deadline)
+{
+	SMPCPU *c;
+	ulong now, spins = 0;
+	int left;
+
+	for (;;)
+	{
+		now = KtimeGetNs();
+		left = 0;
+
+		for (int i = 1; i < ncpu; i++)
+		{
+			c = &cputable[i];
+
+			if (!AtomicLoad(&c->Alive))
+			{
+				left++;
+			}
+			else if (!c->AliveNs)
+			{
+				c->AliveNs = now - t0;
+			}
+		}
+
+		if (!left || SmpExpired(now, deadline, &spins))
+		{
+			return left;
+		}
+
+		ArchCpuRelax();
+	}
+}
+
+/*
+ *  Wait for @cpu to finish its bringup, until @deadline passes
+ */
+static bool INIT
+SmpWaitOnline(int cpu, ulong deadline)
+{
+	ulong spins = 0;
+
+	while (!CpuOnline(cpu))
+	{
+		if (SmpExpired(KtimeGetNs(), deadline, &spins))
+		{
+			return false;
+		}
+
+		ArchCpuRelax();
+	}
+
+	return true;
+}
+
+/*
+ *  Give up on @cpu, stuck somewhere in its bringup.  INIT parks it in
+ *  wait-for-SIPI, where it no longer touches the handshakes.
+ */
+static void INIT
+SmpStopCpu(int cpu)
+{
+	SMPCPU *c = &cputable[cpu];
+
+	ApicSendInit(c->ApicId);
+
+	AtomicFetchAnd(&CpuOnlineMask, ~(1ul << cpu));
+	TscSyncReset();
+
+	KWARN("cpu%d (apic %u) did not come online\n", cpu, c->ApicId);
+}
+
+/*
+ *  Start all APs.  INIT and the two SIPIs go to every AP in one round,
+ *  so the delays they need are paid once rather than per AP.  The rest
+ *  of the bringup is taken one AP at a time: the allocator is not
+ *  locked, and the TSC warp test pairs the boot CPU with a single AP.
+ */
+void INIT
+ArchStartCpus(void)
+{
+	SMPCPU *c;
+	ulong t0;
+	int nstack, up = 1;
+
+	if (ncpu <= 1)
+	{
+		return;
+	}
+
+	nstack = SmpSetupTrampoline();
+	if (nstack < ncpu - 1)
+	{
+		KWARN("stacks for %d of %d APs\n", nstack, ncpu - 1);
+		ncpu = nstack + 1;
+	}
+
+	t0 = KtimeGetNs();
+
+	for (int i = 1; i < ncpu; i++)
+	{
+		ApicSendInit(cputable[i].ApicId);
+	}
+
+	mSleep(AP_INIT_DELAY_MS);
+
+	for (int i = 1; i < ncpu; i++)
+	{
+		ApicSendStartup(cputable[i].ApicId, AP_TRAMPOLINE_PA);
+	}
+
+	SmpWaitAlive(t0, KtimeGetNs() + AP_SIPI_DELAY_US * 1000ul);
+
+	// the second SIPI only for those the first one missed
+	for (int i = 1; i < ncpu; i++)
+	{
+		if (!AtomicLoad(&cputable[i].Alive))
+		{
+			ApicSendStartup(cputable[i].ApicId, AP_TRAMPOLINE_PA);
+		}
+	}
+
+	SmpWaitAlive(t0, KtimeGetNs() + AP_START_TIMEOUT_MS * 1000000ul);
+
+	for (int i = 1; i < ncpu; i++)
+	{
+		c = &cputable[i];
+
+		if (!AtomicLoad(&c->Alive))
+		{
+			KWARN("cpu%d (apic %u) did not start\n", i, c->ApicId);
+			continue;
+		}
+
+		AtomicStore(&apturn, i);
+
+		if (TscSyncSource(i) < 0 ||
+		    !SmpWaitOnline(i, KtimeGetNs() + AP_ONLINE_TIMEOUT_MS * 1000000ul))
+		{
+			SmpStopCpu(i);
+			continue;
+		}
+
+		c->OnlineNs = KtimeGetNs() - t0;
+		up++;
+
+		KLOG("cpu%d (apic %u): alive at %lu us, online at %lu us\n",
+		     i, c->ApicId, c->AliveNs / 1000, c->OnlineNs / 1000);
+	}
+
+	KLOG("%d/%d cpus online in %lu us\n", up, ncpu, (KtimeGetNs() - t0) / 1000);
+}
+
+/*
+ *  Called by an AP on its own stack once its GDT and IDT are loaded.
+ *  Sets up its percpu data, reports it is alive and waits for its turn.
+ */
+void INIT
+SmpApEnter(void)
+{
+	int cpu = SmpCpuIndex(CpuidApicId());
+
+	if (cpu <= 0)
+	{
+		// not one we started, and without percpu data to complain with
+		for (;;)
+		{
+			HLT;
+		}
+	}
+
+	PerCpuSetup(cpu);
+
+	AtomicStore(&cputable[cpu].Alive, true);
+
+	while (AtomicLoad(&apturn) != cpu)
+	{
+		ArchCpuRelax();
+	}
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2024, akarilab.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _X86_CORE_SMP_H
+#define _X86_CORE_SMP_H
+
+#include <akari/cpu.h>
+
+/*
+ *  AP bringup lives in the reserved first 1MB: the SIPI vector is a
+ *  page number below it, and CR3 is loaded before long mode.
+ */
+#define AP_TRAMPOLINE_PA	0x8000
+#define AP_PML4_PA		0x9000
+#define AP_PDPT_PA		0xa000
+#define AP_PD_PA		0xb000
+
+#define AP_STACK_ORDER		2	// 16KiB
+#define AP_NSTACKS		(NCPU - 1)	// less the boot CPU
+
+#define AP_INIT_DELAY_MS	10
+#define AP_SIPI_DELAY_US	200
+#define AP_START_TIMEOUT_MS	100
+#define AP_ONLINE_TIMEOUT_MS	100
+
+// per wait loop iteration, when there is no clock to read
+#define AP_SPIN_NS		100
+
+#ifndef __ASSEMBLER__
+
+#include <akari/types.h>
+#include <akari/compiler.h>
+
+void SmpAddCpu(u32 apicid) INIT;
+void SmpApEnter(void) INIT;
+
+#endif	// __ASSEMBLER__
+
+#endif	// _X86_CORE_SMP_H
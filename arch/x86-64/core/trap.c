@@ -65,6 +65,16 @@ extern ulong AllVectors[];
 		" 	jmp TrapHandler \n"	\
 	)
 
+// device interrupt, see IrqHandler
+#define IRQVECTOR(_n)	\
+	void __vector ## _n ## _(void);	\
+	asm (	\
+		".align 4 \n"		\
+		"__vector" #_n "_: \n"	\
+		"	pushq $" #_n "\n"	\
+		" 	jmp IrqHandler \n"	\
+	)
+
 VECTOR(0x00); VECTOR(0x01); VECTOR(0x02); VECTOR(0x03);
 VECTOR(0x04); VECTOR(0x05); VECTOR(0x06); VECTOR(0x07);
 VECTORERR(0x08); VECTOR(0x09); VECTORERR(0x0a); VECTORERR(0x0b);
@@ -73,65 +83,66 @@ VECTOR(0x10); VECTORERR(0x11); VECTOR(0x12); VECTOR(0x13);
 VECTOR(0x14); VECTORERR(0x15); VECTOR(0x16); VECTOR(0x17);
 VECTOR(0x18); VECTOR(0x19); VECTOR(0x1a); VECTOR(0x1b);
 VECTOR(0x1c); VECTORERR(0x1d); VECTORERR(0x1e); VECTOR(0x1f);
-VECTOR(0x20); VECTOR(0x21); VECTOR(0x22); VECTOR(0x23);
-VECTOR(0x24); VECTOR(0x25); VECTOR(0x26); VECTOR(0x27);
-VECTOR(0x28); VECTOR(0x29); VECTOR(0x2a); VECTOR(0x2b);
-VECTOR(0x2c); VECTOR(0x2d); VECTOR(0x2e); VECTOR(0x2f);
-VECTOR(0x30); VECTOR(0x31); VECTOR(0x32); VECTOR(0x33);
-VECTOR(0x34); VECTOR(0x35); VECTOR(0x36); VECTOR(0x37);
-VECTOR(0x38); VECTOR(0x39); VECTOR(0x3a); VECTOR(0x3b);
-VECTOR(0x3c); VECTOR(0x3d); VECTOR(0x3e); VECTOR(0x3f);
-VECTOR(0x40); VECTOR(0x41); VECTOR(0x42); VECTOR(0x43);
-VECTOR(0x44); VECTOR(0x45); VECTOR(0x46); VECTOR(0x47);
-VECTOR(0x48); VECTOR(0x49); VECTOR(0x4a); VECTOR(0x4b);
-VECTOR(0x4c); VECTOR(0x4d); VECTOR(0x4e); VECTOR(0x4f);
-VECTOR(0x50); VECTOR(0x51); VECTOR(0x52); VECTOR(0x53);
-VECTOR(0x54); VECTOR(0x55); VECTOR(0x56); VECTOR(0x57);
-VECTOR(0x58); VECTOR(0x59); VECTOR(0x5a); VECTOR(0x5b);
-VECTOR(0x5c); VECTOR(0x5d); VECTOR(0x5e); VECTOR(0x5f);
-VECTOR(0x60); VECTOR(0x61); VECTOR(0x62); VECTOR(0x63);
-VECTOR(0x64); VECTOR(0x65); VECTOR(0x66); VECTOR(0x67);
-VECTOR(0x68); VECTOR(0x69); VECTOR(0x6a); VECTOR(0x6b);
-VECTOR(0x6c); VECTOR(0x6d); VECTOR(0x6e); VECTOR(0x6f);
-VECTOR(0x70); VECTOR(0x71); VECTOR(0x72); VECTOR(0x73);
-VECTOR(0x74); VECTOR(0x75); VECTOR(0x76); VECTOR(0x77);
-VECTOR(0x78); VECTOR(0x79); VECTOR(0x7a); VECTOR(0x7b);
-VECTOR(0x7c); VECTOR(0x7d); VECTOR(0x7e); VECTOR(0x7f);
-VECTOR(0x80); VECTOR(0x81); VECTOR(0x82); VECTOR(0x83);
-VECTOR(0x84); VECTOR(0x85); VECTOR(0x86); VECTOR(0x87);
-VECTOR(0x88); VECTOR(0x89); VECTOR(0x8a); VECTOR(0x8b);
-VECTOR(0x8c); VECTOR(0x8d); VECTOR(0x8e); VECTOR(0x8f);
-VECTOR(0x90); VECTOR(0x91); VECTOR(0x92); VECTOR(0x93);
-VECTOR(0x94); VECTOR(0x95); VECTOR(0x96); VECTOR(0x97);
-VECTOR(0x98); VECTOR(0x99); VECTOR(0x9a); VECTOR(0x9b);
-VECTOR(0x9c); VECTOR(0x9d); VECTOR(0x9e); VECTOR(0x9f);
-VECTOR(0xa0); VECTOR(0xa1); VECTOR(0xa2); VECTOR(0xa3);
-VECTOR(0xa4); VECTOR(0xa5); VECTOR(0xa6); VECTOR(0xa7);
-VECTOR(0xa8); VECTOR(0xa9); VECTOR(0xaa); VECTOR(0xab);
-VECTOR(0xac); VECTOR(0xad); VECTOR(0xae); VECTOR(0xaf);
-VECTOR(0xb0); VECTOR(0xb1); VECTOR(0xb2); VECTOR(0xb3);
-VECTOR(0xb4); VECTOR(0xb5); VECTOR(0xb6); VECTOR(0xb7);
-VECTOR(0xb8); VECTOR(0xb9); VECTOR(0xba); VECTOR(0xbb);
-VECTOR(0xbc); VECTOR(0xbd); VECTOR(0xbe); VECTOR(0xbf);
-VECTOR(0xc0); VECTOR(0xc1); VECTOR(0xc2); VECTOR(0xc3);
-VECTOR(0xc4); VECTOR(0xc5); VECTOR(0xc6); VECTOR(0xc7);
-VECTOR(0xc8); VECTOR(0xc9); VECTOR(0xca); VECTOR(0xcb);
-VECTOR(0xcc); VECTOR(0xcd); VECTOR(0xce); VECTOR(0xcf);
-VECTOR(0xd0); VECTOR(0xd1); VECTOR(0xd2); VECTOR(0xd3);
-VECTOR(0xd4); VECTOR(0xd5); VECTOR(0xd6); VECTOR(0xd7);
-VECTOR(0xd8); VECTOR(0xd9); VECTOR(0xda); VECTOR(0xdb);
-VECTOR(0xdc); VECTOR(0xdd); VECTOR(0xde); VECTOR(0xdf);
-VECTOR(0xe0); VECTOR(0xe1); VECTOR(0xe2); VECTOR(0xe3);
-VECTOR(0xe4); VECTOR(0xe5); VECTOR(0xe6); VECTOR(0xe7);
-VECTOR(0xe8); VECTOR(0xe9); VECTOR(0xea); VECTOR(0xeb);
-VECTOR(0xec); VECTOR(0xed); VECTOR(0xee); VECTOR(0xef);
-VECTOR(0xf0); VECTOR(0xf1); VECTOR(0xf2); VECTOR(0xf3);
-VECTOR(0xf4); VECTOR(0xf5); VECTOR(0xf6); VECTOR(0xf7);
-VECTOR(0xf8); VECTOR(0xf9); VECTOR(0xfa); VECTOR(0xfb);
-VECTOR(0xfc); VECTOR(0xfd); VECTOR(0xfe); VECTOR(0xff);
+IRQVECTOR(0x20); IRQVECTOR(0x21); IRQVECTOR(0x22); IRQVECTOR(0x23);
+IRQVECTOR(0x24); IRQVECTOR(0x25); IRQVECTOR(0x26); IRQVECTOR(0x27);
+IRQVECTOR(0x28); IRQVECTOR(0x29); IRQVECTOR(0x2a); IRQVECTOR(0x2b);
+IRQVECTOR(0x2c); IRQVECTOR(0x2d); IRQVECTOR(0x2e); IRQVECTOR(0x2f);
+IRQVECTOR(0x30); IRQVECTOR(0x31); IRQVECTOR(0x32); IRQVECTOR(0x33);
+IRQVECTOR(0x34); IRQVECTOR(0x35); IRQVECTOR(0x36); IRQVECTOR(0x37);
+IRQVECTOR(0x38); IRQVECTOR(0x39); IRQVECTOR(0x3a); IRQVECTOR(0x3b);
+IRQVECTOR(0x3c); IRQVECTOR(0x3d); IRQVECTOR(0x3e); IRQVECTOR(0x3f);
+IRQVECTOR(0x40); IRQVECTOR(0x41); IRQVECTOR(0x42); IRQVECTOR(0x43);
+IRQVECTOR(0x44); IRQVECTOR(0x45); IRQVECTOR(0x46); IRQVECTOR(0x47);
+IRQVECTOR(0x48); IRQVECTOR(0x49); IRQVECTOR(0x4a); IRQVECTOR(0x4b);
+IRQVECTOR(0x4c); IRQVECTOR(0x4d); IRQVECTOR(0x4e); IRQVECTOR(0x4f);
+IRQVECTOR(0x50); IRQVECTOR(0x51); IRQVECTOR(0x52); IRQVECTOR(0x53);
+IRQVECTOR(0x54); IRQVECTOR(0x55); IRQVECTOR(0x56); IRQVECTOR(0x57);
+IRQVECTOR(0x58); IRQVECTOR(0x59); IRQVECTOR(0x5a); IRQVECTOR(0x5b);
+IRQVECTOR(0x5c); IRQVECTOR(0x5d); IRQVECTOR(0x5e); IRQVECTOR(0x5f);
+IRQVECTOR(0x60); IRQVECTOR(0x61); IRQVECTOR(0x62); IRQVECTOR(0x63);
+IRQVECTOR(0x64); IRQVECTOR(0x65); IRQVECTOR(0x66); IRQVECTOR(0x67);
+IRQVECTOR(0x68); IRQVECTOR(0x69); IRQVECTOR(0x6a); IRQVECTOR(0x6b);
+IRQVECTOR(0x6c); IRQVECTOR(0x6d); IRQVECTOR(0x6e); IRQVECTOR(0x6f);
+IRQVECTOR(0x70); IRQVECTOR(0x71); IRQVECTOR(0x72); IRQVECTOR(0x73);
+IRQVECTOR(0x74); IRQVECTOR(0x75); IRQVECTOR(0x76); IRQVECTOR(0x77);
+IRQVECTOR(0x78); IRQVECTOR(0x79); IRQVECTOR(0x7a); IRQVECTOR(0x7b);
+IRQVECTOR(0x7c); IRQVECTOR(0x7d); IRQVECTOR(0x7e); IRQVECTOR(0x7f);
+IRQVECTOR(0x80); IRQVECTOR(0x81); IRQVECTOR(0x82); IRQVECTOR(0x83);
+IRQVECTOR(0x84); IRQVECTOR(0x85); IRQVECTOR(0x86); IRQVECTOR(0x87);
+IRQVECTOR(0x88); IRQVECTOR(0x89); IRQVECTOR(0x8a); IRQVECTOR(0x8b);
+IRQVECTOR(0x8c); IRQVECTOR(0x8d); IRQVECTOR(0x8e); IRQVECTOR(0x8f);
+IRQVECTOR(0x90); IRQVECTOR(0x91); IRQVECTOR(0x92); IRQVECTOR(0x93);
+IRQVECTOR(0x94); IRQVECTOR(0x95); IRQVECTOR(0x96); IRQVECTOR(0x97);
+IRQVECTOR(0x98); IRQVECTOR(0x99); IRQVECTOR(0x9a); IRQVECTOR(0x9b);
+IRQVECTOR(0x9c); IRQVECTOR(0x9d); IRQVECTOR(0x9e); IRQVECTOR(0x9f);
+IRQVECTOR(0xa0); IRQVECTOR(0xa1); IRQVECTOR(0xa2); IRQVECTOR(0xa3);
+IRQVECTOR(0xa4); IRQVECTOR(0xa5); IRQVECTOR(0xa6); IRQVECTOR(0xa7);
+IRQVECTOR(0xa8); IRQVECTOR(0xa9); IRQVECTOR(0xaa); IRQVECTOR(0xab);
+IRQVECTOR(0xac); IRQVECTOR(0xad); IRQVECTOR(0xae); IRQVECTOR(0xaf);
+IRQVECTOR(0xb0); IRQVECTOR(0xb1); IRQVECTOR(0xb2); IRQVECTOR(0xb3);
+IRQVECTOR(0xb4); IRQVECTOR(0xb5); IRQVECTOR(0xb6); IRQVECTOR(0xb7);
+IRQVECTOR(0xb8); IRQVECTOR(0xb9); IRQVECTOR(0xba); IRQVECTOR(0xbb);
+IRQVECTOR(0xbc); IRQVECTOR(0xbd); IRQVECTOR(0xbe); IRQVECTOR(0xbf);
+IRQVECTOR(0xc0); IRQVECTOR(0xc1); IRQVECTOR(0xc2); IRQVECTOR(0xc3);
+IRQVECTOR(0xc4); IRQVECTOR(0xc5); IRQVECTOR(0xc6); IRQVECTOR(0xc7);
+IRQVECTOR(0xc8); IRQVECTOR(0xc9); IRQVECTOR(0xca); IRQVECTOR(0xcb);
+IRQVECTOR(0xcc); IRQVECTOR(0xcd); IRQVECTOR(0xce); IRQVECTOR(0xcf);
+IRQVECTOR(0xd0); IRQVECTOR(0xd1); IRQVECTOR(0xd2); IRQVECTOR(0xd3);
+IRQVECTOR(0xd4); IRQVECTOR(0xd5); IRQVECTOR(0xd6); IRQVECTOR(0xd7);
+IRQVECTOR(0xd8); IRQVECTOR(0xd9); IRQVECTOR(0xda); IRQVECTOR(0xdb);
+IRQVECTOR(0xdc); IRQVECTOR(0xdd); IRQVECTOR(0xde); IRQVECTOR(0xdf);
+IRQVECTOR(0xe0); IRQVECTOR(0xe1); IRQVECTOR(0xe2); IRQVECTOR(0xe3);
+IRQVECTOR(0xe4); IRQVECTOR(0xe5); IRQVECTOR(0xe6); IRQVECTOR(0xe7);
+IRQVECTOR(0xe8); IRQVECTOR(0xe9); IRQVECTOR(0xea); IRQVECTOR(0xeb);
+IRQVECTOR(0xec); IRQVECTOR(0xed); IRQVECTOR(0xee); IRQVECTOR(0xef);
+IRQVECTOR(0xf0); IRQVECTOR(0xf1); IRQVECTOR(0xf2); IRQVECTOR(0xf3);
+IRQVECTOR(0xf4); IRQVECTOR(0xf5); IRQVECTOR(0xf6); IRQVECTOR(0xf7);
+IRQVECTOR(0xf8); IRQVECTOR(0xf9); IRQVECTOR(0xfa); IRQVECTOR(0xfb);
+IRQVECTOR(0xfc); IRQVECTOR(0xfd); IRQVECTOR(0xfe); IRQVECTOR(0xff);
 
 #undef VECTOR
 #undef VECTORERR
+#undef IRQVECTOR
 
 // make vector table
 
@@ -253,29 +264,40 @@ TrapInit(void)
 	LoadIdt(idt, sizeof idt);
 }
 
+/*
+ *  APs share the IDT of the boot CPU
+ */
+void INIT
+TrapInitAp(void)
+{
+	LoadIdt(idt, sizeof idt);
+}
+
 void
 X86PageFault(X86TRAPFRAME *tf)
 {
 	PAGEFAULT pf;
 	ulong faultaddr = Cr2();
 
-	KDBG("page fault @%p (%p)\n", tf->Rip, faultaddr);
-
 	pf.FaultAddr = faultaddr;
+	pf.Present = !!(tf->Errcode & (1 << 0));
 	pf.Wr = !!(tf->Errcode & (1 << 1));
-	pf.User = false;
+	pf.User = !!(tf->Errcode & (1 << 2));
 
 	PageFault(&pf);
 }
 
 /*
- *  General Trap Handler
+ *  General Trap Handler, for exceptions only
  */
 void 
 Trap(X86TRAPFRAME *tf)
 {
-	int err;
-	KDBG("trap from %d %d(err=0x%x) %p\n", tf->R15, tf->Trapno, tf->Errcode, tf->Rip);
+	// page faults are part of normal operation (copy-on-write)
+	if (tf->Trapno != E_PF)
+	{
+		KDBG("trap from %d %d(err=0x%x) %p\n", tf->R15, tf->Trapno, tf->Errcode, tf->Rip);
+	}
 
 	switch (tf->Trapno)
 	{
@@ -285,11 +307,6 @@ Trap(X86TRAPFRAME *tf)
 	case E_GP:
 		Panic("GP");
 	default:
-		err = X86Interrupt(tf);
-		if (err)
-		{
-			Panic("unknown trap");
-		}
-		break;
+		Panic("unknown trap");
 	}
 }
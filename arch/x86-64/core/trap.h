@@ -58,6 +58,7 @@
 typedef struct GATEDESC		GATEDESC;
 typedef enum GATETYPE		GATETYPE;
 typedef struct X86TRAPFRAME	X86TRAPFRAME;
+typedef struct X86IRQFRAME	X86IRQFRAME;
 
 enum GATETYPE
 {
@@ -110,6 +111,31 @@ struct X86TRAPFRAME
 	u64 Ss;
 } PACKED;
 
+/*
+ *  Frame of IrqHandler: only the registers a C call may clobber
+ */
+struct X86IRQFRAME
+{
+	u64 Tsc;		// rdtsc at IrqHandler entry with IRQLAT, else unused
+	u64 Rax;
+	u64 Rcx;
+	u64 Rdx;
+	u64 Rsi;
+	u64 Rdi;
+	u64 R8;
+	u64 R9;
+	u64 R10;
+	u64 R11;
+	u64 Vector;
+	/* iret */
+	u64 Rip;
+	u64 Cs;
+	u64 Rflags;
+	u64 Rsp;
+	u64 Ss;
+} PACKED;
+
 void TrapInit(void) INIT;
+void TrapInitAp(void) INIT;
 
 #endif	// _X86_CORE_TRAP_H
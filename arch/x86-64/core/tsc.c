@@ -0,0 +1,452 @@
+/*
+ * Copyright (c) 2024, akarilab.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <akari/types.h>
+#include <akari/compiler.h>
+#include <akari/timer.h>
+#include <akari/printk.h>
+
+#define KPREFIX		"TSC:"
+
+#include <akari/log.h>
+
+#include <cpuid.h>
+#include <msr.h>
+#include <arch/asm.h>
+#include <arch/cpu.h>
+
+#include "tsc.h"
+
+#define CALIBRATE_USEC		10000
+#define CALIBRATE_TRIES		3
+
+#define SYNC_ROUNDS		1000
+#define SYNC_TIMEOUT_MS		100
+#define SYNC_FOREVER		(~0ul)
+
+// tscsync.Turn
+#define TURN_IDLE		-1
+#define TURN_SOURCE		0
+#define TURN_TARGET		1
+#define TURN_RESULT		2
+
+// tscsync.Action
+#define SYNC_DONE		0
+#define SYNC_ADJUST		1
+
+typedef struct TSCDEV	TSCDEV;
+
+struct TSCDEV
+{
+	ulong Khz;
+};
+
+static TSCDEV tscdev;
+
+/*
+ *  Handshake between the boot CPU (source) and the AP under test
+ *  (target).  They take turns, so no lock is needed.
+ */
+static struct
+{
+	volatile int Turn;
+	volatile u64 Tsc;
+	volatile int Action;
+	volatile long Adjust;
+} tscsync = {
+	.Turn = TURN_IDLE,
+};
+
+static bool
+TscInvariant(void)
+{
+	u32 a, b, c, d;
+
+	Cpuid(CPUID_EXT0, &a, &b, &c, &d);
+
+	if (a < CPUID_EXT7)
+	{
+		return false;
+	}
+
+	Cpuid(CPUID_EXT7, &a, &b, &c, &d);
+
+	return !!(d & CPUID_EXT7_EDX_INVTSC);
+}
+
+/*
+ *  TSC frequency enumerated by the processor (leaf 0x15, or the base
+ *  frequency of leaf 0x16 when the crystal clock is not reported).
+ */
+static ulong
+TscCpuidKhz(void)
+{
+	u32 max, a, b, c, d;
+
+	Cpuid(CPUID_0, &max, &b, &c, &d);
+
+	if (max >= CPUID_15)
+	{
+		Cpuid(CPUID_15, &a, &b, &c, &d);
+
+		if (a && b && c)
+		{
+			return (ulong)c * b / a / 1000;
+		}
+	}
+
+	if (max >= CPUID_16)
+	{
+		Cpuid(CPUID_16, &a, &b, &c, &d);
+
+		if (a & 0xffff)
+		{
+			return (ulong)(a & 0xffff) * 1000;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ *  Count TSC cycles over a few short windows of @ref and keep the
+ *  smallest: a window can only be stretched, never shortened.
+ */
+static ulong
+TscCalibrate(TIMER *ref)
+{
+	ulong period = TimerUsec2Period(ref, CALIBRATE_USEC);
+	ulong start, end;
+	u64 t0, t1, best = ~0ul;
+
+	for (int i = 0; i < CALIBRATE_TRIES; i++)
+	{
+		start = ref->ReadCounterRaw(ref);
+		end = start + period;
+
+		t0 = Rdtsc();
+		while (ref->ReadCounterRaw(ref) < end)
+			;
+		t1 = Rdtsc();
+
+		best = MIN(best, t1 - t0);
+	}
+
+	return best * 1000 / CALIBRATE_USEC;
+}
+
+static ulong
+TscReadCounterRaw(TIMER *tm)
+{
+	return Rdtsc();
+}
+
+static int INIT
+TscProbe(TIMER *tm)
+{
+	TSCDEV *tsc = tm->Device;
+	TIMER *ref = STimer;
+	ulong khz;
+
+	if (!TscInvariant())
+	{
+		KLOG("TSC is not invariant\n");
+		return -1;
+	}
+
+	// measured once, shared by every CPU
+	if (tsc->Khz)
+	{
+		TimerSetFreq(tm, tsc->Khz * 1000);
+		return 0;
+	}
+
+	khz = TscCpuidKhz();
+
+	if (khz)
+	{
+		KLOG("%lu kHz (cpuid)\n", khz);
+	}
+	else if (ref)
+	{
+		khz = TscCalibrate(ref);
+
+		KLOG("%lu kHz (calibrated against %s)\n", khz, ref->Name);
+	}
+
+	if (!khz)
+	{
+		KWARN("cannot determine TSC frequency\n");
+		return -1;
+	}
+
+	tsc->Khz = khz;
+	TimerSetFreq(tm, khz * 1000);
+
+	return 0;
+}
+
+static const TIMER tsctemplate = {
+	.Name = "TSC",
+	.Global = false,
+	.UserReadable = true,
+	.Rating = 300,
+	.Device = &tscdev,
+	.Probe = TscProbe,
+	.ReadCounterRaw = TscReadCounterRaw,
+};
+
+// every CPU reads its own TSC
+static TIMER tmtsc PERCPU;
+
+/*
+ *  TSC frequency in kHz, 0 if the TSC is not usable
+ */
+ulong
+TscKhz(void)
+{
+	return tscdev.Khz;
+}
+
+static bool
+TscAdjustSupported(void)
+{
+	u32 max, a, b, c, d;
+
+	Cpuid(CPUID_0, &max, &b, &c, &d);
+
+	if (max < CPUID_7)
+	{
+		return false;
+	}
+
+	CpuidCount(CPUID_7, 0, &a, &b, &c, &d);
+
+	return !!(b & CPUID_7_EBX_TSC_ADJUST);
+}
+
+/*
+ *  Firmware may have written the TSC of this CPU.  Undo it, so that all
+ *  CPUs start from the same offset.
+ */
+static void INIT
+TscAdjustReset(void)
+{
+	long adj;
+
+	if (!TscAdjustSupported())
+	{
+		return;
+	}
+
+	adj = Rdmsr64(IA32_TSC_ADJUST);
+	if (adj)
+	{
+		KLOG("cpu%d: TSC_ADJUST %ld reset to 0\n", CpuId(), adj);
+		Wrmsr64(IA32_TSC_ADJUST, 0);
+	}
+}
+
+/*
+ *  Wait for @turn until the TSC reaches @until.  Returns false on timeout.
+ */
+static bool
+SyncWait(int turn, u64 until)
+{
+	while (tscsync.Turn != turn)
+	{
+		if (Rdtsc() >= until)
+		{
+			return false;
+		}
+
+		Pause();
+	}
+
+	return true;
+}
+
+/*
+ *  Bound the offset of the target TSC against ours.  Each round the
+ *  target stamps between two of our reads t0 and t2, so its offset lies
+ *  in [t1 - t2, t1 - t0]; the tightest bounds over all rounds are kept.
+ */
+static bool
+SyncMeasure(long *lo, long *hi, u64 until)
+{
+	u64 t0, t1, t2;
+
+	*lo = (long)(1ul << 63);
+	*hi = (long)~(1ul << 63);
+
+	for (int i = 0; i < SYNC_ROUNDS; i++)
+	{
+		t0 = RdtscOrdered();
+		tscsync.Tsc = t0;
+		tscsync.Turn = TURN_TARGET;
+
+		if (!SyncWait(TURN_SOURCE, until))
+		{
+			return false;
+		}
+
+		t1 = tscsync.Tsc;
+		t2 = RdtscOrdered();
+
+		*lo = MAX(*lo, (long)(t1 - t2));
+		*hi = MIN(*hi, (long)(t1 - t0));
+	}
+
+	return true;
+}
+
+/*
+ *  Boot CPU side of the warp test against @cpu, which runs
+ *  TscSyncTarget() at the same time.  A target found out of sync is
+ *  corrected through its IA32_TSC_ADJUST once; if that does not help,
+ *  the TSC stops keeping time.
+ *
+ *  Returns -1 if the target stops answering.  The caller must then stop
+ *  it before TscSyncReset(), as it may still write to the handshake.
+ */
+int INIT
+TscSyncSource(int cpu)
+{
+	long lo, hi, skew;
+	bool adjusted = false;
+	u64 until;
+
+	if (!tscdev.Khz)
+	{
+		return 0;
+	}
+
+	until = Rdtsc() + tscdev.Khz * SYNC_TIMEOUT_MS;
+
+	for (;;)
+	{
+		if (!SyncWait(TURN_SOURCE, until) || !SyncMeasure(&lo, &hi, until))
+		{
+			KWARN("cpu%d: no answer to the TSC warp test\n", cpu);
+			return -1;
+		}
+
+		// the midpoint of the bounds is the best estimate
+		skew = lo + (hi - lo) / 2;
+
+		KLOG("cpu%d: skew %ld cycles (%ld..%ld)\n", cpu, skew, lo, hi);
+
+		if (lo <= 0 && hi >= 0)
+		{
+			tscsync.Action = SYNC_DONE;
+			break;
+		}
+
+		if (adjusted || !TscAdjustSupported())
+		{
+			tscsync.Action = SYNC_DONE;
+			TimerMarkUnstable(&CPU_VAR(tmtsc, 0), "TSC not synchronized");
+			break;
+		}
+
+		tscsync.Adjust = -skew;
+		tscsync.Action = SYNC_ADJUST;
+		tscsync.Turn = TURN_RESULT;
+
+		adjusted = true;
+	}
+
+	tscsync.Turn = TURN_RESULT;
+
+	if (!SyncWait(TURN_IDLE, until))
+	{
+		KWARN("cpu%d: no answer to the TSC warp test\n", cpu);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ *  Make the handshake ready for the next target after a failed one
+ */
+void INIT
+TscSyncReset(void)
+{
+	tscsync.Turn = TURN_IDLE;
+}
+
+/*
+ *  AP side of the warp test
+ */
+void INIT
+TscSyncTarget(void)
+{
+	if (!tscdev.Khz)
+	{
+		return;
+	}
+
+	for (;;)
+	{
+		tscsync.Turn = TURN_SOURCE;
+
+		for (int i = 0; i < SYNC_ROUNDS; i++)
+		{
+			SyncWait(TURN_TARGET, SYNC_FOREVER);
+
+			tscsync.Tsc = RdtscOrdered();
+			tscsync.Turn = TURN_SOURCE;
+		}
+
+		SyncWait(TURN_RESULT, SYNC_FOREVER);
+
+		if (tscsync.Action == SYNC_DONE)
+		{
+			break;
+		}
+
+		Wrmsr64(IA32_TSC_ADJUST, Rdmsr64(IA32_TSC_ADJUST) + tscsync.Adjust);
+	}
+
+	tscsync.Turn = TURN_IDLE;
+}
+
+/*
+ *  Register the TSC of this CPU
+ */
+void INIT
+TscInit(void)
+{
+	TscAdjustReset();
+
+	MYCPU(tmtsc) = tsctemplate;
+
+	NewTimer(&MYCPU(tmtsc));
+}
@@ -100,11 +100,13 @@ struct FADT
 typedef struct MADTENTRY		MADTENTRY;
 typedef struct MADT_LOCALAPIC		MADT_LOCALAPIC;
 typedef struct MADT_IOAPIC		MADT_IOAPIC;
+typedef struct MADT_ISO			MADT_ISO;
 typedef struct MADT_LOCAL_X2APIC	MADT_LOCAL_X2APIC;
 typedef struct MADT			MADT;
 
 #define APIC_TYPE_LOCALAPIC			0
 #define APIC_TYPE_IOAPIC			1
+#define APIC_TYPE_ISO				2
 #define APIC_TYPE_LOCAL_X2APIC			9
 
 struct MADTENTRY
@@ -132,6 +134,24 @@ struct MADT_IOAPIC
 	u32 IntrBase;
 };
 
+/*
+ * Interrupt Source Override: ISA irq Source is wired to Gsi
+ */
+struct MADT_ISO
+{
+	MADTENTRY Header;
+
+	u8 Bus;		// 0: ISA
+	u8 Source;
+	u32 Gsi;
+	u16 Flags;
+} PACKED;
+
+#define MADT_ISO_POLARITY_MASK		0x3
+#define MADT_ISO_POLARITY_LOW		0x3
+#define MADT_ISO_TRIGGER_MASK		0xc
+#define MADT_ISO_TRIGGER_LEVEL		0xc
+
 struct MADT_LOCAL_X2APIC
 {
 	MADTENTRY Header;
@@ -39,6 +39,7 @@
 #endif
 
 #define CR0_PE		0x1
+#define CR0_WP		0x10000
 #define CR0_PG		0x80000000
 #define CR4_PAE		(1 << 5)
 
@@ -64,6 +65,38 @@ inb(u16 port)
 	return data;
 }
 
+static inline void
+outl(u16 port, u32 data)
+{
+	asm volatile ("outl %0, %1" :: "a"(data), "d"(port));
+}
+
+static inline u32
+inl(u16 port)
+{
+	u32 data;
+
+	asm volatile ("inl %1, %0" : "=a"(data) : "d"(port));
+
+	return data;
+}
+
+static inline ulong
+Cr0(void)
+{
+	ulong cr0;
+
+	asm volatile ("movq %%cr0, %0" : "=r"(cr0));
+
+	return cr0;
+}
+
+static inline void
+SetCr0(ulong cr0)
+{
+	asm volatile ("movq %0, %%cr0" :: "r"(cr0));
+}
+
 static inline ulong
 Cr2(void)
 {
@@ -74,6 +107,51 @@ Cr2(void)
 	return cr2;
 }
 
+static inline ulong
+Cr3(void)
+{
+	ulong cr3;
+
+	asm volatile ("movq %%cr3, %0" : "=r"(cr3));
+
+	return cr3;
+}
+
+static inline void
+Invlpg(ulong va)
+{
+	asm volatile ("invlpg (%0)" :: "r"(va) : "memory");
+}
+
+static inline void
+Pause(void)
+{
+	asm volatile ("pause" ::: "memory");
+}
+
+static inline u64
+Rdtsc(void)
+{
+	u32 lo, hi;
+
+	asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+
+	return (u64)lo | ((u64)hi << 32);
+}
+
+/*
+ *  rdtsc that is not executed ahead of earlier loads
+ */
+static inline u64
+RdtscOrdered(void)
+{
+	u32 lo, hi;
+
+	asm volatile ("lfence; rdtsc" : "=a"(lo), "=d"(hi) :: "memory");
+
+	return (u64)lo | ((u64)hi << 32);
+}
+
 #endif	// __ASSEMBLER__
 
 #endif	// _X86_ASM_H
@@ -33,8 +33,9 @@
 #include <akari/types.h>
 #include <akari/cpu.h>
 #include <akari/compiler.h>
+#include <arch/asm.h>
 
-// #define PERCPU_ENABLE
+#define PERCPU_ENABLE
 
 #define INTR_DISABLE	asm volatile ("cli");
 #define INTR_ENABLE	asm volatile ("sti");
@@ -54,7 +55,29 @@ extern void *__PerCpuPtr[NCPU];
 
 #define CPU_VAR(_v, _cpu)	(*(typeof(_v) *)(__PerCpuPtr[(_cpu)] + PERCPU_VAR_OFFSET(_v)))
 
-#define MYCPU(_v)		CPU_VAR(_v, currentcpu)
+/*
+ *  GS base points to this CPU's copy of the percpu data, whose first
+ *  word points to itself.
+ */
+static inline void *
+PerCpuBase(void)
+{
+	void *base;
+
+	asm ("movq %%gs:0, %0" : "=r"(base));
+
+	return base;
+}
+
+#define MYCPU(_v)		(*(typeof(_v) *)(PerCpuBase() + PERCPU_VAR_OFFSET(_v)))
+
+extern int __cpuid PERCPU;
+
+static inline int
+CpuId(void)
+{
+	return MYCPU(__cpuid);
+}
 
 #else
 
@@ -64,8 +87,61 @@ extern void *__PerCpuPtr[NCPU];
 #define CPU_VAR(_v, _cpu)	_v
 #define MYCPU(_v)		_v
 
+static inline int
+CpuId(void)
+{
+	return 0;
+}
+
 #endif	// PERCPU_ENABLE
 
 void InitPerCpu(void) INIT;
+void PerCpuSetup(int cpu);
+
+void ArchStartCpus(void) INIT;
+
+static inline u64
+ArchCycles(void)
+{
+	return Rdtsc();
+}
+
+static inline void
+ArchCpuRelax(void)
+{
+	Pause();
+}
+
+/*
+ *  Disable interrupts, returning whether they were enabled
+ */
+static inline ulong
+ArchIntrSave(void)
+{
+	ulong rflags;
+
+	asm volatile ("pushfq; popq %0; cli" : "=r"(rflags) :: "memory");
+
+	return rflags & 0x200;
+}
+
+static inline void
+ArchIntrRestore(ulong flags)
+{
+	if (flags)
+	{
+		asm volatile ("sti" ::: "memory");
+	}
+}
+
+/*
+ *  Enable interrupts and wait for one.  sti delays interrupt delivery
+ *  by an instruction, so nothing can slip in before hlt.
+ */
+static inline void
+ArchIdle(void)
+{
+	asm volatile ("sti; hlt" ::: "memory");
+}
 
 #endif	// _ARCH_CPU_H
@@ -30,6 +30,21 @@
 #ifndef _ARCH_IRQ_H
 #define _ARCH_IRQ_H
 
+// IRQ numbers are interrupt vectors
+#define NR_IRQ			256
+
+// handed out by IrqAllocVector(); the ones below are fixed
+#define IRQ_DYN_FIRST		0x80
+#define IRQ_DYN_LAST		0xef
+
+#define IRQ_IPI_CALL		0xf0	// cross-CPU function calls
+
 void ArchIrqInit(void);
+void ArchMsiCompose(int vector, int cpu, u64 *addr, u32 *data);
+bool ArchIrqCpuTargetable(int cpu);
+
+void ArchSendIPI(int cpu, int vector);
+void ArchSendIPIMask(ulong mask, int vector);
+void ArchSendIPIAllButSelf(int vector);
 
 #endif	// _ARCH_IRQ_H
@@ -40,6 +40,9 @@
 
 #define PAGE_OFFSET	KLINK_OFFSET
 
+// User address space: 0x0 - 0x00007fffffffffff
+#define USER_VA_END	ULL(0x0000800000000000)
+
 #ifndef __ASSEMBLER__
 
 extern char __kstart[], __kend[];
@@ -39,7 +39,9 @@
 #define PTE_PCD		(1 << 4)
 #define PTE_A		(1 << 5)
 #define PTE_D		(1 << 6)
+#define PTE_PS		(1 << 7)	// pd/pdpt: huge page
 #define PTE_G		(1 << 8)
+#define PTE_COW		(1 << 9)	// software: copy-on-write
 #define PTE_XD		(1ull << 63)
 
 /*
@@ -58,6 +60,14 @@
 #define	PAGESIZE	0x1000
 #define PAGESHIFT	12
 
+#define HUGEPAGESHIFT	21
+#define HUGEPAGESIZE	(1 << HUGEPAGESHIFT)
+#define HUGEPAGE_ORDER	(HUGEPAGESHIFT - PAGESHIFT)
+#define HUGEPAGE_LEVEL	2
+
+// bytes mapped by one entry of a level @_level table
+#define PLEVELSIZE(_level)	(1ul << (PAGESHIFT + ((_level) - 1) * 9))
+
 #define PTE_PA_MASK	ULL(0xfffffffff000)
 
 #ifndef __ASSEMBLER__
@@ -70,6 +80,8 @@ typedef struct VAS	VAS;
 #define PPresent(_pte)		((_pte) & PTE_P)
 #define PWritable(_pte)		((_pte) & PTE_W)
 #define PUser(_pte)		((_pte) & PTE_U)
+#define PCow(_pte)		((_pte) & PTE_COW)
+#define PHuge(_pte)		((_pte) & PTE_PS)
 
 #define PTE_PA(_pte)		((ulong)(_pte) & PTE_PA_MASK)
 
@@ -113,9 +125,50 @@ ArchSetPteLeaf(PTE *pte, PHYSADDR pa, PTEFLAGS flags)
 	*pte = (pa & PTE_PA_MASK) | archflags | PTE_P;
 }
 
+static inline void
+ArchSetPteHuge(PTE *pte, PHYSADDR pa, PTEFLAGS flags)
+{
+	ulong archflags = ArchPteFlags(flags);
+
+	*pte = (pa & PTE_PA_MASK) | archflags | PTE_PS | PTE_P;
+}
+
+/*
+ *  4K entry mapping @pa with the permissions of the huge entry @huge
+ */
+static inline PTE
+ArchHugeToPte(PTE huge, PHYSADDR pa)
+{
+	return (pa & PTE_PA_MASK) | (huge & ~(PTE_PA_MASK | PTE_PS));
+}
+
+/*
+ *  Write-protect a leaf entry so that it can be shared copy-on-write.
+ */
+static inline void
+ArchSetPteCow(PTE *pte)
+{
+	if (PWritable(*pte) || PCow(*pte))
+	{
+		*pte = (*pte & ~PTE_W) | PTE_COW;
+	}
+}
+
+/*
+ *  Resolve a copy-on-write entry: point it at @pa and make it writable again.
+ */
+static inline void
+ArchBreakPteCow(PTE *pte, PHYSADDR pa)
+{
+	*pte = (pa & PTE_PA_MASK) | (*pte & ~(PTE_PA_MASK | PTE_COW)) | PTE_W;
+}
+
 void ArchSwitchVas(VAS *vas);
+void ArchFlushTlb(VAS *vas);
+void ArchFlushTlbPage(VAS *vas, ulong va);
 
 void ArchInitKvas(VAS *kvas);
+void ArchInitUvas(VAS *uvas);
 
 #endif	// __ASSEMBLER__
 
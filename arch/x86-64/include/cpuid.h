@@ -33,10 +33,21 @@
 #define CPUID_0		0x0
 #define CPUID_1		0x1
 #define CPUID_1_ECX_X2APIC	0x200000
+#define CPUID_1_ECX_TSC_DEADLINE	0x1000000
 #define CPUID_1_EDX_MSR		0x20
 #define CPUID_1_EDX_PAE		0x40
 #define CPUID_1_EDX_APIC	0x200
 
+#define CPUID_7		0x7
+#define CPUID_7_EBX_TSC_ADJUST	0x2
+
+#define CPUID_B		0xb	// extended topology
+
+#define CPUID_15	0x15
+#define CPUID_16	0x16
+
+#define CPUID_EXT0	0x80000000
+
 #define CPUID_EXT1	0x80000001
 #define CPUID_EXT1_EDX_64BIT	0x20000000
 
@@ -44,6 +55,9 @@
 #define CPUID_EXT3	0x80000003
 #define CPUID_EXT4	0x80000004
 
+#define CPUID_EXT7	0x80000007
+#define CPUID_EXT7_EDX_INVTSC	0x100
+
 #ifndef __ASSEMBLER__
 
 #include <akari/types.h>
@@ -55,6 +69,13 @@ Cpuid(u32 ax, u32 *a, u32 *b, u32 *c, u32 *d)
 			      : "a"(ax));
 }
 
+static inline void
+CpuidCount(u32 ax, u32 cx, u32 *a, u32 *b, u32 *c, u32 *d)
+{
+	asm volatile ("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d)
+			      : "a"(ax), "c"(cx));
+}
+
 #endif	// __ASSEMBLER__
 
 #endif	// _X86_CPUID_H
@@ -40,6 +40,12 @@
 #define IA32_EFER_FFXSR		(1 << 14)
 #define IA32_EFER_TCE		(1 << 15)
 
+#define IA32_GS_BASE	0xc0000101
+
+#define IA32_TSC_ADJUST		0x3b
+
+#define IA32_TSC_DEADLINE	0x6e0
+
 #define IA32_APIC_BASE		0x1b
 #define IA32_APIC_BASE_ENABLE_X2APIC		0x400
 #define IA32_APIC_BASE_APIC_GLOBAL_ENABLE	0x800
@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2024, akarilab.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// Clock read benchmarks
+
+#include <akari/types.h>
+#include <akari/compiler.h>
+#include <akari/bench.h>
+#include <akari/clockpage.h>
+#include <akari/timer.h>
+#include <akari/mm.h>
+#include <arch/cpu.h>
+
+#define KPREFIX		"bench/clock:"
+
+#include <akari/log.h>
+
+#define NREAD		1000000ul
+
+/*
+ *  Read the time the way user space does, through the clock page mapped
+ *  in a user VAS, and compare with the kernel's own clock reads.
+ */
+static void
+ClockBench(void)
+{
+	const volatile CLOCKPAGE *cp = (const volatile CLOCKPAGE *)CLOCKPAGE_VA;
+	TIMER *tm = STimer;
+	u64 t0, page, kern, global = 0;
+	ulong ns, last = 0, sink = 0;
+	bool mono = true;
+	VAS *vas;
+
+	vas = NewVas();
+	if (!vas)
+	{
+		KWARN("cannot create vas\n");
+		return;
+	}
+
+	SwitchVas(vas);
+
+	if (ClockPageRead(cp, &ns) < 0)
+	{
+		KLOG("clock page not valid\n");
+		SwitchKvas();
+		FreeVas(vas);
+		return;
+	}
+
+	t0 = ArchCycles();
+	for (ulong i = 0; i < NREAD; i++)
+	{
+		ClockPageRead(cp, &ns);
+
+		mono &= ns >= last;
+		last = ns;
+	}
+	page = ArchCycles() - t0;
+
+	SwitchKvas();
+	FreeVas(vas);
+
+	t0 = ArchCycles();
+	for (ulong i = 0; i < NREAD; i++)
+	{
+		sink += KtimeGetNs();
+	}
+	kern = ArchCycles() - t0;
+
+	if (tm)
+	{
+		t0 = ArchCycles();
+		for (ulong i = 0; i < NREAD; i++)
+		{
+			sink += tm->ReadCounterRaw(tm);
+		}
+		global = ArchCycles() - t0;
+	}
+
+	KLOG("clock page %lu cycles/read (%s), KtimeGetNs %lu, %s raw read %lu\n",
+	     page / NREAD, mono ? "monotonic" : "NOT monotonic",
+	     kern / NREAD, tm ? tm->Name : "-", global / NREAD);
+	KDBG("%lu\n", sink);
+}
+
+DEFINE_BENCH(Clock, ClockBench);
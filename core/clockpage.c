@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2024, akarilab.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// Clock page: time for user space without a kernel entry
+
+#include <akari/types.h>
+#include <akari/compiler.h>
+#include <akari/clockpage.h>
+#include <akari/timer.h>
+#include <akari/kalloc.h>
+
+#define KPREFIX		"clockpage:"
+
+#include <akari/log.h>
+
+static CLOCKPAGE *clockpage;
+
+/*
+ *  Publish the timekeeping base: @ns at @cycles of @tm
+ */
+void
+ClockPageUpdate(TIMER *tm, ulong cycles, ulong ns)
+{
+	CLOCKPAGE *cp = clockpage;
+	volatile u32 *seq;
+
+	if (!cp)
+	{
+		return;
+	}
+
+	seq = &cp->Seq;
+
+	// stores are not reordered with each other on x86
+	*seq = *seq + 1;
+	asm volatile ("" ::: "memory");
+
+	if (tm && tm->UserReadable && !tm->Unstable)
+	{
+		cp->Mult = tm->Mult;
+		cp->Shift = tm->Shift;
+		cp->BaseCycles = cycles;
+		cp->BaseNs = ns;
+		cp->Valid = 1;
+	}
+	else
+	{
+		cp->Valid = 0;
+	}
+
+	asm volatile ("" ::: "memory");
+	*seq = *seq + 1;
+}
+
+PAGE *
+ClockPage(void)
+{
+	return clockpage ? Va2Page(clockpage) : NULL;
+}
+
+/*
+ *  Filled in once timekeeping has a clocksource
+ */
+void INIT
+ClockPageInit(void)
+{
+	clockpage = Zalloc();
+	if (!clockpage)
+	{
+		KWARN("cannot allocate clock page\n");
+	}
+}
@@ -35,6 +35,8 @@
 
 void *__CpuPtr[NCPU];
 
+volatile ulong CpuOnlineMask;
+
 void INIT
 InitPerCpuData(void)
 {
@@ -31,10 +31,25 @@
 #include <akari/compiler.h>
 #include <akari/fault.h>
 #include <akari/panic.h>
+#include <akari/mm.h>
 
 void
 PageFault(PAGEFAULT *pf)
 {
+	VAS *vas = CurrentVas();
+
+	if (pf->Present)
+	{
+		if (pf->Wr && VasCowFault(vas, pf->FaultAddr) == 0)
+		{
+			return;
+		}
+	}
+	else if (VasAnonFault(vas, pf->FaultAddr) == 0)
+	{
+		return;
+	}
+
 	if (!pf->User)
 	{
 		Panic("Page Fault occured @%p", pf->FaultAddr);
@@ -0,0 +1,399 @@
+/*
+ * Copyright (c) 2024, akarilab.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// High resolution timers: per-CPU min-heap on the expiry time
+
+#include <akari/types.h>
+#include <akari/compiler.h>
+#include <akari/hrtimer.h>
+#include <akari/timer.h>
+#include <akari/softirq.h>
+#include <akari/list.h>
+#include <akari/cpu.h>
+
+#include <arch/cpu.h>
+
+#define KPREFIX		"hrtimer:"
+
+#include <akari/log.h>
+
+// longest delta handed to the event device; it is re-armed on expiry
+#define MAX_DELTA_NS		1000000000ul
+
+typedef struct HRTIMERBASE	HRTIMERBASE;
+
+struct HRTIMERBASE
+{
+	HRTIMER *Heap[NHRTIMER];
+	uint n;
+
+	EVENTTIMER *Dev;
+	ulong Next;		// expiry the device is armed for, 0 if none
+
+	LIST Deferred;
+
+	ulong nExpire;
+	ulong Hist[HRTIMER_NHIST];
+};
+
+static HRTIMERBASE hrbase PERCPU;
+
+static inline void
+HeapSet(HRTIMERBASE *b, uint i, HRTIMER *t)
+{
+	b->Heap[i] = t;
+	t->Index = i;
+}
+
+static void
+HeapUp(HRTIMERBASE *b, uint i)
+{
+	HRTIMER *t = b->Heap[i];
+	uint parent;
+
+	while (i > 0)
+	{
+		parent = (i - 1) / 2;
+
+		if (b->Heap[parent]->Expires <= t->Expires)
+		{
+			break;
+		}
+
+		HeapSet(b, i, b->Heap[parent]);
+		i = parent;
+	}
+
+	HeapSet(b, i, t);
+}
+
+static void
+HeapDown(HRTIMERBASE *b, uint i)
+{
+	HRTIMER *t = b->Heap[i];
+	uint child;
+
+	while ((child = 2 * i + 1) < b->n)
+	{
+		if (child + 1 < b->n &&
+		    b->Heap[child + 1]->Expires < b->Heap[child]->Expires)
+		{
+			child++;
+		}
+
+		if (t->Expires <= b->Heap[child]->Expires)
+		{
+			break;
+		}
+
+		HeapSet(b, i, b->Heap[child]);
+		i = child;
+	}
+
+	HeapSet(b, i, t);
+}
+
+static void
+HeapRemove(HRTIMERBASE *b, HRTIMER *t)
+{
+	uint i = t->Index;
+	HRTIMER *last;
+
+	t->Index = HRTIMER_IDLE;
+
+	last = b->Heap[--b->n];
+
+	if (last == t)
+	{
+		return;
+	}
+
+	HeapSet(b, i, last);
+
+	if (i > 0 && b->Heap[(i - 1) / 2]->Expires > last->Expires)
+	{
+		HeapUp(b, i);
+	}
+	else
+	{
+		HeapDown(b, i);
+	}
+}
+
+/*
+ *  Arm the event device for the earliest expiry.  A periodic device
+ *  cannot be programmed; timers then expire from the tick.
+ */
+static void
+HrtimerReprogram(HRTIMERBASE *b)
+{
+	EVENTTIMER *et = b->Dev;
+	ulong next, now, delta;
+
+	if (!et || et->Mode != ET_MODE_ONESHOT)
+	{
+		return;
+	}
+
+	if (b->n == 0)
+	{
+		if (b->Next)
+		{
+			et->Off(et);
+			b->Next = 0;
+		}
+		return;
+	}
+
+	next = b->Heap[0]->Expires;
+
+	if (next == b->Next)
+	{
+		return;
+	}
+
+	now = KtimeGetNs();
+	delta = next > now ? next - now : 0;
+
+	if (!b->Next)
+	{
+		et->On(et);
+	}
+
+	et->SetNextEvent(et, MIN(delta, MAX_DELTA_NS));
+	b->Next = next;
+}
+
+void
+HrtimerInit(HRTIMER *t, void (*func)(HRTIMER *), void *arg, uint flags)
+{
+	t->Expires = 0;
+	t->Index = HRTIMER_IDLE;
+	t->Flags = flags;
+	t->Func = func;
+	t->Arg = arg;
+	t->Deferred.Next = NULL;
+	t->Deferred.Prev = NULL;
+}
+
+/*
+ *  Queue @t on this CPU to expire at @ns (HRTIMER_ABS) or @ns from now
+ *  (HRTIMER_REL).  A queued @t is moved.  The heap is shared with
+ *  HrtimerInterrupt(), so it is changed with interrupts off.
+ */
+int
+HrtimerStart(HRTIMER *t, ulong ns, int mode)
+{
+	HRTIMERBASE *b = &MYCPU(hrbase);
+	ulong intr = ArchIntrSave();
+
+	if (HrtimerQueued(t))
+	{
+		HeapRemove(b, t);
+	}
+
+	if (b->n >= NHRTIMER)
+	{
+		ArchIntrRestore(intr);
+		KWARN("too many timers\n");
+		return -1;
+	}
+
+	t->Expires = mode == HRTIMER_REL ? KtimeGetNs() + ns : ns;
+
+	b->Heap[b->n] = t;
+	HeapUp(b, b->n++);
+
+	if (t->Index == 0)
+	{
+		HrtimerReprogram(b);
+	}
+
+	ArchIntrRestore(intr);
+
+	return 0;
+}
+
+bool
+HrtimerCancel(HRTIMER *t)
+{
+	HRTIMERBASE *b = &MYCPU(hrbase);
+	ulong intr = ArchIntrSave();
+	bool first;
+
+	if (ListLinked(&t->Deferred))
+	{
+		ListDel(&t->Deferred);
+		ArchIntrRestore(intr);
+		return true;
+	}
+
+	if (!HrtimerQueued(t))
+	{
+		ArchIntrRestore(intr);
+		return false;
+	}
+
+	first = t->Index == 0;
+
+	HeapRemove(b, t);
+
+	if (first)
+	{
+		HrtimerReprogram(b);
+	}
+
+	ArchIntrRestore(intr);
+
+	return true;
+}
+
+static void
+HrtimerRecordLatency(HRTIMERBASE *b, ulong lat)
+{
+	int bucket = 0;
+
+	while (lat > 1 && bucket < HRTIMER_NHIST - 1)
+	{
+		lat >>= 1;
+		bucket++;
+	}
+
+	b->Hist[bucket]++;
+}
+
+/*
+ *  Expire every due timer, then re-arm the device for the next one.
+ *  Called from the event timer interrupt, or from the tick when the
+ *  device is periodic.
+ */
+void
+HrtimerInterrupt(void)
+{
+	HRTIMERBASE *b = &MYCPU(hrbase);
+	HRTIMER *t;
+	ulong now;
+
+	b->Next = 0;
+
+	now = KtimeGetNs();
+
+	while (b->n > 0 && b->Heap[0]->Expires <= now)
+	{
+		t = b->Heap[0];
+		HeapRemove(b, t);
+
+		HrtimerRecordLatency(b, now - t->Expires);
+		b->nExpire++;
+
+		if (t->Flags & HRTIMER_DEFERRED)
+		{
+			ListAddTail(&b->Deferred, &t->Deferred);
+			SoftirqRaise(SOFTIRQ_HRTIMER);
+		}
+		else
+		{
+			t->Func(t);
+		}
+
+		// callbacks may take a while
+		now = KtimeGetNs();
+	}
+
+	HrtimerReprogram(b);
+}
+
+/*
+ *  Run the callbacks of expired HRTIMER_DEFERRED timers
+ */
+void
+HrtimerRunDeferred(void)
+{
+	HRTIMERBASE *b = &MYCPU(hrbase);
+	HRTIMER *t;
+
+	while (!ListEmpty(&b->Deferred))
+	{
+		INTR_DISABLE;
+
+		t = LIST_ENTRY(b->Deferred.Next, HRTIMER, Deferred);
+		ListDel(&t->Deferred);
+
+		INTR_ENABLE;
+
+		t->Func(t);
+	}
+}
+
+/*
+ *  @et is this CPU's event device from now on
+ */
+void
+HrtimerSetDevice(EVENTTIMER *et)
+{
+	HRTIMERBASE *b = &MYCPU(hrbase);
+	ulong intr = ArchIntrSave();
+
+	b->Dev = et;
+	b->Next = 0;
+
+	HrtimerReprogram(b);
+
+	ArchIntrRestore(intr);
+}
+
+void
+HrtimerReport(void)
+{
+	HRTIMERBASE *b = &MYCPU(hrbase);
+
+	KLOG("%lu expired, %d queued, expiry latency:\n", b->nExpire, b->n);
+
+	for (int i = 0; i < HRTIMER_NHIST; i++)
+	{
+		if (b->Hist[i])
+		{
+			KLOG("  < %lu ns: %lu\n", 2ul << i, b->Hist[i]);
+		}
+	}
+}
+
+void INIT
+HrtimerInitCpu(void)
+{
+	HRTIMERBASE *b = &MYCPU(hrbase);
+
+	b->n = 0;
+	b->Dev = NULL;
+	b->Next = 0;
+
+	ListInit(&b->Deferred);
+
+	SoftirqSetAction(SOFTIRQ_HRTIMER, HrtimerRunDeferred);
+}
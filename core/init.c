@@ -34,7 +34,14 @@
 #include <akari/panic.h>
 #include <akari/mm.h>
 #include <akari/timer.h>
+#include <akari/softirq.h>
 #include <akari/irq.h>
+#include <akari/irqbalance.h>
+#include <akari/smpcall.h>
+#include <akari/pci.h>
+#include <akari/bench.h>
+#include <akari/atomic.h>
+#include <akari/cpu.h>
 #include <arch/memlayout.h>
 #include <arch/cpu.h>
 
@@ -57,6 +64,35 @@ ReserveKernelArea(void)
 	ReserveMem(kstartpa, ksize);
 }
 
+/*
+ *  Idle loop of every CPU, with the tick stopped while nothing needs it
+ */
+static void NORETURN
+CpuIdle(void)
+{
+	for (;;)
+	{
+		SoftirqRunPending();
+
+		INTR_DISABLE;
+
+		// raised after the check above: do not sleep on it
+		if (SoftirqPending())
+		{
+			INTR_ENABLE;
+			continue;
+		}
+
+		TimerIdleEnter();
+		ArchIdle();
+
+		// woken with interrupts on: the wheel and hrtimers are not locked
+		INTR_DISABLE;
+		TimerIdleExit();
+		INTR_ENABLE;
+	}
+}
+
 void INIT NORETURN
 KernelMain(void)
 {
@@ -73,10 +109,16 @@ KernelMain(void)
 	KallocInit();
 
 	IrqInit();
+	SmpCallInitCpu();
+	PciInit();
 
 	TTYInit();
 	TimerInit();
 
+	ArchStartCpus();
+
+	IrqBalanceInit();
+
 	KDBG("sleeptest\n");
 	mSleep(1000);
 	KDBG("1 ");
@@ -85,14 +127,33 @@ KernelMain(void)
 	mSleep(1000);
 	KDBG("3\n");
 
+#ifdef KBENCH
+	KernelBench();
+#endif	// KBENCH
+
 	INTR_ENABLE;
 
 #ifdef DBGHELLO
 	KDBG("Kernel Hello!\n");
 #endif	// DBGHELLO
-	
-	for (;;)
-		;
+
+	CpuIdle();
 
 	// Panic("KernelMain Exit");
 }
+
+/*
+ *  Generic part of the AP bringup, on the AP once its arch side is up
+ */
+void INIT NORETURN
+ApMain(void)
+{
+	SmpCallInitCpu();
+	TimerInitCpu();
+
+	AtomicFetchOr(&CpuOnlineMask, 1ul << CpuId());
+
+	INTR_ENABLE;
+
+	CpuIdle();
+}
@@ -32,60 +32,499 @@
 #include <akari/irq.h>
 #include <akari/irqsource.h>
 #include <akari/kalloc.h>
+#include <akari/atomic.h>
+#include <akari/spinlock.h>
+#include <akari/softirq.h>
+#include <akari/timer.h>
 #include <arch/irq.h>
+#include <arch/cpu.h>
 
 #define KPREFIX		"irq:"
 
 #include <akari/log.h>
 
-static IRQ *
+// descriptors indexed by irqno
+static IRQ irqdesc[NR_IRQ];
+static IRQ irqlocal[NR_IRQ] PERCPU;
+
+// only touched by the owning CPU, so no atomics
+static ulong irqcount[NR_IRQ] PERCPU;
+static ulong irqcycles[NR_IRQ] PERCPU;	// spent in the handlers
+static ulong irqunclaimed PERCPU;
+
+static u64 vecmap[NR_IRQ / 64];
+
+// serializes NewIRQ() and IrqSetAffinity(); dispatch does not take it
+static SPINLOCK irqlock = SPINLOCK_INIT;
+
+static IRQCHIP *defaultchip;
+
+// IRQs this CPU masked and now polls
+static IRQ *pollhead PERCPU;
+
+static inline IRQ *
 GetIRQ(int irqno)
 {
-	// TODO
+	IRQ *irq;
+
+	if (irqno < 0 || irqno >= NR_IRQ)
+	{
+		return NULL;
+	}
+
+	irq = &MYCPU(irqlocal)[irqno];
+	if (AtomicLoad(&irq->Flags) & IRQ_USED)
+	{
+		return irq;
+	}
+
+	irq = &irqdesc[irqno];
+	if (AtomicLoad(&irq->Flags) & IRQ_USED)
+	{
+		return irq;
+	}
+
 	return NULL;
 }
 
+/*
+ *  Allocate a free vector from the dynamic range, -1 if none is left
+ */
+int
+IrqAllocVector(void)
+{
+	u64 old, bit;
+
+	for (int v = IRQ_DYN_FIRST; v <= IRQ_DYN_LAST; v++)
+	{
+		bit = 1ul << (v % 64);
+		old = AtomicLoad(&vecmap[v / 64]);
+
+		while (!(old & bit))
+		{
+			if (AtomicCas(&vecmap[v / 64], &old, old | bit))
+			{
+				return v;
+			}
+		}
+	}
+
+	return -1;
+}
+
+void
+IrqFreeVector(int irqno)
+{
+	AtomicFetchAnd(&vecmap[irqno / 64], ~(1ul << (irqno % 64)));
+}
+
+/*
+ *  Chip of IRQs registered from now on
+ */
+void
+IrqSetDefaultChip(IRQCHIP *chip)
+{
+	defaultchip = chip;
+}
+
+IRQCHIP *
+IrqDefaultChip(void)
+{
+	return defaultchip;
+}
+
+/*
+ *  Register @src on @irqno, or on a newly allocated vector if @irqno is
+ *  negative.  Sources registered on the same irqno share it.  A private
+ *  IRQ is only seen by the calling CPU.
+ */
 IRQ *
-NewIRQ(int irqno, IRQSOURCE *src, bool priv)
+NewIRQ(int irqno, IRQSOURCE *src)
 {
+	bool priv = !!(src->Flags & IRQ_PRIVATE);
+	bool allocated = irqno < 0;
+	IRQSOURCE **tail;
+	IRQCHIP *chip;
 	IRQ *irq;
+	ulong flags;
 
-	irq = Alloc();	// XXX: malloc
-	
-	if (!irq)
+	if (irqno < 0)
 	{
-		return NULL;
+		irqno = IrqAllocVector();
+		if (irqno < 0)
+		{
+			KWARN("out of vectors\n");
+			return NULL;
+		}
 	}
 
-	if (irqno < 0)
+	if (irqno >= NR_IRQ)
 	{
-		// TODO: Allocate new irqno
 		return NULL;
 	}
 
-	if (priv)
+	irq = priv ? &MYCPU(irqlocal)[irqno] : &irqdesc[irqno];
+
+	src->Next = NULL;
+
+	flags = SpinLockIrqSave(&irqlock);
+
+	if (!(irq->Flags & IRQ_USED))
 	{
-		// TODO
-		irq->Chip = NULL;
+		chip = src->Chip ? src->Chip : defaultchip;
+
+		irq->Irqno = irqno;
+		irq->Chip = chip;
+		irq->Hwirq = src->Hwirq;
+		irq->Cpu = CpuId();
+		irq->Src = src;
+		irq->Flags = src->Flags;	// not visible before IRQ_USED
+
+		if (chip && chip->Setup && chip->Setup(irq))
+		{
+			if (allocated)
+			{
+				IrqFreeVector(irqno);
+			}
+			irq->Flags = 0;
+			irq = NULL;
+			goto out;
+		}
+
+		// publish the descriptor after it is filled in
+		AtomicStore(&irq->Flags, IRQ_USED | src->Flags);
+
+		if (chip && chip->Unmask)
+		{
+			chip->Unmask(irq);
+		}
+	}
+	else if (src->Chip && src->Chip != irq->Chip)
+	{
+		KWARN("irq %d: already on %s\n", irqno, irq->Chip->Name);
+		irq = NULL;
 	}
 	else
 	{
-		// TODO
-		irq->Chip = NULL;
+		for (tail = &irq->Src; *tail; tail = &(*tail)->Next)
+			;
+
+		AtomicStore(tail, src);
 	}
 
-	irq->Irqno = irqno;
-	irq->Src = src;
+out:
+	SpinUnlockIrqRestore(&irqlock, flags);
 
 	return irq;
 }
 
+/*
+ *  Deliver @irq to @cpu from now on
+ */
+int
+IrqSetAffinity(IRQ *irq, int cpu)
+{
+	IRQCHIP *chip = irq->Chip;
+	ulong flags;
+	int err;
+
+	if (irq->Flags & IRQ_PRIVATE)
+	{
+		return -1;
+	}
+	if (!chip || !chip->SetAffinity)
+	{
+		return -1;
+	}
+	if (!ArchIrqCpuTargetable(cpu))
+	{
+		return -1;
+	}
+
+	flags = SpinLockIrqSave(&irqlock);
+
+	err = chip->SetAffinity(irq, cpu);
+	if (!err)
+	{
+		irq->Cpu = cpu;
+	}
+
+	SpinUnlockIrqRestore(&irqlock, flags);
+
+	return err;
+}
+
+/*
+ *  Moderate @irq: once more than @rate interrupts per second arrive,
+ *  mask it and run its handlers from SOFTIRQ_IO in rounds of at most
+ *  @budget calls, until a round finds less than @budget events.
+ *  Handlers must return non-zero when their device has nothing pending.
+ *  @rate 0 turns moderation off.
+ */
+int
+IrqSetModeration(IRQ *irq, uint rate, uint budget)
+{
+	IRQMOD *mod = irq->Mod;
+	ulong flags;
+	uint perwindow;
+
+	if (irq->Flags & IRQ_PRIVATE)
+	{
+		return -1;
+	}
+	if (!irq->Chip || !irq->Chip->Mask || !irq->Chip->Unmask)
+	{
+		return -1;
+	}
+
+	if (!mod)
+	{
+		if (rate == 0)
+		{
+			return 0;
+		}
+
+		mod = AllocZeroPagesVa(0);	// XXX: we need malloc!!!
+		if (!mod)
+		{
+			return -1;
+		}
+	}
+
+	perwindow = rate / (1000000000 / IRQMOD_WINDOW_NSEC);
+	if (rate && perwindow == 0)
+	{
+		perwindow = 1;
+	}
+
+	flags = SpinLockIrqSave(&irqlock);
+
+	mod->Budget = budget ? budget : IRQMOD_BUDGET;
+	mod->Count = 0;
+	mod->Window = KtimeGetNs();
+	mod->Rate = perwindow;
+
+	// if it is polling with @rate 0, its next round unmasks it
+	AtomicStore(&irq->Mod, mod);
+
+	SpinUnlockIrqRestore(&irqlock, flags);
+
+	return 0;
+}
+
+/*
+ *  Count an interrupt on a moderated @irq and switch it to polling if
+ *  it came in too fast
+ */
+static void
+IrqModerate(IRQ *irq, IRQMOD *mod)
+{
+	ulong now = KtimeGetNs();
+
+	if (now - mod->Window >= IRQMOD_WINDOW_NSEC)
+	{
+		mod->Window = now;
+		mod->Count = 0;
+	}
+
+	if (++mod->Count < mod->Rate)
+	{
+		return;
+	}
+
+	SpinLock(&irqlock);
+	irq->Chip->Mask(irq);
+	SpinUnlock(&irqlock);
+
+	mod->Polling = true;
+	mod->PollStamp = now;
+	mod->nMask++;
+
+	mod->PollNext = MYCPU(pollhead);
+	MYCPU(pollhead) = irq;
+
+	SoftirqRaise(SOFTIRQ_IO);
+}
+
+/*
+ *  Run every handler on @irq once.  Returns true if one had work.
+ */
+static bool
+IrqPollOnce(IRQ *irq)
+{
+	IRQSOURCE *src;
+	bool work = false;
+
+	for (src = AtomicLoad(&irq->Src); src; src = AtomicLoad(&src->Next))
+	{
+		if (src->Handler(src) == 0)
+		{
+			work = true;
+		}
+	}
+
+	return work;
+}
+
+/*
+ *  One polling round.  Returns true if the budget was used up, i.e.
+ *  the source is still busy.
+ */
+static bool
+IrqPollRound(IRQ *irq, IRQMOD *mod)
+{
+	ulong lat = KtimeGetNs() - mod->PollStamp;
+	uint n;
+
+	mod->nRound++;
+	mod->LatSum += lat;
+	if (lat > mod->LatMax)
+	{
+		mod->LatMax = lat;
+	}
+
+	for (n = 0; n < mod->Budget; n++)
+	{
+		if (!IrqPollOnce(irq))
+		{
+			break;
+		}
+	}
+
+	mod->nPolled += n;
+	mod->PollStamp = KtimeGetNs();
+
+	return n == mod->Budget && mod->Rate;
+}
+
+/*
+ *  Load dropped: back to interrupts.  Events that arrived just before
+ *  the unmask may not raise one, so poll once more.
+ */
+static void
+IrqPollDone(IRQ *irq, IRQMOD *mod)
+{
+	uint n;
+
+	mod->Polling = false;
+	mod->Count = 0;
+	mod->Window = KtimeGetNs();
+	mod->nUnmask++;
+
+	SpinLock(&irqlock);
+	irq->Chip->Unmask(irq);
+	SpinUnlock(&irqlock);
+
+	for (n = 0; n < mod->Budget && IrqPollOnce(irq); n++)
+		;
+
+	mod->nPolled += n;
+}
+
+/*
+ *  SOFTIRQ_IO: poll this CPU's masked IRQs.  Rounds run with interrupts
+ *  off, as handlers do, and are bounded by the budget.
+ */
+static void
+IrqPollSoftirq(void)
+{
+	ulong intr = ArchIntrSave();
+	IRQ **pp = &MYCPU(pollhead);
+	IRQ *irq;
+	bool busy = false;
+
+	while ((irq = *pp) != NULL)
+	{
+		if (IrqPollRound(irq, irq->Mod))
+		{
+			busy = true;
+			pp = &irq->Mod->PollNext;
+		}
+		else
+		{
+			*pp = irq->Mod->PollNext;
+			IrqPollDone(irq, irq->Mod);
+		}
+	}
+
+	if (busy)
+	{
+		SoftirqRaise(SOFTIRQ_IO);
+	}
+
+	ArchIntrRestore(intr);
+}
+
+/*
+ *  Interrupts taken on @irqno by @cpu
+ */
+ulong
+IrqCount(int irqno, int cpu)
+{
+	return CPU_VAR(irqcount, cpu)[irqno];
+}
+
+/*
+ *  ArchCycles() @cpu spent in the handlers of @irqno
+ */
+ulong
+IrqCycles(int irqno, int cpu)
+{
+	return CPU_VAR(irqcycles, cpu)[irqno];
+}
+
+/*
+ *  The shared descriptor of @irqno, NULL if it has none
+ */
+IRQ *
+IrqDescriptor(int irqno)
+{
+	IRQ *irq = &irqdesc[irqno];
+
+	return AtomicLoad(&irq->Flags) & IRQ_USED ? irq : NULL;
+}
+
+void
+IrqReport(void)
+{
+	IRQMOD *mod;
+	IRQ *irq;
+
+	for (int i = 0; i < NR_IRQ; i++)
+	{
+		irq = GetIRQ(i);
+		if (!irq)
+		{
+			continue;
+		}
+
+		KLOG("%3d %s %lu%s\n", i, irq->Chip ? irq->Chip->Name : "-",
+		     MYCPU(irqcount)[i], irq->Src->Next ? " shared" : "");
+
+		mod = irq->Mod;
+		if (!mod)
+		{
+			continue;
+		}
+
+		KLOG("    moderated: %lu masked %lu unmasked, %lu polled in %lu rounds, "
+		     "latency avg %lu max %lu ns\n", mod->nMask, mod->nUnmask, mod->nPolled,
+		     mod->nRound, mod->nRound ? mod->LatSum / mod->nRound : 0, mod->LatMax);
+	}
+	KLOG("%lu unclaimed\n", MYCPU(irqunclaimed));
+}
+
+/*
+ *  Run every handler registered on @irqno.  Called with interrupts off.
+ */
 int
 HandleGenericIRQ(int irqno)
 {
 	IRQ *irq;
 	IRQSOURCE *src;
-	int ret;
+	IRQMOD *mod;
+	int ret = -1;
+	u64 start;
 
 	irq = GetIRQ(irqno);
 
@@ -94,17 +533,45 @@ HandleGenericIRQ(int irqno)
 		return -1;
 	}
 
-	src = irq->Src;
+	MYCPU(irqcount)[irqno]++;
 
-	ret = src->Handler(src);
+	start = ArchCycles();
 
-	// irq->Chip->EOI(irqno);
+	for (src = AtomicLoad(&irq->Src); src; src = AtomicLoad(&src->Next))
+	{
+		if (src->Handler(src) == 0)
+		{
+			ret = 0;
+		}
+	}
+
+	MYCPU(irqcycles)[irqno] += ArchCycles() - start;
+
+	// masked before the EOI, so a level triggered line does not refire
+	mod = AtomicLoad(&irq->Mod);
+	if (mod && mod->Rate && !mod->Polling)
+	{
+		IrqModerate(irq, mod);
+	}
+
+	if (irq->Chip && irq->Chip->EOI)
+	{
+		irq->Chip->EOI(irq);
+	}
+
+	// no printing here: this runs on every interrupt
+	if (ret)
+	{
+		MYCPU(irqunclaimed)++;
+	}
 
-	return ret;
+	return 0;
 }
 
 void INIT
 IrqInit(void)
 {
+	SoftirqSetAction(SOFTIRQ_IO, IrqPollSoftirq);
+
 	ArchIrqInit();
 }
@@ -0,0 +1,323 @@
+/*
+ * Copyright (c) 2024, akarilab.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// IRQ balancing: move IRQs off busy CPUs by their measured load
+
+#include <akari/types.h>
+#include <akari/compiler.h>
+#include <akari/irqbalance.h>
+#include <akari/irq.h>
+#include <akari/irqchip.h>
+#include <akari/timeout.h>
+#include <akari/timer.h>
+#include <akari/cpu.h>
+
+#define KPREFIX		"irqbalance:"
+
+#include <akari/log.h>
+
+static IRQBALANCE balance;
+static TIMEOUT balancetimeout;
+
+// counters at the last sample
+static ulong lastcycles[NCPU][NR_IRQ];
+static ulong lastcount[NCPU][NR_IRQ];
+
+static uint lastbefore, lastafter;
+static ulong nfail;
+
+/*
+ *  Recompute the per-CPU load from where the IRQs are
+ */
+void
+IrqBalanceLoad(IRQBALANCE *b)
+{
+	IRQLOAD *l;
+
+	for (int cpu = 0; cpu < NCPU; cpu++)
+	{
+		b->CpuLoad[cpu] = b->Fixed[cpu];
+	}
+
+	for (int i = 0; i < NR_IRQ; i++)
+	{
+		l = &b->Irq[i];
+
+		if (l->Used && l->Movable)
+		{
+			b->CpuLoad[l->Cpu] += l->Load;
+		}
+	}
+}
+
+/*
+ *  (max - min) load in % of the average
+ */
+uint
+IrqBalanceImbalance(IRQBALANCE *b)
+{
+	ulong max = 0, min = ~0ul, total = 0;
+	int n = 0;
+
+	for (int cpu = 0; cpu < NCPU; cpu++)
+	{
+		if (!(b->CpuMask & (1ul << cpu)))
+		{
+			continue;
+		}
+
+		max = MAX(max, b->CpuLoad[cpu]);
+		min = MIN(min, b->CpuLoad[cpu]);
+		total += b->CpuLoad[cpu];
+		n++;
+	}
+
+	if (n < 2 || total == 0)
+	{
+		return 0;
+	}
+
+	return (max - min) * 100 / (total / n);
+}
+
+/*
+ *  One balancing round.  Picks at most one IRQ to move from the busiest
+ *  to the least busy CPU, and applies the move to @b.  Returns the irqno
+ *  and sets @to, or returns -1 if the load is even enough.
+ */
+int
+IrqBalanceStep(IRQBALANCE *b, int *to)
+{
+	int busy = -1, idle = -1, best = -1;
+	ulong total = 0, avg, diff, gain, bestgain = 0;
+	IRQLOAD *l;
+	int n = 0;
+
+	b->Round++;
+
+	IrqBalanceLoad(b);
+
+	for (int cpu = 0; cpu < NCPU; cpu++)
+	{
+		if (!(b->CpuMask & (1ul << cpu)))
+		{
+			continue;
+		}
+
+		if (busy < 0 || b->CpuLoad[cpu] > b->CpuLoad[busy])
+		{
+			busy = cpu;
+		}
+		if (idle < 0 || b->CpuLoad[cpu] < b->CpuLoad[idle])
+		{
+			idle = cpu;
+		}
+
+		total += b->CpuLoad[cpu];
+		n++;
+	}
+
+	if (n < 2)
+	{
+		return -1;
+	}
+
+	avg = total / n;
+	diff = b->CpuLoad[busy] - b->CpuLoad[idle];
+
+	// hysteresis: small or noisy differences do not move anything
+	if (diff == 0 || diff * 100 <= avg * IRQBALANCE_MIN_PCT)
+	{
+		return -1;
+	}
+
+	for (int i = 0; i < NR_IRQ; i++)
+	{
+		l = &b->Irq[i];
+
+		if (!l->Used || !l->Movable || l->Cpu != busy || l->Load == 0)
+		{
+			continue;
+		}
+		if (l->Moved && b->Round - l->Moved < IRQBALANCE_HOLD)
+		{
+			continue;
+		}
+
+		// moving more than diff would only swap the imbalance
+		if (l->Load >= diff)
+		{
+			continue;
+		}
+
+		gain = MIN(l->Load, diff - l->Load);
+		if (gain > bestgain)
+		{
+			bestgain = gain;
+			best = i;
+		}
+	}
+
+	if (best < 0)
+	{
+		return -1;
+	}
+
+	l = &b->Irq[best];
+	l->Cpu = idle;
+	l->Moved = b->Round;
+	b->nMove++;
+
+	IrqBalanceLoad(b);
+
+	*to = idle;
+
+	return best;
+}
+
+/*
+ *  Fill @b with the load of every online CPU since the last sample
+ */
+static void
+IrqBalanceSample(IRQBALANCE *b)
+{
+	IRQLOAD *l;
+	IRQ *irq;
+	ulong cycles, count, d;
+
+	b->CpuMask = 0;
+
+	for (int cpu = 0; cpu < NCPU; cpu++)
+	{
+		if (CpuOnline(cpu) && ArchIrqCpuTargetable(cpu))
+		{
+			b->CpuMask |= 1ul << cpu;
+		}
+	}
+
+	for (int cpu = 0; cpu < NCPU; cpu++)
+	{
+		b->Fixed[cpu] = 0;
+	}
+
+	for (int i = 0; i < NR_IRQ; i++)
+	{
+		l = &b->Irq[i];
+		irq = IrqDescriptor(i);
+
+		l->Used = !!irq;
+		l->Movable = irq && !(irq->Flags & IRQ_PRIVATE) &&
+			     irq->Chip && irq->Chip->SetAffinity;
+		l->Cpu = irq ? irq->Cpu : 0;
+		l->Load = 0;
+
+		for (int cpu = 0; cpu < NCPU; cpu++)
+		{
+			if (!CpuOnline(cpu))
+			{
+				continue;
+			}
+
+			cycles = IrqCycles(i, cpu);
+			count = IrqCount(i, cpu);
+
+			d = cycles - lastcycles[cpu][i] +
+			    (count - lastcount[cpu][i]) * IRQBALANCE_ENTRY_COST;
+
+			lastcycles[cpu][i] = cycles;
+			lastcount[cpu][i] = count;
+
+			// a movable IRQ takes its load along wherever it goes
+			if (l->Movable)
+			{
+				l->Load += d;
+			}
+			else
+			{
+				b->Fixed[cpu] += d;
+			}
+		}
+	}
+}
+
+static void
+IrqBalanceTimeout(TIMEOUT *t)
+{
+	IRQBALANCE *b = &balance;
+	int irqno, to;
+
+	IrqBalanceSample(b);
+	IrqBalanceLoad(b);
+
+	lastbefore = IrqBalanceImbalance(b);
+
+	irqno = IrqBalanceStep(b, &to);
+	if (irqno >= 0 && IrqSetAffinity(IrqDescriptor(irqno), to) != 0)
+	{
+		nfail++;
+	}
+
+	lastafter = IrqBalanceImbalance(b);
+
+	TimeoutArm(t, IRQBALANCE_INTERVAL);
+}
+
+void
+IrqBalanceReport(void)
+{
+	IRQBALANCE *b = &balance;
+
+	KLOG("%lu rounds, %lu moves (%lu failed), imbalance %u%% -> %u%%\n",
+	     b->Round, b->nMove, nfail, lastbefore, lastafter);
+
+	for (int cpu = 0; cpu < NCPU; cpu++)
+	{
+		if (b->CpuMask & (1ul << cpu))
+		{
+			KLOG("  cpu%d: %lu cycles\n", cpu, b->CpuLoad[cpu]);
+		}
+	}
+}
+
+/*
+ *  Start balancing on this CPU, once the other CPUs are online
+ */
+void INIT
+IrqBalanceInit(void)
+{
+	if (CpuOnlineCount() < 2)
+	{
+		KLOG("one CPU, not balancing\n");
+		return;
+	}
+
+	IrqBalanceSample(&balance);
+
+	TimeoutInit(&balancetimeout, IrqBalanceTimeout, NULL);
+	TimeoutArm(&balancetimeout, IRQBALANCE_INTERVAL);
+}
@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2024, akarilab.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// IRQ balancer under a synthetic interrupt load
+
+#include <akari/types.h>
+#include <akari/compiler.h>
+#include <akari/bench.h>
+#include <akari/irqbalance.h>
+
+#define KPREFIX		"bench/irqbalance:"
+
+#include <akari/log.h>
+
+#define NBENCHCPU	4
+#define NBENCHIRQ	24
+#define NROUND		64
+
+static IRQBALANCE benchbalance;
+static ulong baseload[NBENCHIRQ];
+
+static inline ulong
+NextRand(ulong x)
+{
+	// xorshift
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+
+	return x;
+}
+
+/*
+ *  Run @nround rounds on @b, returns the number of moves
+ */
+static ulong
+Rounds(IRQBALANCE *b, int nround)
+{
+	ulong moves = b->nMove;
+	int to;
+
+	for (int r = 0; r < nround; r++)
+	{
+		IrqBalanceStep(b, &to);
+	}
+
+	return b->nMove - moves;
+}
+
+/*
+ *  NBENCHIRQ skewed IRQs all start on CPU0, as at boot.  Then the load
+ *  jitters by up to 1/8, which must not move anything, and finally the
+ *  traffic shifts to a few IRQs.
+ */
+static void
+IrqBalanceBench(void)
+{
+	IRQBALANCE *b = &benchbalance;
+	ulong rnd = 88172645463325252ul;
+	IRQLOAD *l;
+	uint before;
+	ulong moves;
+
+	b->CpuMask = (1ul << NBENCHCPU) - 1;
+	b->Fixed[0] = 20000;	// CPU0's timer tick
+
+	for (int i = 0; i < NBENCHIRQ; i++)
+	{
+		rnd = NextRand(rnd);
+		l = &b->Irq[0x80 + i];
+
+		l->Used = true;
+		l->Movable = true;
+		l->Cpu = 0;
+		l->Load = 1000 + (rnd % 100000) / (i + 1);
+		baseload[i] = l->Load;
+	}
+
+	IrqBalanceLoad(b);
+	before = IrqBalanceImbalance(b);
+	moves = Rounds(b, NROUND);
+
+	KLOG("boot: imbalance %u%% -> %u%%, %lu moves\n", before,
+	     IrqBalanceImbalance(b), moves);
+
+	moves = b->nMove;
+
+	for (int r = 0; r < NROUND; r++)
+	{
+		for (int i = 0; i < NBENCHIRQ; i++)
+		{
+			rnd = NextRand(rnd);
+			b->Irq[0x80 + i].Load = baseload[i] - baseload[i] / 8 +
+						rnd % (baseload[i] / 4 + 1);
+		}
+
+		Rounds(b, 1);
+	}
+
+	IrqBalanceLoad(b);
+	KLOG("jitter: imbalance %u%%, %lu moves\n", IrqBalanceImbalance(b),
+	     b->nMove - moves);
+
+	for (int i = 0; i < 3; i++)
+	{
+		b->Irq[0x80 + NBENCHIRQ - 1 - i].Load *= 20;
+	}
+
+	IrqBalanceLoad(b);
+	before = IrqBalanceImbalance(b);
+	moves = Rounds(b, NROUND);
+
+	KLOG("shift: imbalance %u%% -> %u%%, %lu moves\n", before,
+	     IrqBalanceImbalance(b), moves);
+}
+
+DEFINE_BENCH(IrqBalance, IrqBalanceBench);
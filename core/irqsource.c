@@ -37,8 +37,13 @@
 
 #include <akari/log.h>
 
+/*
+ *  Handle @hwirq of @chip on @irqno, or on a new vector if @irqno is
+ *  negative
+ */
 IRQSOURCE *
-NewIRQSource(void *device, int (*handler)(IRQSOURCE *), int irqno, bool private)
+NewChipIRQSource(void *device, int (*handler)(IRQSOURCE *), int irqno,
+		 IRQCHIP *chip, int hwirq, uint flags)
 {
 	IRQSOURCE *irqsrc;
 
@@ -51,17 +56,29 @@ NewIRQSource(void *device, int (*handler)(IRQSOURCE *), int irqno, bool private)
 
 	irqsrc->Device = device;
 	irqsrc->Handler = handler;
+	irqsrc->Chip = chip;
+	irqsrc->Hwirq = hwirq;
+	irqsrc->Flags = flags;
 
-	irqsrc->Irq = NewIRQ(irqno, irqsrc, private);
+	irqsrc->Irq = NewIRQ(irqno, irqsrc);
 
 	if (!irqsrc->Irq)
 	{
 		goto free;
 	}
 
+	irqsrc->Chip = irqsrc->Irq->Chip;
+
 	return irqsrc;
 
 free:
 	Free(irqsrc);
 	return NULL;
 }
+
+IRQSOURCE *
+NewIRQSource(void *device, int (*handler)(IRQSOURCE *), int irqno, bool private)
+{
+	return NewChipIRQSource(device, handler, irqno, NULL, -1,
+				private ? IRQ_PRIVATE : 0);
+}
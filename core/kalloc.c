@@ -177,18 +177,30 @@ __AllocPages(KALLOCBLOCK *kb, uint order)
 PAGE *
 AllocPages(uint order)
 {
-	return __AllocPages(&kblock, order);
+	PAGE *p;
+
+	p = __AllocPages(&kblock, order);
+
+	if (p)
+	{
+		p->Refcnt = 1;
+		p->Order = order;
+	}
+
+	return p;
 }
 
 void *
 AllocZeroPagesVa(uint order)
 {
+	PAGE *page;
 	void *va;
 
-	va = Page2Va(AllocPages(order));
+	page = AllocPages(order);
 
-	if (va)
+	if (page)
 	{
+		va = Page2Va(page);
 		memset(va, 0, 1 << order << PAGESHIFT);
 		return va;
 	}
@@ -238,9 +250,28 @@ MergePage(KALLOCBLOCK *kb, PAGE *page, uint order)
 void
 FreePages(PAGE *page, uint order)
 {
+	page->Refcnt = 0;
+
 	MergePage(&kblock, page, order);
 }
 
+/*
+ *  Drop a reference to @page, freeing it when the last mapping goes away.
+ */
+void
+PagePut(PAGE *page)
+{
+	if (page->Refcnt == 0)
+	{
+		Panic("PagePut: page %p is already free", Page2Pa(page));
+	}
+
+	if (--page->Refcnt == 0)
+	{
+		MergePage(&kblock, page, page->Order);
+	}
+}
+
 static void INIT
 InitPageBlock(MEMBLOCK *block)
 {
@@ -35,8 +35,13 @@
 #include <akari/sysmem.h>
 #include <akari/kalloc.h>
 #include <akari/string.h>
+#include <akari/timer.h>
+#include <akari/smpcall.h>
+#include <akari/cpu.h>
 #include <arch/mm.h>
 #include <arch/memlayout.h>
+#include <arch/clockpage.h>
+#include <arch/cpu.h>
 
 #define KPREFIX		"mm:"
 
@@ -47,7 +52,20 @@
  */
 static VAS kernvas;
 
-#define SwitchVas	ArchSwitchVas
+static VAS *curvas PERCPU;
+
+bool HugepageEnabled = true;
+HUGEPAGESTAT HugepageStat;
+
+#define NPTE		(PAGESIZE / sizeof(PTE))
+
+void
+SwitchVas(VAS *vas)
+{
+	MYCPU(curvas) = vas;
+
+	ArchSwitchVas(vas);
+}
 
 void
 SwitchKvas(void)
@@ -55,46 +73,307 @@ SwitchKvas(void)
 	SwitchVas(&kernvas);
 }
 
+VAS *
+CurrentVas(void)
+{
+	return MYCPU(curvas);
+}
+
+static inline bool
+UserVa(ulong va)
+{
+	return va < USER_VA_END;
+}
+
+/*
+ *  Number of top-level entries covering the user half
+ */
+static inline uint
+UserPgdirEntries(VAS *vas)
+{
+	return PIDX(vas->Level, USER_VA_END - 1) + 1;
+}
+
+/*
+ *  PAGE of the page table containing @pte
+ */
+static inline PAGE *
+PgtPage(PTE *pte)
+{
+	return Va2Page((void *)PAGEALIGNDOWN(pte));
+}
+
+static PAGETABLE
+VasAllocPgt(VAS *vas)
+{
+	PAGETABLE pgt;
+
+	pgt = Zalloc();
+	if (!pgt)
+	{
+		return NULL;
+	}
+
+	Va2Page(pgt)->nPte = 0;
+	vas->nPgt++;
+
+	return pgt;
+}
+
+static void
+VasFreePgt(VAS *vas, PAGETABLE pgt)
+{
+	Free(pgt);
+	vas->nPgt--;
+}
+
+/*
+ *  Page tables unlinked by unmap stay allocated until the TLB has been
+ *  flushed on every CPU: until then a paging-structure cache may still
+ *  reference them.
+ */
+static void
+VasDeferFreePgt(VAS *vas, PAGE *page)
+{
+	page->Next = vas->PgtFree;
+	vas->PgtFree = page;
+}
+
+static void
+VasReclaimPgt(VAS *vas)
+{
+	PAGE *page;
+
+	while ((page = vas->PgtFree) != NULL)
+	{
+		vas->PgtFree = page->Next;
+
+		FreePages(page, 0);
+		vas->nPgt--;
+	}
+}
+
+static VMAREA *
+VasFindArea(VAS *vas, ulong va)
+{
+	VMAREA *a;
+
+	for (a = vas->Area; a < &vas->Area[vas->nArea]; a++)
+	{
+		if (a->Start <= va && va < a->End)
+		{
+			return a;
+		}
+	}
+
+	return NULL;
+}
+
+static bool
+VasAreaOverlap(VAS *vas, ulong start, ulong end)
+{
+	VMAREA *a;
+
+	for (a = vas->Area; a < &vas->Area[vas->nArea]; a++)
+	{
+		if (a->Start < end && start < a->End)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ *  Whether areas cover [@start, @end) without a gap
+ */
+static bool
+VasAreaCovers(VAS *vas, ulong start, ulong end)
+{
+	VMAREA *a;
+
+	while (start < end)
+	{
+		a = VasFindArea(vas, start);
+		if (!a)
+		{
+			return false;
+		}
+
+		start = a->End;
+	}
+
+	return true;
+}
+
+static int
+VasInsertArea(VAS *vas, ulong start, ulong end, PTEFLAGS flags)
+{
+	VMAREA *a;
+	uint idx;
+
+	if (vas->nArea >= NVMAREA)
+	{
+		return -1;
+	}
+
+	for (idx = 0; idx < vas->nArea; idx++)
+	{
+		if (start < vas->Area[idx].Start)
+		{
+			break;
+		}
+	}
+
+	memmove(vas->Area + idx + 1, vas->Area + idx, (vas->nArea - idx) * sizeof(VMAREA));
+
+	a = &vas->Area[idx];
+	a->Start = start;
+	a->End = end;
+	a->Flags = flags;
+
+	vas->nArea++;
+
+	return 0;
+}
+
+static void
+VasRemoveArea(VAS *vas, uint idx)
+{
+	memmove(vas->Area + idx, vas->Area + idx + 1, (vas->nArea - idx - 1) * sizeof(VMAREA));
+	vas->nArea--;
+}
+
+/*
+ *  Make @va an area boundary
+ */
+static int
+VasSplitArea(VAS *vas, ulong va)
+{
+	VMAREA *a;
+	ulong end;
+
+	a = VasFindArea(vas, va);
+
+	if (!a || a->Start == va)
+	{
+		return 0;
+	}
+
+	end = a->End;
+	a->End = va;
+
+	if (VasInsertArea(vas, va, end, a->Flags) < 0)
+	{
+		a->End = end;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+VasRemoveAreas(VAS *vas, ulong start, ulong end)
+{
+	if (VasSplitArea(vas, start) < 0 || VasSplitArea(vas, end) < 0)
+	{
+		return -1;
+	}
+
+	for (uint i = 0; i < vas->nArea; )
+	{
+		if (start <= vas->Area[i].Start && vas->Area[i].End <= end)
+		{
+			VasRemoveArea(vas, i);
+			continue;
+		}
+
+		i++;
+	}
+
+	return 0;
+}
+
+/*
+ *  Walk down to the entry of @va in the level @tolevel table.
+ *  The walk stops early at a huge leaf.  *@plevel is set to the level of
+ *  the returned entry, or of the missing entry when NULL is returned.
+ */
 static PTE *
-VasPageWalk(VAS *vas, ulong va, bool allocpgt)
+__VasPageWalk(VAS *vas, ulong va, bool allocpgt, uint tolevel, uint *plevel)
 {
 	PAGETABLE pgt = vas->Pgdir;
 	uint level;
 	uint vlevel = vas->Level;
-	uint vll = vas->LowestLevel;
 	PHYSADDR pgtpa;
 	PTE *pte;
 
-	for (level = vlevel; level > vll; level--)
+	for (level = vlevel; level > tolevel; level--)
 	{
 		pte = &pgt[PIDX(level, va)];
 
 		if (PPresent(*pte))
 		{
+			if (level == HUGEPAGE_LEVEL && PHuge(*pte))
+			{
+				break;
+			}
+
 			pgtpa = PTE_PA(*pte);
 			pgt = (PAGETABLE)P2V(pgtpa);
 		}
 		else if (allocpgt)
 		{
-			pgt = Zalloc();
+			pgt = VasAllocPgt(vas);
 			if (!pgt)
 			{
+				*plevel = level;
 				return NULL;
 			}
 			pgtpa = V2P(pgt);
 
-			ArchSetPtePgt(pte, pgtpa);
+			PgtPage(pte)->nPte++;
+
+			if (vas->User && UserVa(va))
+			{
+				ArchSetPtePgtUser(pte, pgtpa);
+			}
+			else
+			{
+				ArchSetPtePgt(pte, pgtpa);
+			}
 		}
 		else
 		{
 			// unmapped
+			*plevel = level;
 			return NULL;
 		}
 	}
 
+	*plevel = level;
+
 	return &pgt[PIDX(level, va)];
 }
 
+static PTE *
+VasPageWalk(VAS *vas, ulong va, bool allocpgt)
+{
+	uint level;
+	PTE *pte;
+
+	pte = __VasPageWalk(vas, va, allocpgt, vas->LowestLevel, &level);
+
+	// huge leaves are only handled by the anonymous memory paths
+	if (pte && level != vas->LowestLevel)
+	{
+		return NULL;
+	}
+
+	return pte;
+}
+
 static void
 VasMapPages(VAS *vas, ulong va, PHYSADDR pa, ulong size, PTEFLAGS flags, bool remap)
 {
@@ -108,15 +387,185 @@ VasMapPages(VAS *vas, ulong va, PHYSADDR pa, ulong size, PTEFLAGS flags, bool re
 		{
 			Panic("null pte %p", va);
 		}
-		if (!remap && PPresent(*pte))
+		if (PPresent(*pte))
+		{
+			if (!remap)
+			{
+				Panic("this entry has been used: va %p", va);
+			}
+		}
+		else
 		{
-			Panic("this entry has been used: va %p", va);
+			PgtPage(pte)->nPte++;
 		}
 
 		ArchSetPteLeaf(pte, pa, flags);
 	}
 }
 
+static int VasSplitHuge(VAS *vas, PTE *pde, ulong va);
+
+/*
+ *  Clear the leaf entry of @va and unlink the page tables it leaves empty.
+ *  A huge leaf only partly inside [@va, @end) is split first.
+ *  Returns the number of bytes covered, so that holes are skipped quickly,
+ *  or 0 if a huge page could not be split.
+ */
+static ulong
+VasUnmapPage(VAS *vas, ulong va, ulong end)
+{
+	PAGETABLE path[8];
+	PAGETABLE pgt = vas->Pgdir;
+	PAGE *page;
+	ulong size;
+	uint level;
+	PTE *pte;
+
+	for (level = vas->Level; level > vas->LowestLevel; level--)
+	{
+		path[level] = pgt;
+		pte = &pgt[PIDX(level, va)];
+
+		if (!PPresent(*pte))
+		{
+			size = PLEVELSIZE(level);
+			return size - (va & (size - 1));
+		}
+
+		if (level == HUGEPAGE_LEVEL && PHuge(*pte))
+		{
+			if (ALIGNDOWN(va, HUGEPAGESIZE) == va && va + HUGEPAGESIZE <= end)
+			{
+				break;
+			}
+
+			if (VasSplitHuge(vas, pte, va) < 0)
+			{
+				return 0;
+			}
+		}
+
+		pgt = (PAGETABLE)P2V(PTE_PA(*pte));
+	}
+
+	path[level] = pgt;
+	pte = &pgt[PIDX(level, va)];
+
+	if (!PPresent(*pte))
+	{
+		return PAGESIZE;
+	}
+
+	if (vas->User)
+	{
+		PagePut(Pa2Page(PTE_PA(*pte)));
+	}
+
+	*pte = 0;
+	size = PLEVELSIZE(level);
+
+	for (; level < vas->Level; level++)
+	{
+		page = Va2Page(path[level]);
+
+		if (--page->nPte > 0)
+		{
+			break;
+		}
+
+		// kernel tables below the pgdir are shared by every user pgdir
+		if (!UserVa(va) && level == vas->Level - 1)
+		{
+			break;
+		}
+
+		path[level + 1][PIDX(level + 1, va)] = 0;
+
+		VasDeferFreePgt(vas, page);
+	}
+
+	return size;
+}
+
+static void
+VasShootdownCpu(void *arg)
+{
+	ArchFlushTlb((VAS *)arg);
+}
+
+/*
+ *  Flush all of @vas on the other online CPUs that have it loaded
+ */
+static void
+VasShootdown(VAS *vas)
+{
+	ulong others = CpuOnlineMask & ~(1ul << CpuId());
+
+	if (others)
+	{
+		SmpCallMask(others, VasShootdownCpu, vas);
+	}
+}
+
+/*
+ *  Flush [@va, @va + @size) on this CPU, and @vas on the others, before
+ *  the pages and page tables that were mapped there are reused.
+ */
+static void
+VasFlushRange(VAS *vas, ulong va, ulong size)
+{
+	VasShootdown(vas);
+
+	if (size <= 32 * PAGESIZE)
+	{
+		for (ulong p = 0; p < size; p += PAGESIZE)
+		{
+			ArchFlushTlbPage(vas, va + p);
+		}
+	}
+	else
+	{
+		ArchFlushTlb(vas);
+	}
+}
+
+/*
+ *  Unmap [@va, @va + @size).  Pages of a user address space are released,
+ *  page tables left empty are freed once the TLB has been flushed.
+ *  When out of memory, the range may be left partly unmapped.
+ */
+int
+VasUnmap(VAS *vas, ulong va, ulong size)
+{
+	ulong end = va + size;
+	ulong done;
+
+	if (!PAGEALIGNED(va) || !PAGEALIGNED(size))
+	{
+		return -1;
+	}
+	if (VasRemoveAreas(vas, va, end) < 0)
+	{
+		return -1;
+	}
+
+	for (ulong p = va; p < end; p += done)
+	{
+		done = VasUnmapPage(vas, p, end);
+		if (!done)
+		{
+			VasFlushRange(vas, va, p - va);
+			VasReclaimPgt(vas);
+			return -1;
+		}
+	}
+
+	VasFlushRange(vas, va, size);
+	VasReclaimPgt(vas);
+
+	return 0;
+}
+
 static PHYSADDR
 Addrwalk(VAS *vas, ulong va)
 {
@@ -170,16 +619,748 @@ KIOmap(PHYSADDR pa, ulong nbytes)
 	return va;
 }
 
-static void INIT
-InitKvas(void)
+/*
+ *  Map the clock page read-only at CLOCKPAGE_VA
+ */
+static int
+VasMapClockPage(VAS *vas)
 {
-	ArchInitKvas(&kernvas);
-
-	kernvas.User = false;
+	PAGE *page = ClockPage();
+	PTE *pte;
 
-	if (!kernvas.Pgdir)
+	if (!page)
 	{
-		Panic("NULL pgdir");
+		return 0;
+	}
+
+	pte = VasPageWalk(vas, CLOCKPAGE_VA, true);
+	if (!pte)
+	{
+		return -1;
+	}
+
+	PageGet(page);
+
+	ArchSetPteLeaf(pte, Page2Pa(page), PTEFLAG_USER);
+	PgtPage(pte)->nPte++;
+
+	return 0;
+}
+
+static VAS *
+__NewVas(bool clockpage)
+{
+	VAS *vas;
+	PAGE *page;
+	PAGETABLE pgdir;
+	uint nuser;
+
+	page = AllocPages(0);	// XXX: malloc
+	if (!page)
+	{
+		return NULL;
+	}
+
+	vas = Page2Va(page);
+	memset(vas, 0, sizeof *vas);
+
+	pgdir = VasAllocPgt(vas);
+	if (!pgdir)
+	{
+		Free(vas);
+		return NULL;
+	}
+
+	vas->Pgdir = pgdir;
+	vas->User = true;
+
+	ArchInitUvas(vas);
+
+	/*
+	 * The kernel half is shared by pointer: its entries were preallocated
+	 * at boot and never change.
+	 */
+	nuser = UserPgdirEntries(vas);
+
+	memcpy(pgdir + nuser, kernvas.Pgdir + nuser, (NPTE - nuser) * sizeof(PTE));
+
+	if (clockpage && VasMapClockPage(vas) < 0)
+	{
+		FreeVas(vas);
+		return NULL;
+	}
+
+	return vas;
+}
+
+/*
+ *  Create an empty user address space.
+ *  Only the clock page is mapped.
+ */
+VAS *
+NewVas(void)
+{
+	return __NewVas(true);
+}
+
+static void
+VasFreeTable(VAS *vas, PAGETABLE pgt, uint level, uint nent)
+{
+	PAGETABLE next;
+	PTE pte;
+
+	for (uint i = 0; i < nent; i++)
+	{
+		pte = pgt[i];
+
+		if (!PPresent(pte))
+		{
+			continue;
+		}
+
+		if (level == vas->LowestLevel || (level == HUGEPAGE_LEVEL && PHuge(pte)))
+		{
+			PagePut(Pa2Page(PTE_PA(pte)));
+		}
+		else
+		{
+			next = (PAGETABLE)P2V(PTE_PA(pte));
+
+			VasFreeTable(vas, next, level - 1, NPTE);
+			VasFreePgt(vas, next);
+		}
+	}
+}
+
+/*
+ *  Release all user mappings of @vas and @vas itself.
+ *  The kernel half is shared and left untouched.
+ */
+void
+FreeVas(VAS *vas)
+{
+	if (!vas->User)
+	{
+		Panic("FreeVas: kernel address space");
+	}
+	if (vas == CurrentVas())
+	{
+		Panic("FreeVas: address space in use");
+	}
+
+	VasFreeTable(vas, vas->Pgdir, vas->Level, UserPgdirEntries(vas));
+	VasReclaimPgt(vas);
+
+	VasFreePgt(vas, vas->Pgdir);
+	Free(vas);
+}
+
+/*
+ *  Reserve [@va, @va + @size) of user space for zero-filled anonymous
+ *  memory.  Pages are allocated on first touch by VasAnonFault().
+ */
+int
+VasMapAnon(VAS *vas, ulong va, ulong size, PTEFLAGS flags)
+{
+	if (!vas->User || size == 0 || !PAGEALIGNED(va) || !PAGEALIGNED(size) ||
+	    va + size > CLOCKPAGE_VA || va + size < va)
+	{
+		return -1;
+	}
+	if (VasAreaOverlap(vas, va, va + size))
+	{
+		return -1;
+	}
+
+	return VasInsertArea(vas, va, va + size, flags);
+}
+
+/*
+ *  Back the 2MiB-aligned range around @va with a huge page if the area
+ *  covers all of it and nothing is mapped there yet.
+ */
+static int
+VasHugeFault(VAS *vas, VMAREA *area, ulong va)
+{
+	ulong base = ALIGNDOWN(va, HUGEPAGESIZE);
+	PAGE *page;
+	uint level;
+	PTE *pde;
+
+	if (!HugepageEnabled || base < area->Start || area->End < base + HUGEPAGESIZE)
+	{
+		return -1;
+	}
+
+	pde = __VasPageWalk(vas, base, true, HUGEPAGE_LEVEL, &level);
+
+	if (!pde || PPresent(*pde))
+	{
+		return -1;
+	}
+
+	page = AllocPages(HUGEPAGE_ORDER);
+	if (!page)
+	{
+		HugepageStat.nFallback++;
+		return -1;
+	}
+
+	memset(Page2Va(page), 0, HUGEPAGESIZE);
+
+	ArchSetPteHuge(pde, Page2Pa(page), area->Flags | PTEFLAG_USER);
+	PgtPage(pde)->nPte++;
+
+	HugepageStat.nFault++;
+
+	return 0;
+}
+
+/*
+ *  Resolve a fault on a not-present page of an anonymous area.
+ */
+int
+VasAnonFault(VAS *vas, ulong va)
+{
+	VMAREA *area;
+	void *page;
+	uint level;
+	PTE *pte;
+
+	if (!vas || !vas->User || !UserVa(va))
+	{
+		return -1;
+	}
+
+	area = VasFindArea(vas, va);
+	if (!area)
+	{
+		return -1;
+	}
+
+	if (VasHugeFault(vas, area, va) == 0)
+	{
+		return 0;
+	}
+
+	pte = __VasPageWalk(vas, va, true, vas->LowestLevel, &level);
+	if (!pte)
+	{
+		return -1;
+	}
+	if (PPresent(*pte))
+	{
+		return 0;
+	}
+
+	page = Zalloc();
+	if (!page)
+	{
+		return -1;
+	}
+
+	ArchSetPteLeaf(pte, V2P(page), area->Flags | PTEFLAG_USER);
+	PgtPage(pte)->nPte++;
+
+	return 0;
+}
+
+/*
+ *  Fault in [@va, @va + @size) ahead of time.
+ */
+int
+VasPopulate(VAS *vas, ulong va, ulong size)
+{
+	for (ulong p = PAGEALIGNDOWN(va); p < va + size; p += PAGESIZE)
+	{
+		if (VasAnonFault(vas, p) < 0)
+		{
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ *  Replace the huge leaf *@pde covering @va with a table of 4K entries.
+ *  An exclusively owned huge page is broken up in place, a shared one is
+ *  copied so that this address space gets private pages.
+ */
+static int
+VasSplitHuge(VAS *vas, PTE *pde, ulong va)
+{
+	PHYSADDR pa = PTE_PA(*pde);
+	PAGE *head, *page;
+	PAGETABLE pt;
+	bool shared;
+
+	pt = VasAllocPgt(vas);
+	if (!pt)
+	{
+		return -1;
+	}
+
+	head = Pa2Page(pa);
+	shared = head->Refcnt > 1;
+
+	if (!shared)
+	{
+		for (uint i = 0; i < NPTE; i++)
+		{
+			page = Pa2Page(pa + i * PAGESIZE);
+			page->Refcnt = 1;
+			page->Order = 0;
+
+			pt[i] = ArchHugeToPte(*pde, pa + i * PAGESIZE);
+		}
+	}
+	else
+	{
+		for (uint i = 0; i < NPTE; i++)
+		{
+			page = AllocPages(0);
+			if (!page)
+			{
+				for (uint j = 0; j < i; j++)
+				{
+					PagePut(Pa2Page(PTE_PA(pt[j])));
+				}
+				VasFreePgt(vas, pt);
+				return -1;
+			}
+
+			memcpy(Page2Va(page), P2V(pa + i * PAGESIZE), PAGESIZE);
+
+			pt[i] = ArchHugeToPte(*pde, Page2Pa(page));
+
+			if (PCow(pt[i]))
+			{
+				ArchBreakPteCow(&pt[i], Page2Pa(page));
+			}
+		}
+	}
+
+	Va2Page(pt)->nPte = NPTE;
+
+	ArchSetPtePgtUser(pde, V2P(pt));
+	VasFlushRange(vas, ALIGNDOWN(va, HUGEPAGESIZE), HUGEPAGESIZE);
+
+	// copied: no CPU can reach the shared huge page any more
+	if (shared)
+	{
+		PagePut(head);
+	}
+
+	HugepageStat.nSplit++;
+
+	return 0;
+}
+
+/*
+ *  Rewrite the permissions of a present leaf.  Writable pages that are
+ *  still shared stay copy-on-write.
+ */
+static void
+VasSetLeafProt(PTE *pte, uint level, PTEFLAGS flags)
+{
+	PHYSADDR pa = PTE_PA(*pte);
+	bool shared = Pa2Page(pa)->Refcnt > 1;
+
+	flags |= PTEFLAG_USER;
+
+	if (level == HUGEPAGE_LEVEL)
+	{
+		ArchSetPteHuge(pte, pa, flags);
+	}
+	else
+	{
+		ArchSetPteLeaf(pte, pa, flags);
+	}
+
+	if (shared)
+	{
+		ArchSetPteCow(pte);
+	}
+}
+
+/*
+ *  Returns the size done, 0 if a huge page could not be split
+ */
+static ulong
+VasProtectPage(VAS *vas, ulong va, ulong end, PTEFLAGS flags)
+{
+	ulong size;
+	uint level;
+	PTE *pte;
+
+	pte = __VasPageWalk(vas, va, false, vas->LowestLevel, &level);
+
+	if (!pte || !PPresent(*pte))
+	{
+		size = PLEVELSIZE(level);
+		return size - (va & (size - 1));
+	}
+
+	if (level == HUGEPAGE_LEVEL)
+	{
+		if (ALIGNDOWN(va, HUGEPAGESIZE) == va && va + HUGEPAGESIZE <= end)
+		{
+			VasSetLeafProt(pte, level, flags);
+			return HUGEPAGESIZE;
+		}
+
+		if (VasSplitHuge(vas, pte, va) < 0)
+		{
+			return 0;
+		}
+
+		pte = __VasPageWalk(vas, va, false, vas->LowestLevel, &level);
+	}
+
+	VasSetLeafProt(pte, level, flags);
+
+	return PAGESIZE;
+}
+
+/*
+ *  Change the permissions of [@va, @va + @size) of user space, which
+ *  must be covered by anon areas.  When out of memory, the range may be
+ *  left partly changed.
+ */
+int
+VasProtect(VAS *vas, ulong va, ulong size, PTEFLAGS flags)
+{
+	ulong end = va + size;
+	ulong done;
+	VMAREA *a;
+
+	if (!vas->User || !PAGEALIGNED(va) || !PAGEALIGNED(size))
+	{
+		return -1;
+	}
+	// nothing else, like the clock page, may be touched
+	if (!VasAreaCovers(vas, va, end))
+	{
+		return -1;
+	}
+	if (VasSplitArea(vas, va) < 0 || VasSplitArea(vas, end) < 0)
+	{
+		return -1;
+	}
+
+	for (a = vas->Area; a < &vas->Area[vas->nArea]; a++)
+	{
+		if (va <= a->Start && a->End <= end)
+		{
+			a->Flags = flags;
+		}
+	}
+
+	for (ulong p = va; p < end; p += done)
+	{
+		done = VasProtectPage(vas, p, end, flags);
+		if (!done)
+		{
+			VasFlushRange(vas, va, p - va);
+			return -1;
+		}
+	}
+
+	VasFlushRange(vas, va, size);
+
+	return 0;
+}
+
+/*
+ *  Collapse the 512 4K pages mapping [@base, @base + 2MiB) into a huge
+ *  page.  Only fully populated ranges of exclusively owned pages qualify.
+ */
+static int
+VasCollapseOne(VAS *vas, VMAREA *area, ulong base)
+{
+	PAGETABLE pt;
+	PAGE *huge;
+	char *dst;
+	uint level;
+	PTE *pde;
+
+	pde = __VasPageWalk(vas, base, false, HUGEPAGE_LEVEL, &level);
+
+	if (!pde || !PPresent(*pde) || PHuge(*pde))
+	{
+		return -1;
+	}
+
+	pt = (PAGETABLE)P2V(PTE_PA(*pde));
+
+	if (Va2Page(pt)->nPte != NPTE)
+	{
+		return -1;
+	}
+
+	for (uint i = 0; i < NPTE; i++)
+	{
+		if (!PPresent(pt[i]) || PCow(pt[i]) || Pa2Page(PTE_PA(pt[i]))->Refcnt != 1)
+		{
+			return -1;
+		}
+	}
+
+	huge = AllocPages(HUGEPAGE_ORDER);
+	if (!huge)
+	{
+		return -1;
+	}
+
+	dst = Page2Va(huge);
+
+	for (uint i = 0; i < NPTE; i++)
+	{
+		memcpy(dst + i * PAGESIZE, P2V(PTE_PA(pt[i])), PAGESIZE);
+	}
+
+	ArchSetPteHuge(pde, Page2Pa(huge), area->Flags | PTEFLAG_USER);
+	VasFlushRange(vas, base, HUGEPAGESIZE);
+
+	// no CPU can reach the small pages any more
+	for (uint i = 0; i < NPTE; i++)
+	{
+		PagePut(Pa2Page(PTE_PA(pt[i])));
+	}
+
+	VasDeferFreePgt(vas, Va2Page(pt));
+
+	HugepageStat.nCollapse++;
+
+	return 0;
+}
+
+/*
+ *  Collapse up to @budget populated 4K ranges of the anonymous areas of
+ *  @vas into huge pages.  Returns the number collapsed.
+ *
+ *  A VAS has no lock, so only its owner may call this, never a timeout or
+ *  another CPU: collapsing under a fault or VasUnmap would free live pages.
+ */
+int
+VasCollapseHuge(VAS *vas, int budget)
+{
+	VMAREA *a;
+	int n = 0;
+
+	if (!HugepageEnabled)
+	{
+		return 0;
+	}
+
+	for (a = vas->Area; a < &vas->Area[vas->nArea] && n < budget; a++)
+	{
+		for (ulong base = ALIGN(a->Start, HUGEPAGESIZE);
+		     base + HUGEPAGESIZE <= a->End && n < budget;
+		     base += HUGEPAGESIZE)
+		{
+			if (VasCollapseOne(vas, a, base) == 0)
+			{
+				n++;
+			}
+		}
+	}
+
+	VasReclaimPgt(vas);
+
+	return n;
+}
+
+static int
+VasCloneTable(VAS *dst, PAGETABLE dpgt, PAGETABLE spgt, uint level, uint nent)
+{
+	PAGE *dpage = Va2Page(dpgt);
+	PAGETABLE next;
+	PTE *spte;
+
+	for (uint i = 0; i < nent; i++)
+	{
+		spte = &spgt[i];
+
+		if (!PPresent(*spte))
+		{
+			continue;
+		}
+
+		if (level == dst->LowestLevel || (level == HUGEPAGE_LEVEL && PHuge(*spte)))
+		{
+			// share the page read-only in both address spaces
+			ArchSetPteCow(spte);
+			PageGet(Pa2Page(PTE_PA(*spte)));
+
+			dpgt[i] = *spte;
+			dpage->nPte++;
+			continue;
+		}
+
+		next = VasAllocPgt(dst);
+		if (!next)
+		{
+			return -1;
+		}
+
+		ArchSetPtePgtUser(&dpgt[i], V2P(next));
+		dpage->nPte++;
+
+		if (VasCloneTable(dst, next, (PAGETABLE)P2V(PTE_PA(*spte)), level - 1, NPTE) < 0)
+		{
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ *  Duplicate the user half of @parent.
+ *  No data is copied here: every page becomes copy-on-write in both
+ *  address spaces and is copied by VasCowFault() on the first write.
+ */
+VAS *
+VasClone(VAS *parent)
+{
+	VAS *child;
+	int err;
+
+	// the clock page comes with the parent's mappings
+	child = __NewVas(false);
+	if (!child)
+	{
+		return NULL;
+	}
+
+	memcpy(child->Area, parent->Area, parent->nArea * sizeof(VMAREA));
+	child->nArea = parent->nArea;
+
+	err = VasCloneTable(child, child->Pgdir, parent->Pgdir, parent->Level,
+			    UserPgdirEntries(parent));
+
+	// parent's writable entries have been write-protected, on every CPU
+	VasShootdown(parent);
+	ArchFlushTlb(parent);
+
+	if (err)
+	{
+		FreeVas(child);
+		return NULL;
+	}
+
+	return child;
+}
+
+static int
+VasHugeCowFault(VAS *vas, PTE *pde, ulong va)
+{
+	PHYSADDR pa = PTE_PA(*pde);
+	PAGE *head, *new = NULL;
+
+	head = Pa2Page(pa);
+
+	if (head->Refcnt == 1)
+	{
+		ArchBreakPteCow(pde, pa);
+	}
+	else if ((new = AllocPages(HUGEPAGE_ORDER)) != NULL)
+	{
+		memcpy(Page2Va(new), P2V(pa), HUGEPAGESIZE);
+
+		ArchBreakPteCow(pde, Page2Pa(new));
+	}
+	else
+	{
+		// no free huge page: fall back to private 4K copies
+		HugepageStat.nFallback++;
+
+		return VasSplitHuge(vas, pde, va);
+	}
+
+	VasFlushRange(vas, ALIGNDOWN(va, HUGEPAGESIZE), HUGEPAGESIZE);
+
+	// no CPU can reach the old copy any more
+	if (new)
+	{
+		PagePut(head);
+	}
+
+	return 0;
+}
+
+/*
+ *  Resolve a write fault on a copy-on-write page.
+ *  The page is reused if this is the last mapping, otherwise copied.
+ */
+int
+VasCowFault(VAS *vas, ulong va)
+{
+	PTE *pte;
+	PAGE *page, *new = NULL;
+	PHYSADDR pa;
+	uint level;
+
+	if (!vas || !vas->User || !UserVa(va))
+	{
+		return -1;
+	}
+
+	pte = __VasPageWalk(vas, va, false, vas->LowestLevel, &level);
+
+	if (!pte || !PPresent(*pte) || !PCow(*pte))
+	{
+		return -1;
+	}
+
+	if (level == HUGEPAGE_LEVEL)
+	{
+		return VasHugeCowFault(vas, pte, va);
+	}
+
+	pa = PTE_PA(*pte);
+	page = Pa2Page(pa);
+
+	if (page->Refcnt == 1)
+	{
+		ArchBreakPteCow(pte, pa);
+	}
+	else
+	{
+		new = AllocPages(0);
+		if (!new)
+		{
+			return -1;
+		}
+
+		memcpy(Page2Va(new), P2V(pa), PAGESIZE);
+
+		ArchBreakPteCow(pte, Page2Pa(new));
+	}
+
+	VasFlushRange(vas, PAGEALIGNDOWN(va), PAGESIZE);
+
+	// no CPU can reach the old copy any more
+	if (new)
+	{
+		PagePut(page);
+	}
+
+	return 0;
+}
+
+static void INIT
+InitKvas(void)
+{
+	ArchInitKvas(&kernvas);
+
+	kernvas.User = false;
+
+	if (!kernvas.Pgdir)
+	{
+		Panic("NULL pgdir");
 	}
 	if (!PAGEALIGNED(kernvas.Pgdir))
 	{
@@ -189,6 +1370,29 @@ InitKvas(void)
 	memset(kernvas.Pgdir, 0, PAGESIZE);
 }
 
+/*
+ *  Populate every kernel-half entry of the kernel pgdir once at boot.
+ *  Later kernel mappings only modify lower-level tables, so these entries
+ *  never change and every user pgdir can share them without any
+ *  synchronization.
+ */
+static void INIT
+KvasPreallocPgdir(void)
+{
+	PAGETABLE pgt;
+
+	for (uint i = UserPgdirEntries(&kernvas); i < NPTE; i++)
+	{
+		pgt = VasAllocPgt(&kernvas);
+		if (!pgt)
+		{
+			Panic("cannot preallocate kernel page table");
+		}
+
+		ArchSetPtePgt(&kernvas.Pgdir[i], V2P(pgt));
+	}
+}
+
 void INIT
 KvasMap(void)
 {
@@ -197,6 +1401,7 @@ KvasMap(void)
 	PTEFLAGS flags;
 
 	InitKvas();
+	KvasPreallocPgdir();
 
 	pstart = SysmemStart();
 	pend = SysmemEnd();
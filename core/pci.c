@@ -0,0 +1,605 @@
+/*
+ * Copyright (c) 2024, akarilab.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// PCI enumeration and MSI/MSI-X
+
+#include <akari/types.h>
+#include <akari/compiler.h>
+#include <akari/pci.h>
+#include <akari/irq.h>
+#include <akari/irqsource.h>
+#include <akari/cpu.h>
+#include <akari/mm.h>
+#include <arch/irq.h>
+#include <arch/cpu.h>
+
+#define KPREFIX		"pci:"
+
+#include <akari/log.h>
+
+// MSI capability
+#define MSI_CTRL		0x2
+#define MSI_CTRL_ENABLE		0x1
+#define MSI_CTRL_64BIT		0x80
+#define MSI_CTRL_MASKBIT	0x100
+#define MSI_ADDR_LO		0x4
+#define MSI_ADDR_HI		0x8
+
+// MSI-X capability
+#define MSIX_CTRL		0x2
+#define MSIX_CTRL_SIZE_MASK	0x7ff
+#define MSIX_CTRL_MASKALL	0x4000
+#define MSIX_CTRL_ENABLE	0x8000
+#define MSIX_TABLE		0x4
+#define MSIX_TABLE_BIR_MASK	0x7
+
+// MSI-X table entry
+#define MSIX_ENTRY_SIZE		16
+#define MSIX_ENTRY_ADDR_LO	0x0
+#define MSIX_ENTRY_ADDR_HI	0x4
+#define MSIX_ENTRY_DATA		0x8
+#define MSIX_ENTRY_CTRL		0xc
+#define MSIX_ENTRY_MASKED	0x1
+
+static PCIDEV pcidevs[PCI_MAX_DEV];
+static int npcidev;
+
+u32
+PciRead32(PCIDEV *pdev, uint off)
+{
+	return ArchPciRead32(pdev->Bus, pdev->Dev, pdev->Func, off);
+}
+
+u16
+PciRead16(PCIDEV *pdev, uint off)
+{
+	return PciRead32(pdev, off) >> ((off & 2) * 8);
+}
+
+u8
+PciRead8(PCIDEV *pdev, uint off)
+{
+	return PciRead32(pdev, off) >> ((off & 3) * 8);
+}
+
+void
+PciWrite32(PCIDEV *pdev, uint off, u32 val)
+{
+	ArchPciWrite32(pdev->Bus, pdev->Dev, pdev->Func, off, val);
+}
+
+void
+PciWrite16(PCIDEV *pdev, uint off, u16 val)
+{
+	uint shift = (off & 2) * 8;
+	u32 dw;
+
+	dw = PciRead32(pdev, off & ~3);
+
+	// the status register next to command is write-1-to-clear
+	if ((off & ~3) == PCI_COMMAND)
+	{
+		dw &= 0xffff;
+	}
+
+	dw &= ~(0xffffu << shift);
+	dw |= (u32)val << shift;
+
+	PciWrite32(pdev, off & ~3, dw);
+}
+
+static void
+PciSetCommand(PCIDEV *pdev, u16 set)
+{
+	PciWrite16(pdev, PCI_COMMAND, PciRead16(pdev, PCI_COMMAND) | set);
+}
+
+/*
+ *  Physical address of memory BAR @bar, 0 for I/O BARs
+ */
+PHYSADDR
+PciBar(PCIDEV *pdev, int bar)
+{
+	u32 lo, hi = 0;
+
+	lo = PciRead32(pdev, PCI_BAR0 + bar * 4);
+
+	if (lo & 1)
+	{
+		return 0;
+	}
+	if (((lo >> 1) & 3) == 2)
+	{
+		hi = PciRead32(pdev, PCI_BAR0 + (bar + 1) * 4);
+	}
+
+	return ((PHYSADDR)hi << 32) | (lo & ~0xfu);
+}
+
+/*
+ *  Devices with @vendor and @device after @from, NULL to start
+ */
+PCIDEV *
+PciFindDevice(u16 vendor, u16 device, PCIDEV *from)
+{
+	int i = from ? from - pcidevs + 1 : 0;
+
+	for (; i < npcidev; i++)
+	{
+		if (pcidevs[i].Vendor == vendor && pcidevs[i].Device == device)
+		{
+			return &pcidevs[i];
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ *  MSI-X: every vector has a table entry in device memory with its own
+ *  mask bit
+ */
+static volatile u32 *
+MsixEntry(PCIDEV *pdev, int idx)
+{
+	return pdev->MsixTable + idx * MSIX_ENTRY_SIZE;
+}
+
+static int
+MsixSetup(IRQ *irq)
+{
+	PCIDEV *pdev = irq->Chip->Device;
+	volatile u32 *ent;
+	u64 addr;
+	u32 data;
+
+	if (irq->Hwirq < 0 || irq->Hwirq >= pdev->MsixSize)
+	{
+		return -1;
+	}
+
+	ent = MsixEntry(pdev, irq->Hwirq);
+
+	ArchMsiCompose(irq->Irqno, irq->Cpu, &addr, &data);
+
+	ent[MSIX_ENTRY_CTRL / 4] = MSIX_ENTRY_MASKED;
+	ent[MSIX_ENTRY_ADDR_LO / 4] = (u32)addr;
+	ent[MSIX_ENTRY_ADDR_HI / 4] = addr >> 32;
+	ent[MSIX_ENTRY_DATA / 4] = data;
+
+	return 0;
+}
+
+static void
+MsixMask(IRQ *irq)
+{
+	volatile u32 *ent = MsixEntry(irq->Chip->Device, irq->Hwirq);
+
+	ent[MSIX_ENTRY_CTRL / 4] |= MSIX_ENTRY_MASKED;
+}
+
+static void
+MsixUnmask(IRQ *irq)
+{
+	volatile u32 *ent = MsixEntry(irq->Chip->Device, irq->Hwirq);
+
+	ent[MSIX_ENTRY_CTRL / 4] &= ~MSIX_ENTRY_MASKED;
+}
+
+/*
+ *  The entry may only change while masked
+ */
+static int
+MsixSetAffinity(IRQ *irq, int cpu)
+{
+	volatile u32 *ent = MsixEntry(irq->Chip->Device, irq->Hwirq);
+	u32 ctrl;
+	u64 addr;
+	u32 data;
+
+	ArchMsiCompose(irq->Irqno, cpu, &addr, &data);
+
+	ctrl = ent[MSIX_ENTRY_CTRL / 4];
+	ent[MSIX_ENTRY_CTRL / 4] = ctrl | MSIX_ENTRY_MASKED;
+
+	ent[MSIX_ENTRY_ADDR_LO / 4] = (u32)addr;
+	ent[MSIX_ENTRY_ADDR_HI / 4] = addr >> 32;
+
+	ent[MSIX_ENTRY_CTRL / 4] = ctrl;
+
+	return 0;
+}
+
+/*
+ *  MSI: one vector, programmed in configuration space.  The mask bit is
+ *  optional.
+ */
+static uint
+MsiDataOffset(PCIDEV *pdev, u16 ctrl)
+{
+	return pdev->MsiCap + ((ctrl & MSI_CTRL_64BIT) ? 0xc : 0x8);
+}
+
+static uint
+MsiMaskOffset(PCIDEV *pdev, u16 ctrl)
+{
+	return MsiDataOffset(pdev, ctrl) + 4;
+}
+
+static void
+MsiWriteAddr(PCIDEV *pdev, u16 ctrl, u64 addr, u32 data)
+{
+	PciWrite32(pdev, pdev->MsiCap + MSI_ADDR_LO, (u32)addr);
+
+	if (ctrl & MSI_CTRL_64BIT)
+	{
+		PciWrite32(pdev, pdev->MsiCap + MSI_ADDR_HI, addr >> 32);
+	}
+
+	PciWrite16(pdev, MsiDataOffset(pdev, ctrl), data);
+}
+
+static int
+MsiSetup(IRQ *irq)
+{
+	PCIDEV *pdev = irq->Chip->Device;
+	u16 ctrl;
+	u64 addr;
+	u32 data;
+
+	if (irq->Hwirq != 0)
+	{
+		return -1;
+	}
+
+	ctrl = PciRead16(pdev, pdev->MsiCap + MSI_CTRL);
+
+	ArchMsiCompose(irq->Irqno, irq->Cpu, &addr, &data);
+
+	if (ctrl & MSI_CTRL_MASKBIT)
+	{
+		PciWrite32(pdev, MsiMaskOffset(pdev, ctrl), 1);
+	}
+
+	MsiWriteAddr(pdev, ctrl, addr, data);
+
+	// a single message: Multiple Message Enable stays 0
+	PciWrite16(pdev, pdev->MsiCap + MSI_CTRL, (ctrl & ~0x70) | MSI_CTRL_ENABLE);
+
+	return 0;
+}
+
+static void
+MsiMask(IRQ *irq)
+{
+	PCIDEV *pdev = irq->Chip->Device;
+	u16 ctrl = PciRead16(pdev, pdev->MsiCap + MSI_CTRL);
+
+	PciWrite32(pdev, MsiMaskOffset(pdev, ctrl), 1);
+}
+
+static void
+MsiUnmask(IRQ *irq)
+{
+	PCIDEV *pdev = irq->Chip->Device;
+	u16 ctrl = PciRead16(pdev, pdev->MsiCap + MSI_CTRL);
+
+	PciWrite32(pdev, MsiMaskOffset(pdev, ctrl), 0);
+}
+
+static int
+MsiSetAffinity(IRQ *irq, int cpu)
+{
+	PCIDEV *pdev = irq->Chip->Device;
+	u16 ctrl = PciRead16(pdev, pdev->MsiCap + MSI_CTRL);
+	u64 addr;
+	u32 data;
+
+	ArchMsiCompose(irq->Irqno, cpu, &addr, &data);
+
+	if (ctrl & MSI_CTRL_MASKBIT)
+	{
+		MsiMask(irq);
+	}
+
+	MsiWriteAddr(pdev, ctrl, addr, data);
+
+	if (ctrl & MSI_CTRL_MASKBIT)
+	{
+		MsiUnmask(irq);
+	}
+
+	return 0;
+}
+
+// messages arrive at the local APIC like any other vector
+static void
+MsiEOI(IRQ *irq)
+{
+	IRQCHIP *parent = IrqDefaultChip();
+
+	parent->EOI(irq);
+}
+
+static int
+PciEnableMsix(PCIDEV *pdev)
+{
+	PHYSADDR pa;
+	uint table;
+	u16 ctrl;
+	void *va;
+
+	ctrl = PciRead16(pdev, pdev->MsixCap + MSIX_CTRL);
+	table = PciRead32(pdev, pdev->MsixCap + MSIX_TABLE);
+
+	pa = PciBar(pdev, table & MSIX_TABLE_BIR_MASK);
+	if (!pa)
+	{
+		return -1;
+	}
+
+	pa += table & ~MSIX_TABLE_BIR_MASK;
+
+	va = KIOmap(PAGEALIGNDOWN(pa), PAGESIZE);
+	if (!va)
+	{
+		return -1;
+	}
+
+	pdev->MsixTable = va + (pa & (PAGESIZE - 1));
+
+	// only the entries in the mapped page are used
+	pdev->MsixSize = MIN((ctrl & MSIX_CTRL_SIZE_MASK) + 1,
+			     (PAGESIZE - (pa & (PAGESIZE - 1))) / MSIX_ENTRY_SIZE);
+
+	PciSetCommand(pdev, PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER | PCI_COMMAND_INTX_DISABLE);
+
+	// enable with everything masked, then unmask per entry
+	PciWrite16(pdev, pdev->MsixCap + MSIX_CTRL, ctrl | MSIX_CTRL_ENABLE | MSIX_CTRL_MASKALL);
+
+	for (int i = 0; i < pdev->MsixSize; i++)
+	{
+		MsixEntry(pdev, i)[MSIX_ENTRY_CTRL / 4] = MSIX_ENTRY_MASKED;
+	}
+
+	PciWrite16(pdev, pdev->MsixCap + MSIX_CTRL, ctrl | MSIX_CTRL_ENABLE);
+
+	pdev->Chip.Setup = MsixSetup;
+	pdev->Chip.Mask = MsixMask;
+	pdev->Chip.Unmask = MsixUnmask;
+	pdev->Chip.SetAffinity = MsixSetAffinity;
+	pdev->Chip.Name = "MSI-X";
+
+	pdev->Flags |= PCI_MSIX_ENABLED;
+
+	return 0;
+}
+
+static int
+PciEnableMsiOnly(PCIDEV *pdev)
+{
+	u16 ctrl = PciRead16(pdev, pdev->MsiCap + MSI_CTRL);
+
+	PciSetCommand(pdev, PCI_COMMAND_MASTER | PCI_COMMAND_INTX_DISABLE);
+
+	pdev->Chip.Setup = MsiSetup;
+	pdev->Chip.SetAffinity = MsiSetAffinity;
+	pdev->Chip.Name = "MSI";
+
+	if (ctrl & MSI_CTRL_MASKBIT)
+	{
+		pdev->Chip.Mask = MsiMask;
+		pdev->Chip.Unmask = MsiUnmask;
+	}
+
+	pdev->Flags |= PCI_MSI_ENABLED;
+
+	return 0;
+}
+
+/*
+ *  Switch @pdev to message signalled interrupts, MSI-X if it has it.
+ *  Returns how many of the @nvec vectors can be requested.
+ */
+int
+PciEnableMsi(PCIDEV *pdev, int nvec)
+{
+	if (!(pdev->Flags & (PCI_MSI_ENABLED | PCI_MSIX_ENABLED)))
+	{
+		pdev->Chip.Device = pdev;
+		pdev->Chip.EOI = MsiEOI;
+
+		if (pdev->MsixCap && PciEnableMsix(pdev) == 0)
+			;
+		else if (pdev->MsiCap && PciEnableMsiOnly(pdev) == 0)
+			;
+		else
+		{
+			return -1;
+		}
+	}
+
+	if (pdev->Flags & PCI_MSIX_ENABLED)
+	{
+		return MIN(nvec, pdev->MsixSize);
+	}
+
+	return 1;
+}
+
+/*
+ *  Handle vector @idx of @pdev on @cpu
+ */
+IRQSOURCE *
+PciRequestVector(PCIDEV *pdev, int idx, int cpu, void *device,
+		 int (*handler)(IRQSOURCE *))
+{
+	IRQSOURCE *irqsrc;
+
+	irqsrc = NewChipIRQSource(device, handler, -1, &pdev->Chip, idx, 0);
+	if (!irqsrc)
+	{
+		return NULL;
+	}
+
+	if (cpu != irqsrc->Irq->Cpu && IrqSetAffinity(irqsrc->Irq, cpu))
+	{
+		KWARN("%02x:%02x.%d: vector %d stays on cpu%d\n", pdev->Bus, pdev->Dev,
+		      pdev->Func, idx, irqsrc->Irq->Cpu);
+	}
+
+	return irqsrc;
+}
+
+/*
+ *  One vector per queue, spread over the online CPUs: queue i interrupts
+ *  the i-th CPU.  Returns how many queues got their own vector; the
+ *  driver folds the others onto these.
+ */
+int
+PciRequestQueueVectors(PCIDEV *pdev, int nqueue, void **devices,
+		       int (*handler)(IRQSOURCE *), IRQSOURCE **out)
+{
+	int nvec, cpu = -1;
+
+	nvec = PciEnableMsi(pdev, nqueue);
+	if (nvec < 0)
+	{
+		return -1;
+	}
+
+	for (int i = 0; i < nvec; i++)
+	{
+		// next online CPU, wrapping around
+		do
+		{
+			cpu = (cpu + 1) % NCPU;
+		} while (!CpuOnline(cpu));
+
+		out[i] = PciRequestVector(pdev, i, cpu, devices[i], handler);
+		if (!out[i])
+		{
+			return i;
+		}
+	}
+
+	return nvec;
+}
+
+static u8
+PciFindCap(PCIDEV *pdev, u8 id)
+{
+	u8 ptr;
+
+	if (!(PciRead16(pdev, PCI_STATUS) & PCI_STATUS_CAP_LIST))
+	{
+		return 0;
+	}
+
+	for (ptr = PciRead8(pdev, PCI_CAP_PTR) & ~3; ptr; ptr = PciRead8(pdev, ptr + 1) & ~3)
+	{
+		if (PciRead8(pdev, ptr) == id)
+		{
+			return ptr;
+		}
+	}
+
+	return 0;
+}
+
+static void PciScanBus(uint bus) INIT;
+
+static void INIT
+PciScanFunc(uint bus, uint dev, uint func)
+{
+	PCIDEV *pdev;
+	u32 class;
+
+	if (npcidev == PCI_MAX_DEV)
+	{
+		return;
+	}
+
+	pdev = &pcidevs[npcidev++];
+
+	pdev->Bus = bus;
+	pdev->Dev = dev;
+	pdev->Func = func;
+	pdev->Vendor = PciRead16(pdev, PCI_VENDOR_ID);
+	pdev->Device = PciRead16(pdev, PCI_DEVICE_ID);
+
+	class = PciRead32(pdev, PCI_CLASS_REVISION);
+	pdev->Class = class >> 24;
+	pdev->Subclass = class >> 16;
+
+	pdev->MsiCap = PciFindCap(pdev, PCI_CAP_MSI);
+	pdev->MsixCap = PciFindCap(pdev, PCI_CAP_MSIX);
+
+	KLOG("%02x:%02x.%d %04x:%04x class %02x%02x%s%s\n", bus, dev, func,
+	     pdev->Vendor, pdev->Device, pdev->Class, pdev->Subclass,
+	     pdev->MsiCap ? " MSI" : "", pdev->MsixCap ? " MSI-X" : "");
+
+	// PCI-to-PCI bridge
+	if ((PciRead8(pdev, PCI_HEADER_TYPE) & 0x7f) == 1)
+	{
+		PciScanBus(PciRead8(pdev, PCI_SECONDARY_BUS));
+	}
+}
+
+static void INIT
+PciScanBus(uint bus)
+{
+	uint nfunc;
+	u8 header;
+
+	for (uint dev = 0; dev < 32; dev++)
+	{
+		if ((ArchPciRead32(bus, dev, 0, PCI_VENDOR_ID) & 0xffff) == 0xffff)
+		{
+			continue;
+		}
+
+		header = ArchPciRead32(bus, dev, 0, PCI_HEADER_TYPE) >> ((PCI_HEADER_TYPE & 3) * 8);
+		nfunc = (header & PCI_HEADER_MULTIFUNC) ? 8 : 1;
+
+		for (uint func = 0; func < nfunc; func++)
+		{
+			if ((ArchPciRead32(bus, dev, func, PCI_VENDOR_ID) & 0xffff) != 0xffff)
+			{
+				PciScanFunc(bus, dev, func);
+			}
+		}
+	}
+}
+
+void INIT
+PciInit(void)
+{
+	PciScanBus(0);
+}
@@ -110,6 +110,7 @@ vsprintk(char *buf, const char *fmt, va_list ap)
 {
 	uint n = 0;
 	uint len;
+	bool lng;
 	char c;
 
 	for (int i = 0; fmt[i]; i++)
@@ -119,14 +120,26 @@ vsprintk(char *buf, const char *fmt, va_list ap)
 		{
 			c = fmt[++i];
 
+			lng = c == 'l';
+			if (lng)
+			{
+				c = fmt[++i];
+			}
+
 			switch (c)
 			{
 			case 'd':
-				len = sprintiu32(buf + n, va_arg(ap, i32), 10, true);
+				if (lng)
+					len = sprintiu64(buf + n, va_arg(ap, i64), 10, true);
+				else
+					len = sprintiu32(buf + n, va_arg(ap, i32), 10, true);
 				n += len;
 				break;
 			case 'u':
-				len = sprintiu32(buf + n, va_arg(ap, u32), 10, false);
+				if (lng)
+					len = sprintiu64(buf + n, va_arg(ap, u64), 10, false);
+				else
+					len = sprintiu32(buf + n, va_arg(ap, u32), 10, false);
 				n += len;
 				break;
 			case 'x':
@@ -0,0 +1,299 @@
+/*
+ * Copyright (c) 2024, akarilab.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Cross-CPU function calls over IPIs
+
+#include <akari/types.h>
+#include <akari/compiler.h>
+#include <akari/smpcall.h>
+#include <akari/irqsource.h>
+#include <akari/atomic.h>
+#include <akari/panic.h>
+#include <akari/cpu.h>
+#include <arch/irq.h>
+#include <arch/cpu.h>
+
+#define KPREFIX		"smpcall:"
+
+#include <akari/log.h>
+
+typedef struct SMPCALLSTAT	SMPCALLSTAT;
+
+struct SMPCALLSTAT
+{
+	ulong nQueued;		// calls queued to other CPUs
+	ulong nIPI;		// IPIs those cost
+	ulong nRun;		// calls run on this CPU
+};
+
+/*
+ *  Calls pending on a CPU, newest first.  Anyone pushes with a CAS,
+ *  only the owner takes the whole list.
+ */
+static SMPCALL *callq PERCPU;
+static IRQSOURCE *callirq PERCPU;
+static SMPCALLSTAT callstat PERCPU;
+
+/*
+ *  Queue @c on @cpu.  Returns true if the queue was empty, i.e. @cpu
+ *  needs an IPI to look at it.
+ */
+static bool
+CallQueue(int cpu, SMPCALL *c)
+{
+	SMPCALL **q = &CPU_VAR(callq, cpu);
+	SMPCALL *old = AtomicLoad(q);
+
+	do
+	{
+		c->Next = old;
+	} while (!AtomicCas(q, &old, c));
+
+	MYCPU(callstat).nQueued++;
+
+	return old == NULL;
+}
+
+/*
+ *  Run every call queued on this CPU, oldest first
+ */
+static void
+CallRun(void)
+{
+	SMPCALL *list, *c, *next, *prev = NULL;
+
+	list = AtomicXchg(&MYCPU(callq), NULL);
+
+	// restore the order the calls were made in
+	for (c = list; c; c = next)
+	{
+		next = c->Next;
+		c->Next = prev;
+		prev = c;
+	}
+
+	for (c = prev; c; c = next)
+	{
+		// @c may be reused as soon as Done is set
+		next = c->Next;
+
+		c->Func(c->Arg);
+		MYCPU(callstat).nRun++;
+
+		AtomicStore(&c->Done, 1);
+	}
+}
+
+static int
+CallIrq(IRQSOURCE *src)
+{
+	CallRun();
+
+	return 0;
+}
+
+static inline bool
+CallTarget(int cpu)
+{
+	return cpu >= 0 && cpu < NCPU && CpuOnline(cpu);
+}
+
+/*
+ *  Run @c on @cpu without waiting for it.  @c must stay untouched until
+ *  SmpCallDone().  Calls made back to back to the same CPU share an IPI.
+ */
+int
+SmpCallAsync(int cpu, SMPCALL *c)
+{
+	ulong intr;
+
+	if (!CallTarget(cpu))
+	{
+		return -1;
+	}
+
+	c->Done = 0;
+
+	intr = ArchIntrSave();
+
+	if (cpu == CpuId())
+	{
+		c->Func(c->Arg);
+		AtomicStore(&c->Done, 1);
+	}
+	else if (CallQueue(cpu, c))
+	{
+		MYCPU(callstat).nIPI++;
+		ArchSendIPI(cpu, IRQ_IPI_CALL);
+	}
+
+	ArchIntrRestore(intr);
+
+	return 0;
+}
+
+/*
+ *  Run calls[cpu] on every CPU in @mask, with one IPI per CPU at most
+ */
+int
+SmpCallAsyncMask(ulong mask, SMPCALL *calls)
+{
+	ulong ipi = 0, intr;
+	int me;
+
+	for (int cpu = 0; cpu < NCPU; cpu++)
+	{
+		if ((mask & (1ul << cpu)) && !CallTarget(cpu))
+		{
+			return -1;
+		}
+	}
+
+	intr = ArchIntrSave();
+	me = CpuId();
+
+	for (int cpu = 0; cpu < NCPU; cpu++)
+	{
+		if (!(mask & (1ul << cpu)) || cpu == me)
+		{
+			continue;
+		}
+
+		calls[cpu].Done = 0;
+
+		if (CallQueue(cpu, &calls[cpu]))
+		{
+			ipi |= 1ul << cpu;
+			MYCPU(callstat).nIPI++;
+		}
+	}
+
+	ArchSendIPIMask(ipi, IRQ_IPI_CALL);
+
+	if (mask & (1ul << me))
+	{
+		calls[me].Func(calls[me].Arg);
+		AtomicStore(&calls[me].Done, 1);
+	}
+
+	ArchIntrRestore(intr);
+
+	return 0;
+}
+
+/*
+ *  Spin until @c ran.  Calls to this CPU are served meanwhile, so two
+ *  CPUs waiting on each other with interrupts off do not deadlock.
+ */
+void
+SmpCallWait(SMPCALL *c)
+{
+	while (!SmpCallDone(c))
+	{
+		if (AtomicLoad(&MYCPU(callq)))
+		{
+			ulong intr = ArchIntrSave();
+			CallRun();
+			ArchIntrRestore(intr);
+		}
+
+		ArchCpuRelax();
+	}
+}
+
+/*
+ *  Run @func on @cpu and wait for it to return
+ */
+int
+SmpCall(int cpu, void (*func)(void *), void *arg)
+{
+	SMPCALL c;
+
+	SmpCallInit(&c, func, arg);
+
+	if (SmpCallAsync(cpu, &c))
+	{
+		return -1;
+	}
+
+	SmpCallWait(&c);
+
+	return 0;
+}
+
+/*
+ *  Run @func on every CPU in @mask and wait for all of them
+ */
+int
+SmpCallMask(ulong mask, void (*func)(void *), void *arg)
+{
+	SMPCALL calls[NCPU];
+
+	for (int cpu = 0; cpu < NCPU; cpu++)
+	{
+		SmpCallInit(&calls[cpu], func, arg);
+	}
+
+	if (SmpCallAsyncMask(mask, calls))
+	{
+		return -1;
+	}
+
+	for (int cpu = 0; cpu < NCPU; cpu++)
+	{
+		if (mask & (1ul << cpu))
+		{
+			SmpCallWait(&calls[cpu]);
+		}
+	}
+
+	return 0;
+}
+
+void
+SmpCallReport(void)
+{
+	SMPCALLSTAT *st = &MYCPU(callstat);
+
+	KLOG("cpu%d: %lu queued with %lu IPIs, %lu run\n", CpuId(), st->nQueued,
+	     st->nIPI, st->nRun);
+}
+
+/*
+ *  Take call IPIs on this CPU
+ */
+void INIT
+SmpCallInitCpu(void)
+{
+	MYCPU(callirq) = NewIRQSource(NULL, CallIrq, IRQ_IPI_CALL, true);
+
+	if (!MYCPU(callirq))
+	{
+		Panic("smpcall irq");
+	}
+}
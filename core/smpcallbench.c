@@ -0,0 +1,158 @@
+/*
+ * Copyright (c) 2024, akarilab.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Cross-CPU call latency and throughput
+
+#include <akari/types.h>
+#include <akari/compiler.h>
+#include <akari/bench.h>
+#include <akari/smpcall.h>
+#include <akari/timer.h>
+#include <akari/cpu.h>
+#include <arch/cpu.h>
+
+#define KPREFIX		"bench/smpcall:"
+
+#include <akari/log.h>
+
+#define NPINGPONG	10000
+#define NBURST		64
+#define NCALLS		(NBURST * 1000)
+
+static SMPCALL pong;
+static SMPCALL burst[NBURST];
+
+static void
+Nop(void *arg)
+{
+	;
+}
+
+// runs on the target: answer the boot CPU
+static void
+Ping(void *arg)
+{
+	SmpCallAsync(0, &pong);
+}
+
+static int
+BenchTarget(void)
+{
+	for (int cpu = 1; cpu < NCPU; cpu++)
+	{
+		if (CpuOnline(cpu))
+		{
+			return cpu;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ *  Ping another CPU, which calls back: one IPI each way
+ */
+static void
+PingPongBench(int target)
+{
+	SMPCALL ping;
+	u64 t0, d, sum = 0, max = 0;
+
+	for (int i = 0; i < NPINGPONG; i++)
+	{
+		SmpCallInit(&ping, Ping, NULL);
+		SmpCallInit(&pong, Nop, NULL);
+
+		t0 = ArchCycles();
+
+		SmpCallAsync(target, &ping);
+		SmpCallWait(&pong);
+
+		d = ArchCycles() - t0;
+		sum += d;
+		max = MAX(max, d);
+
+		// the pong is done, but the ping may not be yet
+		SmpCallWait(&ping);
+	}
+
+	KLOG("ping-pong cpu0 <-> cpu%d: %lu cycles avg, %lu max\n", target,
+	     sum / NPINGPONG, max);
+}
+
+/*
+ *  Bursts of asynchronous calls: all but the first of a burst ride on
+ *  the first one's IPI
+ */
+static void
+ThroughputBench(int target)
+{
+	ulong t0, ns;
+
+	for (int i = 0; i < NBURST; i++)
+	{
+		SmpCallInit(&burst[i], Nop, NULL);
+	}
+
+	t0 = KtimeGetNs();
+
+	for (int n = 0; n < NCALLS / NBURST; n++)
+	{
+		for (int i = 0; i < NBURST; i++)
+		{
+			SmpCallAsync(target, &burst[i]);
+		}
+
+		// calls run in order
+		SmpCallWait(&burst[NBURST - 1]);
+	}
+
+	ns = KtimeGetNs() - t0;
+
+	KLOG("%d async calls to cpu%d in bursts of %d: %lu ns each\n", NCALLS,
+	     target, NBURST, ns / NCALLS);
+
+	SmpCallReport();
+}
+
+static void
+SmpCallBench(void)
+{
+	int target = BenchTarget();
+
+	if (target < 0)
+	{
+		KLOG("needs a second CPU\n");
+		return;
+	}
+
+	PingPongBench(target);
+	ThroughputBench(target);
+}
+
+DEFINE_BENCH(SmpCall, SmpCallBench);
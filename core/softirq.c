@@ -0,0 +1,184 @@
+/*
+ * Copyright (c) 2024, akarilab.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Softirqs: work deferred from interrupt handlers, run on interrupt exit
+
+#include <akari/types.h>
+#include <akari/compiler.h>
+#include <akari/softirq.h>
+#include <akari/timer.h>
+#include <akari/cpu.h>
+#include <akari/panic.h>
+
+#include <arch/cpu.h>
+
+#define KPREFIX		"softirq:"
+
+#include <akari/log.h>
+
+typedef struct SOFTIRQSTAT	SOFTIRQSTAT;
+
+struct SOFTIRQSTAT
+{
+	ulong nRun[NSOFTIRQ];
+	ulong nPass;		// passes from interrupt exit
+	ulong nHandoff;		// passes that ran out of budget
+	ulong nIdle;		// passes from the idle loop
+};
+
+static void (*actions[NSOFTIRQ])(void);
+
+// only touched by the owning CPU with interrupts disabled
+static uint pending PERCPU;
+static bool insoftirq PERCPU;
+static SOFTIRQSTAT softirqstat PERCPU;
+
+void
+SoftirqSetAction(int nr, void (*action)(void))
+{
+	if (nr < 0 || nr >= NSOFTIRQ)
+	{
+		Panic("bad softirq");
+	}
+
+	actions[nr] = action;
+}
+
+/*
+ *  Mark softirq @nr pending on this CPU.  It runs on the way out of
+ *  the current interrupt, or from the idle loop.
+ */
+void
+SoftirqRaise(int nr)
+{
+	ulong intr = ArchIntrSave();
+
+	MYCPU(pending) |= 1u << nr;
+
+	ArchIntrRestore(intr);
+}
+
+bool
+SoftirqPending(void)
+{
+	return MYCPU(pending) != 0;
+}
+
+/*
+ *  Run pending softirqs with interrupts enabled, until nothing is
+ *  pending or the budget is used up.  Entered and left with interrupts
+ *  disabled.  Returns true if work was left pending.
+ */
+static bool
+SoftirqRun(bool budget)
+{
+	SOFTIRQSTAT *st = &MYCPU(softirqstat);
+	ulong start = KtimeGetNs();
+	int restart = SOFTIRQ_MAX_RESTART;
+	uint p;
+
+	MYCPU(insoftirq) = true;
+
+	while ((p = MYCPU(pending)) != 0)
+	{
+		if (budget && (restart-- == 0 || KtimeGetNs() - start > SOFTIRQ_MAX_NSEC))
+		{
+			break;
+		}
+
+		MYCPU(pending) = 0;
+
+		INTR_ENABLE;
+
+		for (int nr = 0; nr < NSOFTIRQ; nr++)
+		{
+			if ((p & (1u << nr)) && actions[nr])
+			{
+				st->nRun[nr]++;
+				actions[nr]();
+			}
+		}
+
+		INTR_DISABLE;
+	}
+
+	MYCPU(insoftirq) = false;
+
+	return p != 0;
+}
+
+/*
+ *  Called at the end of every interrupt, with interrupts disabled
+ */
+void
+IrqExit(void)
+{
+	if (!MYCPU(pending) || MYCPU(insoftirq))
+	{
+		return;
+	}
+
+	MYCPU(softirqstat).nPass++;
+
+	// too much work for interrupt exit: let the idle loop finish it
+	if (SoftirqRun(true))
+	{
+		MYCPU(softirqstat).nHandoff++;
+	}
+}
+
+/*
+ *  Idle loop side: run everything left pending, without a budget
+ */
+void
+SoftirqRunPending(void)
+{
+	ulong intr = ArchIntrSave();
+
+	if (MYCPU(pending) && !MYCPU(insoftirq))
+	{
+		MYCPU(softirqstat).nIdle++;
+		SoftirqRun(false);
+	}
+
+	ArchIntrRestore(intr);
+}
+
+void
+SoftirqReport(void)
+{
+	SOFTIRQSTAT *st = &MYCPU(softirqstat);
+
+	KLOG("cpu%d: %lu passes, %lu handed off, %lu from idle\n",
+	     CpuId(), st->nPass, st->nHandoff, st->nIdle);
+
+	for (int nr = 0; nr < NSOFTIRQ; nr++)
+	{
+		KLOG("  softirq %d: %lu runs\n", nr, st->nRun[nr]);
+	}
+}
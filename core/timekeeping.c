@@ -0,0 +1,365 @@
+/*
+ * Copyright (c) 2024, akarilab.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// Timekeeping: nanosecond clock on the best rated timer
+
+#include <akari/types.h>
+#include <akari/compiler.h>
+#include <akari/timer.h>
+#include <akari/cpu.h>
+
+#include <arch/cpu.h>
+
+#define KPREFIX		"timekeeping:"
+
+#include <akari/log.h>
+
+#define NSEC_PER_SEC		1000000000ul
+
+// the watchdog compares intervals of at least this long
+#define WATCHDOG_MIN_NS		(NSEC_PER_SEC / 10)
+#define WATCHDOG_MAX_PPM	1000
+
+#define NCLOCKS			16
+
+typedef struct TIMEKEEPER	TIMEKEEPER;
+
+struct TIMEKEEPER
+{
+	volatile u32 Seq;	// odd while updating
+
+	TIMER *Clock;
+	ulong CycleLast;
+	ulong BaseNs;		// time at CycleLast
+
+	TIMER *Watchdog;	// reference checking Clock
+	ulong WdLast;
+	ulong WdClockLast;
+};
+
+static TIMEKEEPER tk;
+
+static TIMER *clocks[NCLOCKS];
+static int nclocks;
+
+/*
+ *  Precompute the conversions between counts at @freq Hz and ns,
+ *  keeping the multipliers within 32 bits.
+ */
+void
+TimerSetFreq(TIMER *tm, ulong freq)
+{
+	ulong mult;
+	u32 shift;
+
+	tm->Freq = freq;
+
+	mult = (NSEC_PER_SEC << 32) / freq;
+	for (shift = 32; mult >> 32; shift--)
+	{
+		mult >>= 1;
+	}
+
+	tm->Mult = mult;
+	tm->Shift = shift;
+
+	TimerCalcRevMult(freq, &tm->RevMult, &tm->RevShift);
+}
+
+/*
+ *  ns to counts at @freq Hz for Ns2Cycles(), also for event devices
+ *  that have no TIMER
+ */
+void
+TimerCalcRevMult(ulong freq, u32 *revmult, u32 *revshift)
+{
+	ulong mult;
+	u32 shift;
+
+	if (freq >> 32)
+	{
+		mult = ((freq / 1000) << 32) / (NSEC_PER_SEC / 1000);
+	}
+	else
+	{
+		mult = (freq << 32) / NSEC_PER_SEC;
+	}
+
+	for (shift = 32; mult >> 32; shift--)
+	{
+		mult >>= 1;
+	}
+
+	*revmult = mult;
+	*revshift = shift;
+}
+
+static inline void
+TkWriteBegin(void)
+{
+	tk.Seq++;
+	asm volatile ("" ::: "memory");
+}
+
+static inline void
+TkWriteEnd(void)
+{
+	asm volatile ("" ::: "memory");
+	tk.Seq++;
+}
+
+/*
+ *  Monotonic time in nanoseconds
+ */
+ulong
+KtimeGetNs(void)
+{
+	TIMER *clock;
+	ulong last, base, now;
+	u32 seq;
+
+	do
+	{
+		seq = tk.Seq;
+		asm volatile ("" ::: "memory");
+
+		clock = tk.Clock;
+		if (!clock)
+		{
+			return 0;
+		}
+
+		last = tk.CycleLast;
+		base = tk.BaseNs;
+		now = clock->ReadCounterRaw(clock);
+
+		asm volatile ("" ::: "memory");
+	} while ((seq & 1) || tk.Seq != seq);
+
+	return base + TimerCycles2Ns(clock, now - last);
+}
+
+TIMER *
+TimekeepingClock(void)
+{
+	return tk.Clock;
+}
+
+static TIMER *
+BestClock(TIMER *except)
+{
+	TIMER *best = NULL;
+
+	for (int i = 0; i < nclocks; i++)
+	{
+		TIMER *tm = clocks[i];
+
+		if (tm == except || tm->Unstable)
+		{
+			continue;
+		}
+		if (!best || tm->Rating > best->Rating)
+		{
+			best = tm;
+		}
+	}
+
+	return best;
+}
+
+static void
+WatchdogReset(void)
+{
+	TIMER *wd = tk.Watchdog;
+
+	if (wd)
+	{
+		tk.WdLast = wd->ReadCounterRaw(wd);
+		tk.WdClockLast = tk.CycleLast;
+	}
+}
+
+/*
+ *  Keep time on @new from now on, without a jump
+ */
+static void
+TimekeepingSwitch(TIMER *new)
+{
+	TIMER *old = tk.Clock;
+	ulong now;
+
+	TkWriteBegin();
+
+	if (old)
+	{
+		now = old->ReadCounterRaw(old);
+		tk.BaseNs += TimerCycles2Ns(old, now - tk.CycleLast);
+		tk.CycleLast = new->ReadCounterRaw(new);
+	}
+	else
+	{
+		tk.CycleLast = new->ReadCounterRaw(new);
+		tk.BaseNs = TimerCycles2Ns(new, tk.CycleLast);
+	}
+
+	tk.Clock = new;
+
+	TkWriteEnd();
+
+	// the next best source checks the current one
+	tk.Watchdog = BestClock(new);
+	WatchdogReset();
+
+	ClockPageUpdate(tk.Clock, tk.CycleLast, tk.BaseNs);
+
+	KLOG("clocksource %s (rating %d), watchdog %s\n", new->Name, new->Rating,
+	     tk.Watchdog ? tk.Watchdog->Name : "none");
+}
+
+/*
+ *  Stop keeping time on @tm and fall back to the next best source
+ */
+void
+TimerMarkUnstable(TIMER *tm, const char *reason)
+{
+	TIMER *new;
+
+	if (tm->Unstable)
+	{
+		return;
+	}
+
+	tm->Unstable = true;
+
+	KWARN("%s unstable: %s\n", tm->Name, reason);
+
+	if (tm == tk.Clock)
+	{
+		new = BestClock(tm);
+		if (new)
+		{
+			TimekeepingSwitch(new);
+		}
+	}
+	else if (tm == tk.Watchdog)
+	{
+		tk.Watchdog = BestClock(tk.Clock);
+		WatchdogReset();
+	}
+}
+
+static void
+WatchdogCheck(void)
+{
+	TIMER *wd = tk.Watchdog;
+	ulong wdnow, wdns, ns, dev;
+
+	if (!wd)
+	{
+		return;
+	}
+
+	wdnow = wd->ReadCounterRaw(wd);
+	wdns = TimerCycles2Ns(wd, wdnow - tk.WdLast);
+
+	if (wdns < WATCHDOG_MIN_NS)
+	{
+		return;
+	}
+
+	ns = TimerCycles2Ns(tk.Clock, tk.CycleLast - tk.WdClockLast);
+	dev = ns > wdns ? ns - wdns : wdns - ns;
+
+	tk.WdLast = wdnow;
+	tk.WdClockLast = tk.CycleLast;
+
+	if (dev * 1000000 / wdns > WATCHDOG_MAX_PPM)
+	{
+		KWARN("%s: %lu ns against %s: %lu ns\n", tk.Clock->Name, ns, wd->Name, wdns);
+		TimerMarkUnstable(tk.Clock, "watchdog");
+	}
+}
+
+/*
+ *  Fold the elapsed time into the base and check the clock against the
+ *  watchdog.  Called periodically by the boot CPU.
+ */
+void
+TimekeepingUpdate(void)
+{
+	TIMER *clock = tk.Clock;
+	ulong now;
+
+	if (!clock)
+	{
+		return;
+	}
+
+	TkWriteBegin();
+
+	now = clock->ReadCounterRaw(clock);
+	tk.BaseNs += TimerCycles2Ns(clock, now - tk.CycleLast);
+	tk.CycleLast = now;
+
+	TkWriteEnd();
+
+	WatchdogCheck();
+
+	ClockPageUpdate(tk.Clock, tk.CycleLast, tk.BaseNs);
+}
+
+/*
+ *  @tm probed successfully and may keep time
+ */
+void INIT
+TimekeepingAddClock(TIMER *tm)
+{
+	if (nclocks < NCLOCKS)
+	{
+		clocks[nclocks++] = tm;
+	}
+	else
+	{
+		KWARN("%s: too many clocksources\n", tm->Name);
+	}
+}
+
+void INIT
+TimekeepingInit(void)
+{
+	TIMER *best = BestClock(NULL);
+
+	if (!best)
+	{
+		KWARN("no clocksource\n");
+		return;
+	}
+
+	TimekeepingSwitch(best);
+}
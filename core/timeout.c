@@ -0,0 +1,329 @@
+/*
+ * Copyright (c) 2024, akarilab.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// Timeouts: per-CPU hierarchical timing wheel
+
+#include <akari/types.h>
+#include <akari/compiler.h>
+#include <akari/timeout.h>
+#include <akari/list.h>
+#include <akari/cpu.h>
+#include <akari/atomic.h>
+#include <akari/spinlock.h>
+
+#include <arch/cpu.h>
+
+#define KPREFIX		"timeout:"
+
+#include <akari/log.h>
+
+static TIMERWHEEL wheel PERCPU;
+
+#define LEVEL_SHIFT(_l)	(WHEEL_ROOT_BITS + (_l) * WHEEL_LEVEL_BITS)
+#define LEVEL_IDX(_l, _t)	(((_t) >> LEVEL_SHIFT(_l)) & (WHEEL_LEVEL_SIZE - 1))
+
+void
+WheelInit(TIMERWHEEL *w)
+{
+	w->Lock = (SPINLOCK)SPINLOCK_INIT;
+	w->Clk = 0;
+	w->nPending = 0;
+
+	for (int i = 0; i < WHEEL_ROOT_SIZE; i++)
+	{
+		ListInit(&w->Root[i]);
+	}
+
+	for (int l = 0; l < WHEEL_NLEVEL; l++)
+	{
+		for (int i = 0; i < WHEEL_LEVEL_SIZE; i++)
+		{
+			ListInit(&w->Level[l][i]);
+		}
+	}
+}
+
+/*
+ *  Pick the slot of @t from how far in the future it expires
+ */
+static void
+WheelEnqueue(TIMERWHEEL *w, TIMEOUT *t)
+{
+	ulong expires = t->Expires;
+	ulong delta = expires - w->Clk;
+	LIST *slot;
+	int l;
+
+	if ((long)delta < 0)
+	{
+		// already due: run on the next advance
+		slot = &w->Root[w->Clk & (WHEEL_ROOT_SIZE - 1)];
+	}
+	else if (delta < WHEEL_ROOT_SIZE)
+	{
+		slot = &w->Root[expires & (WHEEL_ROOT_SIZE - 1)];
+	}
+	else
+	{
+		if (delta >= WHEEL_MAX_TICKS)
+		{
+			expires = w->Clk + WHEEL_MAX_TICKS - 1;
+			t->Expires = expires;
+		}
+
+		for (l = 0; l < WHEEL_NLEVEL - 1; l++)
+		{
+			if (delta < 1ul << LEVEL_SHIFT(l + 1))
+			{
+				break;
+			}
+		}
+
+		slot = &w->Level[l][LEVEL_IDX(l, expires)];
+	}
+
+	ListAddTail(slot, &t->Entry);
+}
+
+/*
+ *  Arm @t to expire @ticks ticks from now.  An armed @t is moved.
+ */
+void
+WheelAdd(TIMERWHEEL *w, TIMEOUT *t, ulong ticks)
+{
+	if (TimeoutPending(t))
+	{
+		WheelDel(t);
+	}
+
+	t->Expires = w->Clk + ticks;
+	AtomicStore(&t->Wheel, w);
+
+	WheelEnqueue(w, t);
+
+	w->nPending++;
+	w->Stat.nArm++;
+}
+
+/*
+ *  Returns true if @t was pending
+ */
+bool
+WheelDel(TIMEOUT *t)
+{
+	TIMERWHEEL *w = t->Wheel;
+
+	if (!TimeoutPending(t))
+	{
+		return false;
+	}
+
+	ListDel(&t->Entry);
+
+	w->nPending--;
+	w->Stat.nCancel++;
+
+	return true;
+}
+
+/*
+ *  Redistribute slot @idx of level @l into the levels below.
+ *  Returns @idx, so that 0 means the next level wrapped too.
+ */
+static int
+WheelCascade(TIMERWHEEL *w, int l, int idx)
+{
+	LIST list, *e;
+	TIMEOUT *t;
+
+	ListReplace(&list, &w->Level[l][idx]);
+
+	while (!ListEmpty(&list))
+	{
+		e = list.Next;
+		t = LIST_ENTRY(e, TIMEOUT, Entry);
+
+		ListDel(e);
+		WheelEnqueue(w, t);
+
+		w->Stat.nCascade++;
+	}
+
+	return idx;
+}
+
+/*
+ *  Expire everything due up to and including tick @now.
+ *  The due slot is detached first and run as a batch.  The lock is
+ *  dropped around each callback, so that it may arm timeouts again.
+ */
+void
+WheelAdvance(TIMERWHEEL *w, ulong now)
+{
+	LIST work, *e;
+	TIMEOUT *t;
+	ulong flags;
+	int idx;
+
+	flags = SpinLockIrqSave(&w->Lock);
+
+	while ((long)(now - w->Clk) >= 0)
+	{
+		if (w->nPending == 0)
+		{
+			// nothing left to expire or cascade
+			w->Clk = now + 1;
+			break;
+		}
+
+		idx = w->Clk & (WHEEL_ROOT_SIZE - 1);
+
+		if (idx == 0)
+		{
+			for (int l = 0; l < WHEEL_NLEVEL; l++)
+			{
+				if (WheelCascade(w, l, LEVEL_IDX(l, w->Clk)) != 0)
+				{
+					break;
+				}
+			}
+		}
+
+		ListReplace(&work, &w->Root[idx]);
+		w->Clk++;
+
+		while (!ListEmpty(&work))
+		{
+			e = work.Next;
+			t = LIST_ENTRY(e, TIMEOUT, Entry);
+
+			ListDel(e);
+			w->nPending--;
+			w->Stat.nExpire++;
+
+			SpinUnlockIrqRestore(&w->Lock, flags);
+			t->Func(t);
+			flags = SpinLockIrqSave(&w->Lock);
+		}
+	}
+
+	SpinUnlockIrqRestore(&w->Lock, flags);
+}
+
+void
+TimeoutInit(TIMEOUT *t, void (*func)(TIMEOUT *), void *arg)
+{
+	t->Entry.Next = NULL;
+	t->Entry.Prev = NULL;
+	t->Func = func;
+	t->Arg = arg;
+	t->Wheel = NULL;
+}
+
+/*
+ *  Arm @t on this CPU's wheel to expire @ticks ticks from now.  A @t
+ *  pending on another CPU is moved here.  Only one CPU at a time may arm
+ *  a given @t.
+ */
+void
+TimeoutArm(TIMEOUT *t, ulong ticks)
+{
+	TIMERWHEEL *w = &MYCPU(wheel);
+	ulong flags;
+
+	if (AtomicLoad(&t->Wheel) != w)
+	{
+		TimeoutCancel(t);
+	}
+
+	flags = SpinLockIrqSave(&w->Lock);
+	WheelAdd(w, t, ticks);
+	SpinUnlockIrqRestore(&w->Lock, flags);
+}
+
+/*
+ *  Returns true if @t was pending, on whichever CPU.  A callback already
+ *  started is not waited for.
+ */
+bool
+TimeoutCancel(TIMEOUT *t)
+{
+	TIMERWHEEL *w;
+	ulong flags;
+	bool pending;
+
+	// @t may move to another wheel until we hold the lock of its own
+	for (;;)
+	{
+		w = AtomicLoad(&t->Wheel);
+		if (!w)
+		{
+			return false;
+		}
+
+		flags = SpinLockIrqSave(&w->Lock);
+
+		if (t->Wheel == w)
+		{
+			break;
+		}
+
+		SpinUnlockIrqRestore(&w->Lock, flags);
+	}
+
+	pending = WheelDel(t);
+
+	SpinUnlockIrqRestore(&w->Lock, flags);
+
+	return pending;
+}
+
+/*
+ *  Called from the tick
+ */
+void
+TimeoutRun(ulong now)
+{
+	WheelAdvance(&MYCPU(wheel), now);
+}
+
+/*
+ *  Nothing armed on this CPU: the tick may be stopped
+ */
+bool
+TimeoutIdle(void)
+{
+	return MYCPU(wheel).nPending == 0;
+}
+
+void INIT
+TimeoutInitCpu(void)
+{
+	WheelInit(&MYCPU(wheel));
+}
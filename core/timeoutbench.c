@@ -0,0 +1,193 @@
+/*
+ * Copyright (c) 2024, akarilab.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// Timing wheel and hrtimer benchmarks
+
+#include <akari/types.h>
+#include <akari/compiler.h>
+#include <akari/bench.h>
+#include <akari/timeout.h>
+#include <akari/hrtimer.h>
+#include <akari/timer.h>
+#include <arch/cpu.h>
+
+#define KPREFIX		"bench/timeout:"
+
+#include <akari/log.h>
+
+#define NARMCANCEL	10000000ul
+#define NTIMEOUT	4096
+
+static TIMERWHEEL benchwheel;
+static TIMEOUT timeouts[NTIMEOUT];
+static ulong nfired;
+
+static void
+BenchFire(TIMEOUT *t)
+{
+	nfired++;
+}
+
+static inline ulong
+NextRand(ulong x)
+{
+	// xorshift
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+
+	return x;
+}
+
+/*
+ *  Arm and cancel 10M timeouts with spread out expiry times, as most
+ *  timeouts are cancelled before they fire.
+ */
+static void
+ArmCancelBench(void)
+{
+	TIMERWHEEL *w = &benchwheel;
+	ulong rnd = 88172645463325252ul;
+	TIMEOUT *t;
+	u64 t0, cycles;
+
+	WheelInit(w);
+
+	for (int i = 0; i < NTIMEOUT; i++)
+	{
+		TimeoutInit(&timeouts[i], BenchFire, NULL);
+	}
+
+	t0 = ArchCycles();
+
+	for (ulong i = 0; i < NARMCANCEL; i++)
+	{
+		t = &timeouts[i % NTIMEOUT];
+		rnd = NextRand(rnd);
+
+		WheelAdd(w, t, rnd & 0xfffff);
+		WheelDel(t);
+	}
+
+	cycles = ArchCycles() - t0;
+
+	KLOG("arm+cancel: %lu pairs, %lu cycles each\n", NARMCANCEL, cycles / NARMCANCEL);
+}
+
+DEFINE_BENCH(TimeoutArmCancel, ArmCancelBench);
+
+/*
+ *  Let a wheel full of timeouts expire to measure batched expiry and
+ *  the cost of cascading between levels.
+ */
+static void
+ExpireBench(void)
+{
+	TIMERWHEEL *w = &benchwheel;
+	ulong rnd = 2463534242ul;
+	ulong span = 1ul << 20;
+	u64 t0, cycles;
+
+	WheelInit(w);
+	nfired = 0;
+
+	for (int i = 0; i < NTIMEOUT; i++)
+	{
+		rnd = NextRand(rnd);
+
+		TimeoutInit(&timeouts[i], BenchFire, NULL);
+		WheelAdd(w, &timeouts[i], rnd & (span - 1));
+	}
+
+	t0 = ArchCycles();
+	WheelAdvance(w, span);
+	cycles = ArchCycles() - t0;
+
+	KLOG("expire: %lu of %d fired over %lu ticks, %lu cycles per timeout, %lu cascaded\n",
+	     nfired, NTIMEOUT, span, cycles / NTIMEOUT, w->Stat.nCascade);
+}
+
+DEFINE_BENCH(TimeoutExpire, ExpireBench);
+
+#define NHRBENCH	128
+#define NHRSTART	1000000ul
+
+static HRTIMER hrtimers[NHRBENCH + 1];
+
+static void
+HrBenchFire(HRTIMER *t)
+{
+	nfired++;
+}
+
+/*
+ *  Start and cancel an hrtimer with NHRBENCH others queued.  Expiry
+ *  times are far out, so the event device is not reprogrammed.
+ */
+static void
+HrtimerBench(void)
+{
+	ulong rnd = 88172645463325252ul;
+	ulong base = KtimeGetNs() + 3600 * 1000000000ul;
+	HRTIMER *t = &hrtimers[NHRBENCH];
+	u64 t0, cycles;
+
+	for (int i = 0; i <= NHRBENCH; i++)
+	{
+		HrtimerInit(&hrtimers[i], HrBenchFire, NULL, 0);
+	}
+
+	for (int i = 0; i < NHRBENCH; i++)
+	{
+		rnd = NextRand(rnd);
+		HrtimerStart(&hrtimers[i], base + (rnd & 0xffffffff), HRTIMER_ABS);
+	}
+
+	t0 = ArchCycles();
+
+	for (ulong i = 0; i < NHRSTART; i++)
+	{
+		rnd = NextRand(rnd);
+
+		HrtimerStart(t, base + (rnd & 0xffffffff), HRTIMER_ABS);
+		HrtimerCancel(t);
+	}
+
+	cycles = ArchCycles() - t0;
+
+	for (int i = 0; i < NHRBENCH; i++)
+	{
+		HrtimerCancel(&hrtimers[i]);
+	}
+
+	KLOG("hrtimer start+cancel with %d queued: %lu cycles each\n",
+	     NHRBENCH, cycles / NHRSTART);
+}
+
+DEFINE_BENCH(Hrtimer, HrtimerBench);
@@ -29,28 +29,63 @@
 #include <akari/types.h>
 #include <akari/compiler.h>
 #include <akari/timer.h>
+#include <akari/timeout.h>
+#include <akari/hrtimer.h>
+#include <akari/softirq.h>
 #include <akari/panic.h>
 #include <akari/cpu.h>
 
 #include <arch/cpu.h>
 
+#define KPREFIX		"timer:"
+
+#include <akari/log.h>
+
 #define MSEC2USEC	1000
 
+#define NTDB_GLOBAL	16
+#define NTDB_LOCAL	4
+#define NETDB_GLOBAL	16
+#define NETDB_LOCAL	4
+
 TIMER *STimer;
 
+// this CPU's clocksource and tick device
 TIMER *Timer PERCPU;
 EVENTTIMER *EventTimer PERCPU;
 
-static TIMER *tdbGlobal[16];
+// advanced by the boot CPU
+volatile ulong Ticks;
+
+// ticks of this CPU, which drive its timeout wheel
+static ulong cputicks PERCPU;
+
+static TICKSTAT TickStat PERCPU;
+static HRTIMER ticktimer PERCPU;
+static bool tickstopped PERCPU;
+static ulong tickstopat PERCPU;
+
+static TIMER *tdbGlobal[NTDB_GLOBAL];
 static int ntdb = 0;
 
-static EVENTTIMER *etdbGlobal[16];
+static EVENTTIMER *etdbGlobal[NETDB_GLOBAL];
 static int netdb = 0;
 
+// devices owned by one CPU, registered and probed on that CPU
+static TIMER *tdbLocal[NTDB_LOCAL] PERCPU;
+static int ntdbLocal PERCPU;
+
+static EVENTTIMER *etdbLocal[NETDB_LOCAL] PERCPU;
+static int netdbLocal PERCPU;
+
+static EVENTTIMER *globalet;
+
 static inline TIMER *
 SysTimer(void)
 {
-	return STimer;
+	TIMER *tm = TimekeepingClock();
+
+	return tm ? tm : STimer;
 }
 
 void
@@ -68,10 +103,12 @@ uSleep(uint usec)
 	ulong now, after;
 
 	now = timer->ReadCounterRaw(timer);
-	after = now + timer->uSec2Period(timer, usec);
+	after = now + TimerUsec2Period(timer, usec);
 
 	while (timer->ReadCounterRaw(timer) < after)
-		;
+	{
+		ArchCpuRelax();
+	}
 }
 
 int
@@ -94,7 +131,7 @@ NewEventTimerIrq(EVENTTIMER *et, int irqno)
 {
 	IRQSOURCE *irqsrc;
 
-	irqsrc = NewIRQSource(et, EventTimerIrq, irqno, et->Global);
+	irqsrc = NewIRQSource(et, EventTimerIrq, irqno, !et->Global);
 
 	if (!irqsrc)
 	{
@@ -106,25 +143,201 @@ NewEventTimerIrq(EVENTTIMER *et, int irqno)
 	return 0;
 }
 
+/*
+ *  Tick handling.  With a one-shot event timer the tick is an hrtimer
+ *  re-armed every TICK_NSEC, so it can be cancelled while the CPU is
+ *  idle.  Otherwise the event timer runs periodically and hrtimers
+ *  expire from the tick.
+ */
 static void
-GlobalEventTimerInit(void)
+TimerTick(void)
+{
+	MYCPU(TickStat).nTick++;
+	MYCPU(cputicks)++;
+
+	SoftirqRaise(SOFTIRQ_TIMER);
+
+	if (CpuId() == 0 && ++Ticks % HZ == 0)
+	{
+		TimekeepingUpdate();
+	}
+}
+
+/*
+ *  Timeout callbacks run after the tick interrupt has been acknowledged.
+ *  The wheel is not locked against interrupts, so keep them off.
+ */
+static void
+TimerSoftirq(void)
+{
+	ulong intr = ArchIntrSave();
+
+	TimeoutRun(MYCPU(cputicks));
+
+	ArchIntrRestore(intr);
+}
+
+static void
+TickHrtimer(HRTIMER *t)
+{
+	TimerTick();
+
+	HrtimerStart(t, t->Expires + TICK_NSEC, HRTIMER_ABS);
+}
+
+/*
+ *  Event timer interrupt
+ */
+void
+TimerEvent(EVENTTIMER *et)
+{
+	if (et->Mode != ET_MODE_ONESHOT)
+	{
+		TimerTick();
+	}
+
+	HrtimerInterrupt();
+}
+
+void
+TimerIdleEnter(void)
+{
+	EVENTTIMER *et = MYCPU(EventTimer);
+
+	if (!et || et->Mode != ET_MODE_ONESHOT || MYCPU(tickstopped))
+	{
+		return;
+	}
+	if (!TimeoutIdle())
+	{
+		return;
+	}
+
+	// no timeouts: nothing needs the tick until the next interrupt
+	MYCPU(tickstopped) = true;
+	MYCPU(tickstopat) = MYCPU(ticktimer).Expires - TICK_NSEC;
+	MYCPU(TickStat).nStop++;
+
+	HrtimerCancel(&MYCPU(ticktimer));
+}
+
+/*
+ *  Called with interrupts off, like TimerIdleEnter()
+ */
+void
+TimerIdleExit(void)
+{
+	ulong now, skipped;
+
+	if (!MYCPU(tickstopped))
+	{
+		return;
+	}
+
+	// account the ticks that were not taken while stopped
+	now = KtimeGetNs();
+	skipped = (now - MYCPU(tickstopat)) / TICK_NSEC;
+
+	MYCPU(cputicks) += skipped;
+	MYCPU(TickStat).nSkipped += skipped;
+
+	if (CpuId() == 0)
+	{
+		Ticks += skipped;
+	}
+
+	MYCPU(tickstopped) = false;
+
+	TimeoutRun(MYCPU(cputicks));
+
+	HrtimerStart(&MYCPU(ticktimer), MYCPU(tickstopat) + (skipped + 1) * TICK_NSEC,
+		     HRTIMER_ABS);
+}
+
+void
+TickReport(void)
+{
+	TICKSTAT *st = &MYCPU(TickStat);
+
+	KLOG("%lu ticks, stopped %lu times, %lu ticks skipped\n",
+	     st->nTick, st->nStop, st->nSkipped);
+}
+
+static int
+TickSetup(EVENTTIMER *et)
 {
-	EVENTTIMER *et;
 	int err;
 
-	for (int i = 0; i < netdb; i++)
+	if ((et->Features & ET_FEAT_ONESHOT) && et->SetNextEvent)
 	{
-		et = etdbGlobal[i];
-		if (et && et->Probe)
+		err = et->SetMode(et, ET_MODE_ONESHOT);
+		if (err)
 		{
-			err = et->Probe(et);
-			if (!err) {
-				break;
-			}
+			return -1;
+		}
+	}
+	else if (et->Features & ET_FEAT_PERIODIC)
+	{
+		et->SetPeriod(et, 1000 / HZ);
+
+		err = et->SetMode(et, ET_MODE_PERIODIC);
+		if (err)
+		{
+			return -1;
 		}
+
+		et->On(et);
+	}
+	else
+	{
+		return -1;
+	}
+
+	MYCPU(EventTimer) = et;
+	HrtimerSetDevice(et);
+
+	if (et->Mode == ET_MODE_ONESHOT)
+	{
+		HrtimerInit(&MYCPU(ticktimer), TickHrtimer, NULL, 0);
+		HrtimerStart(&MYCPU(ticktimer), TICK_NSEC, HRTIMER_REL);
+	}
+
+	KLOG("tick: %s %s\n", et->Name,
+	     et->Mode == ET_MODE_ONESHOT ? "one-shot" : "periodic");
+
+	return 0;
+}
+
+/*
+ *  Probe @et and keep it if it is rated higher than *@best
+ */
+static void
+EventTimerCandidate(EVENTTIMER *et, EVENTTIMER **best)
+{
+	if (!et || !et->Probe || et->Probe(et))
+	{
+		return;
+	}
+
+	if (!*best || et->Rating > (*best)->Rating)
+	{
+		*best = et;
+	}
+}
+
+static void
+GlobalEventTimerInit(void)
+{
+	for (int i = 0; i < netdb; i++)
+	{
+		EventTimerCandidate(etdbGlobal[i], &globalet);
 	}
 }
 
+/*
+ *  Probe the global timers in registration order.  The best rated one
+ *  becomes STimer, the reference local timers calibrate against.
+ */
 static void
 GlobalTimerInit(void)
 {
@@ -137,50 +350,144 @@ GlobalTimerInit(void)
 		if (t && t->Probe)
 		{
 			err = t->Probe(t);
-			if (!err)
+			if (err)
+			{
+				continue;
+			}
+
+			TimekeepingAddClock(t);
+
+			if (!STimer || t->Rating > STimer->Rating)
 			{
 				STimer = t;
-				break;
 			}
 		}
 	}
+
+	if (STimer)
+	{
+		KLOG("system timer: %s %lu Hz\n", STimer->Name, STimer->Freq);
+	}
+}
+
+static void
+LocalTimerInit(void)
+{
+	TIMER *t;
+	int err;
+
+	for (int i = 0; i < MYCPU(ntdbLocal); i++)
+	{
+		t = MYCPU(tdbLocal)[i];
+		if (t && t->Probe)
+		{
+			err = t->Probe(t);
+			if (err)
+			{
+				continue;
+			}
+
+			// the boot CPU's instance stands for all of them
+			if (CpuId() == 0)
+			{
+				TimekeepingAddClock(t);
+			}
+
+			if (!MYCPU(Timer) || t->Rating > MYCPU(Timer)->Rating)
+			{
+				MYCPU(Timer) = t;
+			}
+		}
+	}
+}
+
+/*
+ *  The tick runs on a local event timer, so that its interrupt stays on
+ *  this CPU.  Only the boot CPU falls back to a global one.
+ */
+static void
+LocalEventTimerInit(void)
+{
+	EVENTTIMER *best = NULL;
+
+	for (int i = 0; i < MYCPU(netdbLocal); i++)
+	{
+		EventTimerCandidate(MYCPU(etdbLocal)[i], &best);
+	}
+
+	if (!best && CpuId() == 0)
+	{
+		best = globalet;
+	}
+
+	if (best)
+	{
+		TickSetup(best);
+	}
 }
 
 void INIT
 TimerInit(void)
 {
+	ClockPageInit();
+
+	SoftirqSetAction(SOFTIRQ_TIMER, TimerSoftirq);
+
 	GlobalTimerInit();
 	GlobalEventTimerInit();
+
+	TimerInitCpu();
 }
 
+/*
+ *  Per-CPU part of the timer setup, run by each CPU on itself
+ */
 void INIT
 TimerInitCpu(void)
 {
-	;
+	TimeoutInitCpu();
+	HrtimerInitCpu();
+
+	LocalTimerInit();
+
+	if (CpuId() == 0)
+	{
+		TimekeepingInit();
+	}
+
+	LocalEventTimerInit();
 }
 
 void INIT
 NewEventTimer(EVENTTIMER *et)
 {
-	if (et->Global)
+	if (et->Global && netdb < NETDB_GLOBAL)
 	{
 		etdbGlobal[netdb++] = et;
 	}
+	else if (!et->Global && MYCPU(netdbLocal) < NETDB_LOCAL)
+	{
+		MYCPU(etdbLocal)[MYCPU(netdbLocal)++] = et;
+	}
 	else
 	{
-		// TODO
+		KWARN("%s: too many event timers\n", et->Name);
 	}
 }
 
 void INIT
 NewTimer(TIMER *tm)
 {
-	if (tm->Global)
+	if (tm->Global && ntdb < NTDB_GLOBAL)
 	{
 		tdbGlobal[ntdb++] = tm;
 	}
+	else if (!tm->Global && MYCPU(ntdbLocal) < NTDB_LOCAL)
+	{
+		MYCPU(tdbLocal)[MYCPU(ntdbLocal)++] = tm;
+	}
 	else
 	{
-		// TODO
+		KWARN("%s: too many timers\n", tm->Name);
 	}
 }
@@ -0,0 +1,314 @@
+/*
+ * Copyright (c) 2024, akarilab.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// User address space benchmarks
+
+#include <akari/types.h>
+#include <akari/compiler.h>
+#include <akari/bench.h>
+#include <akari/mm.h>
+#include <akari/timer.h>
+#include <arch/cpu.h>
+
+#define KPREFIX		"bench/vas:"
+
+#include <akari/log.h>
+
+#define BENCH_VA	0x40000000ul
+
+static void
+VasBenchOne(ulong npages)
+{
+	VAS *parent, *child;
+	ulong size = npages << PAGESHIFT;
+	u64 t0, clone, copy, reuse;
+	bool huge = HugepageEnabled;
+
+	parent = NewVas();
+	if (!parent)
+	{
+		KWARN("cannot create vas\n");
+		return;
+	}
+	// measure 4K pages; huge pages are covered by HugepageBench
+	HugepageEnabled = false;
+
+	if (VasMapAnon(parent, BENCH_VA, size, PTEFLAG_RW) < 0 ||
+	    VasPopulate(parent, BENCH_VA, size) < 0)
+	{
+		HugepageEnabled = huge;
+		KWARN("cannot map %d pages\n", npages);
+		FreeVas(parent);
+		return;
+	}
+
+	HugepageEnabled = huge;
+
+	t0 = ArchCycles();
+	child = VasClone(parent);
+	clone = ArchCycles() - t0;
+
+	if (!child)
+	{
+		KWARN("clone failed\n");
+		FreeVas(parent);
+		return;
+	}
+
+	// child writes first: every fault copies the shared page
+	SwitchVas(child);
+	t0 = ArchCycles();
+	for (ulong va = BENCH_VA; va < BENCH_VA + size; va += PAGESIZE)
+	{
+		*(volatile char *)va = 1;
+	}
+	copy = ArchCycles() - t0;
+
+	// parent is now the single owner: every fault reuses the page
+	SwitchVas(parent);
+	t0 = ArchCycles();
+	for (ulong va = BENCH_VA; va < BENCH_VA + size; va += PAGESIZE)
+	{
+		*(volatile char *)va = 2;
+	}
+	reuse = ArchCycles() - t0;
+
+	SwitchKvas();
+
+	FreeVas(child);
+	FreeVas(parent);
+
+	KLOG("%lu KiB: clone %lu cycles, first write %lu cycles/page (copy) %lu cycles/page (reuse)\n",
+	     size / KiB, clone, copy / npages, reuse / npages);
+}
+
+static void
+VasBench(void)
+{
+	static const ulong npages[] = { 16, 256, 4096, 16384 };
+
+	for (uint i = 0; i < sizeof npages / sizeof npages[0]; i++)
+	{
+		VasBenchOne(npages[i]);
+	}
+}
+
+DEFINE_BENCH(VasClone, VasBench);
+
+/*
+ *  Count create/destroy pairs completed in one second of STimer time.
+ */
+static void
+VasCreateBench(void)
+{
+	TIMER *tm = STimer;
+	ulong end, n = 0;
+	u64 t0, cycles;
+	VAS *vas;
+
+	if (!tm)
+	{
+		KWARN("no system timer\n");
+		return;
+	}
+
+	end = tm->ReadCounterRaw(tm) + TimerUsec2Period(tm, 1000000);
+	t0 = ArchCycles();
+
+	do
+	{
+		// keep timer reads out of the measured loop
+		for (int i = 0; i < 64; i++)
+		{
+			vas = NewVas();
+			if (!vas)
+			{
+				KWARN("cannot create vas\n");
+				return;
+			}
+
+			FreeVas(vas);
+		}
+
+		n += 64;
+	} while (tm->ReadCounterRaw(tm) < end);
+
+	cycles = ArchCycles() - t0;
+
+	KLOG("create/destroy: %lu per second, %lu cycles each\n", n, cycles / n);
+}
+
+DEFINE_BENCH(VasCreate, VasCreateBench);
+
+/*
+ *  Map and unmap single pages 1GiB apart so that each needs its own page
+ *  directory and page table, and check that they are all given back.
+ */
+static void
+VasUnmapBench(void)
+{
+	VAS *vas;
+	ulong va, before, peak = 0;
+	u64 t0, cycles;
+	int n = 256;
+
+	vas = NewVas();
+	if (!vas)
+	{
+		KWARN("cannot create vas\n");
+		return;
+	}
+
+	before = vas->nPgt;
+	t0 = ArchCycles();
+
+	for (int i = 0; i < n; i++)
+	{
+		va = BENCH_VA + (ulong)i * GiB;
+
+		if (VasMapAnon(vas, va, PAGESIZE, PTEFLAG_RW) < 0 ||
+		    VasPopulate(vas, va, PAGESIZE) < 0)
+		{
+			KWARN("cannot map %p\n", va);
+			break;
+		}
+
+		peak = MAX(peak, vas->nPgt);
+
+		VasUnmap(vas, va, PAGESIZE);
+	}
+
+	cycles = ArchCycles() - t0;
+
+	KLOG("map/unmap: %lu cycles each, page table pages %lu -> %lu (peak %lu)\n",
+	     cycles / n, before, vas->nPgt, peak);
+
+	FreeVas(vas);
+}
+
+DEFINE_BENCH(VasUnmap, VasUnmapBench);
+
+#define HUGE_BENCH_SIZE		(64 * MiB)
+#define HUGE_BENCH_STRIDE	4099
+
+/*
+ *  Populate and then touch a 64MiB area in a scattered order, once backed
+ *  by 4K pages and once by 2MiB pages.
+ */
+static void
+HugepageBenchOne(bool huge)
+{
+	ulong npages = HUGE_BENCH_SIZE >> PAGESHIFT;
+	ulong off;
+	u64 t0, populate, access;
+	VAS *vas;
+
+	vas = NewVas();
+	if (!vas)
+	{
+		KWARN("cannot create vas\n");
+		return;
+	}
+
+	HugepageEnabled = huge;
+
+	if (VasMapAnon(vas, BENCH_VA, HUGE_BENCH_SIZE, PTEFLAG_RW) < 0)
+	{
+		KWARN("cannot map area\n");
+		FreeVas(vas);
+		return;
+	}
+
+	t0 = ArchCycles();
+	if (VasPopulate(vas, BENCH_VA, HUGE_BENCH_SIZE) < 0)
+	{
+		KWARN("cannot populate area\n");
+		FreeVas(vas);
+		return;
+	}
+	populate = ArchCycles() - t0;
+
+	SwitchVas(vas);
+
+	// a prime stride in pages walks all of them with little locality
+	off = 0;
+	t0 = ArchCycles();
+	for (int pass = 0; pass < 8; pass++)
+	{
+		for (ulong i = 0; i < npages; i++)
+		{
+			off = (off + HUGE_BENCH_STRIDE) % npages;
+			(void)*(volatile char *)(BENCH_VA + (off << PAGESHIFT));
+		}
+	}
+	access = ArchCycles() - t0;
+
+	SwitchKvas();
+
+	KLOG("%s: populate %lu cycles/page, scattered access %lu cycles/page, page tables %lu\n",
+	     huge ? "2MiB" : "4KiB", populate / npages, access / (npages * 8), vas->nPgt);
+
+	FreeVas(vas);
+}
+
+static void
+HugepageBench(void)
+{
+	bool enabled = HugepageEnabled;
+	VAS *vas;
+	int n;
+
+	HugepageBenchOne(false);
+	HugepageBenchOne(true);
+
+	// a range populated with 4K pages is collapsed afterwards
+	vas = NewVas();
+	if (vas)
+	{
+		HugepageEnabled = false;
+
+		if (VasMapAnon(vas, BENCH_VA, 4 * HUGEPAGESIZE, PTEFLAG_RW) == 0 &&
+		    VasPopulate(vas, BENCH_VA, 4 * HUGEPAGESIZE) == 0)
+		{
+			HugepageEnabled = true;
+			n = VasCollapseHuge(vas, 4);
+			KLOG("collapse: %d of 4 ranges, page tables %lu\n", n, vas->nPgt);
+		}
+
+		FreeVas(vas);
+	}
+
+	HugepageEnabled = enabled;
+
+	KLOG("huge faults %lu, fallbacks %lu, collapses %lu, splits %lu\n",
+	     HugepageStat.nFault, HugepageStat.nFallback,
+	     HugepageStat.nCollapse, HugepageStat.nSplit);
+}
+
+DEFINE_BENCH(Hugepage, HugepageBench);
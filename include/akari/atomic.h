@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2024, akarilab.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _AKARI_ATOMIC_H
+#define _AKARI_ATOMIC_H
+
+#include <akari/types.h>
+#include <akari/compiler.h>
+
+/*
+ *  Atomic operations on naturally aligned words.  Loads acquire, stores
+ *  release and read-modify-write operations are fully ordered.
+ */
+
+#define AtomicLoad(_p)			__atomic_load_n((_p), __ATOMIC_ACQUIRE)
+#define AtomicStore(_p, _v)		__atomic_store_n((_p), (_v), __ATOMIC_RELEASE)
+
+#define AtomicXchg(_p, _v)		__atomic_exchange_n((_p), (_v), __ATOMIC_SEQ_CST)
+#define AtomicFetchAdd(_p, _v)		__atomic_fetch_add((_p), (_v), __ATOMIC_SEQ_CST)
+#define AtomicFetchOr(_p, _v)		__atomic_fetch_or((_p), (_v), __ATOMIC_SEQ_CST)
+#define AtomicFetchAnd(_p, _v)		__atomic_fetch_and((_p), (_v), __ATOMIC_SEQ_CST)
+
+// true if *_p was _old and is now _new; otherwise *_oldp is updated
+#define AtomicCas(_p, _oldp, _new)	\
+	__atomic_compare_exchange_n((_p), (_oldp), (_new), false,	\
+				    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+
+#endif	// _AKARI_ATOMIC_H
@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2024, akarilab.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _AKARI_CLOCKPAGE_H
+#define _AKARI_CLOCKPAGE_H
+
+/*
+ *  Clock page: conversion parameters from the user-readable counter to
+ *  nanoseconds, published by the kernel under a sequence count.
+ *  This header is shared with user space and only needs types.h.
+ */
+
+#include <akari/types.h>
+#include <arch/clockpage.h>
+
+typedef struct CLOCKPAGE	CLOCKPAGE;
+
+struct CLOCKPAGE
+{
+	u32 Seq;		// odd while the kernel updates the page
+	u32 Valid;		// 0: the counter cannot be read from user mode
+	u32 Shift;
+	u32 Reserved;
+	u64 Mult;
+	u64 BaseCycles;
+	u64 BaseNs;
+};
+
+/*
+ *  Read the time without entering the kernel.
+ *  Returns -1 if the page is not usable.
+ */
+static inline int
+ClockPageRead(const volatile CLOCKPAGE *cp, u64 *ns)
+{
+	u64 cycles, base, basens, mult;
+	u32 seq, shift;
+
+	do
+	{
+		seq = cp->Seq;
+		asm volatile ("" ::: "memory");
+
+		if (!cp->Valid)
+		{
+			return -1;
+		}
+
+		mult = cp->Mult;
+		shift = cp->Shift;
+		base = cp->BaseCycles;
+		basens = cp->BaseNs;
+
+		cycles = ClockPageCycles();
+	} while ((seq & 1) || cp->Seq != seq);
+
+	*ns = basens + (u64)(((unsigned __int128)(cycles - base) * mult) >> shift);
+
+	return 0;
+}
+
+#endif	// _AKARI_CLOCKPAGE_H
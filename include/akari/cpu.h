@@ -30,11 +30,13 @@
 #ifndef _CPU_H
 #define _CPU_H
 
+#define NCPU		8
+
+#ifndef __ASSEMBLER__
+
 #include <akari/types.h>
 #include <akari/compiler.h>
 
-#define NCPU		8
-
 extern char __percpu_data[];
 extern char __percpu_data_e[];
 
@@ -46,4 +48,30 @@ extern void *__CpuPtr[NCPU];
 
 #define MY(_v)	
 
+// CPUs that finished bringup and take interrupts
+extern volatile ulong CpuOnlineMask;
+
+static inline bool
+CpuOnline(int cpu)
+{
+	return !!(CpuOnlineMask & (1ul << cpu));
+}
+
+static inline int
+CpuOnlineCount(void)
+{
+	ulong m = CpuOnlineMask;
+	int n = 0;
+
+	// no libgcc for __builtin_popcountl()
+	for (; m; m &= m - 1)
+	{
+		n++;
+	}
+
+	return n;
+}
+
+#endif	// __ASSEMBLER__
+
 #endif	// _CPU_H
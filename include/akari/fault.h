@@ -42,6 +42,7 @@ struct PAGEFAULT
 	ulong FaultAddr;
 	bool Wr;
 	bool User;
+	bool Present;	// protection violation on a present page
 };
 
 void PageFault(PAGEFAULT *pf);
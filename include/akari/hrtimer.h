@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2024, akarilab.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _AKARI_HRTIMER_H
+#define _AKARI_HRTIMER_H
+
+#include <akari/types.h>
+#include <akari/compiler.h>
+#include <akari/list.h>
+
+typedef struct HRTIMER		HRTIMER;
+typedef struct EVENTTIMER	EVENTTIMER;
+
+#define NHRTIMER		256	// queued per CPU
+
+#define HRTIMER_IDLE		(~0u)
+
+// HRTIMER Flags
+#define HRTIMER_DEFERRED	0x1	// run from SOFTIRQ_HRTIMER, not the interrupt
+
+// HrtimerStart() mode
+#define HRTIMER_ABS		0
+#define HRTIMER_REL		1
+
+// latency histogram: bucket i counts [2^i, 2^(i+1)) ns, bucket 0 also 0
+#define HRTIMER_NHIST		32
+
+/*
+ *  High resolution timer, expiring at an absolute KtimeGetNs() time
+ */
+struct HRTIMER
+{
+	ulong Expires;
+	uint Index;		// heap slot, HRTIMER_IDLE if not queued
+	uint Flags;
+
+	void (*Func)(HRTIMER *t);
+	void *Arg;
+
+	LIST Deferred;
+};
+
+void HrtimerInit(HRTIMER *t, void (*func)(HRTIMER *), void *arg, uint flags);
+int HrtimerStart(HRTIMER *t, ulong ns, int mode);
+bool HrtimerCancel(HRTIMER *t);
+void HrtimerInterrupt(void);
+void HrtimerRunDeferred(void);
+void HrtimerSetDevice(EVENTTIMER *et);
+void HrtimerReport(void);
+void HrtimerInitCpu(void) INIT;
+
+static inline bool
+HrtimerQueued(HRTIMER *t)
+{
+	return t->Index != HRTIMER_IDLE;
+}
+
+#endif	// _AKARI_HRTIMER_H
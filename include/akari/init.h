@@ -33,5 +33,6 @@
 #include <akari/compiler.h>
 
 void KernelMain(void) NORETURN;
+void ApMain(void) NORETURN;
 
 #endif	// _INIT_H
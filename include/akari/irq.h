@@ -36,17 +36,66 @@
 
 typedef struct IRQ		IRQ;
 typedef struct IRQSOURCE	IRQSOURCE;
+typedef struct IRQMOD		IRQMOD;
+
+// IRQ Flags
+#define IRQ_USED	0x1
+#define IRQ_PRIVATE	0x2	// one descriptor per CPU, e.g. LAPIC timer
+#define IRQ_LEVEL	0x4	// level triggered, edge if not set
+#define IRQ_ACTIVE_LOW	0x8
+
+// interrupt moderation, see IrqSetModeration()
+#define IRQMOD_WINDOW_NSEC	1000000		// rate is measured per 1ms
+#define IRQMOD_BUDGET		64		// default handler runs per round
+
+/*
+ *  Moderation state, owned by the CPU that took the interrupt
+ */
+struct IRQMOD
+{
+	uint Rate;		// interrupts per window before polling
+	uint Budget;		// handler runs per polling round
+	uint Count;
+	ulong Window;
+	bool Polling;		// masked and serviced from SOFTIRQ_IO
+	ulong PollStamp;
+	IRQ *PollNext;
+
+	ulong nMask;		// switches to polling
+	ulong nUnmask;		// switches back to interrupts
+	ulong nRound;
+	ulong nPolled;		// events handled without an interrupt
+	ulong LatSum;		// ns from the last interrupt or round to a round
+	ulong LatMax;
+};
 
 struct IRQ
 {
 	int Irqno;
+	uint Flags;
 
 	IRQCHIP *Chip;
+	int Hwirq;		// input on Chip, -1 if none
+	int Cpu;		// CPU the interrupt is delivered to
 
+	// handlers, walked without locks by HandleGenericIRQ()
 	IRQSOURCE *Src;
+
+	IRQMOD *Mod;		// NULL if not moderated
 };
 
-IRQ *NewIRQ(int irqno, IRQSOURCE *src, bool priv);
+IRQ *NewIRQ(int irqno, IRQSOURCE *src);
+int IrqSetAffinity(IRQ *irq, int cpu);
+int IrqSetModeration(IRQ *irq, uint rate, uint budget);
+
+int IrqAllocVector(void);
+void IrqFreeVector(int irqno);
+void IrqSetDefaultChip(IRQCHIP *chip);
+IRQCHIP *IrqDefaultChip(void);
+ulong IrqCount(int irqno, int cpu);
+ulong IrqCycles(int irqno, int cpu);
+IRQ *IrqDescriptor(int irqno);
+void IrqReport(void);
 
 int HandleGenericIRQ(int irqno);
 void IrqInit(void) INIT;
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2024, akarilab.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _AKARI_IRQBALANCE_H
+#define _AKARI_IRQBALANCE_H
+
+#include <akari/types.h>
+#include <akari/compiler.h>
+#include <akari/cpu.h>
+#include <arch/irq.h>
+
+typedef struct IRQLOAD		IRQLOAD;
+typedef struct IRQBALANCE	IRQBALANCE;
+
+#define IRQBALANCE_INTERVAL	HZ	// ticks between rounds
+#define IRQBALANCE_MIN_PCT	25	// max - min below this % of the average is left alone
+#define IRQBALANCE_HOLD		4	// rounds before a moved IRQ may move again
+#define IRQBALANCE_ENTRY_COST	1000	// cycles per interrupt spent outside the handlers
+
+struct IRQLOAD
+{
+	bool Used;
+	bool Movable;		// shared, and its chip can set the affinity
+	int Cpu;
+	ulong Load;		// cycles in the last interval
+	ulong Moved;		// round of the last move, 0 if never
+};
+
+/*
+ *  Load of one interval, and the balancer's view of where IRQs go
+ */
+struct IRQBALANCE
+{
+	ulong CpuMask;		// CPUs to balance over
+	ulong Fixed[NCPU];	// load that cannot move, e.g. private IRQs
+	ulong CpuLoad[NCPU];	// Fixed plus the movable IRQs on the CPU
+	IRQLOAD Irq[NR_IRQ];	// indexed by irqno
+
+	ulong Round;
+	ulong nMove;
+};
+
+void IrqBalanceLoad(IRQBALANCE *b);
+int IrqBalanceStep(IRQBALANCE *b, int *to);
+uint IrqBalanceImbalance(IRQBALANCE *b);
+void IrqBalanceReport(void);
+void IrqBalanceInit(void) INIT;
+
+#endif	// _AKARI_IRQBALANCE_H
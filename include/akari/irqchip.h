@@ -34,12 +34,20 @@
 #include <akari/compiler.h>
 
 typedef struct IRQCHIP		IRQCHIP;
+typedef struct IRQ		IRQ;
 
 struct IRQCHIP
 {
+	const char *Name;
 	void *Device;
 
-	void (*EOI)(int irqno);
+	// route irq->Hwirq to irq->Irqno on irq->Cpu, masked
+	int (*Setup)(IRQ *irq);
+	void (*Mask)(IRQ *irq);
+	void (*Unmask)(IRQ *irq);
+	int (*SetAffinity)(IRQ *irq, int cpu);
+
+	void (*EOI)(IRQ *irq);
 };
 
 #endif	// _AKARI_IRQCHIP_H
@@ -38,15 +38,22 @@ typedef struct IRQSOURCE	IRQSOURCE;
 
 struct IRQSOURCE
 {
+	// requested routing, applied by the first source on an IRQ
 	IRQCHIP *Chip;
+	int Hwirq;
+	uint Flags;
 
 	void *Device;
 
 	IRQ *Irq;
+	IRQSOURCE *Next;	// next handler sharing Irq
 
+	// 0 if the interrupt came from this source
 	int (*Handler)(IRQSOURCE *isrc);
 };
 
 IRQSOURCE *NewIRQSource(void *device, int (*handler)(IRQSOURCE *), int irqno, bool private);
+IRQSOURCE *NewChipIRQSource(void *device, int (*handler)(IRQSOURCE *), int irqno,
+			    IRQCHIP *chip, int hwirq, uint flags);
 
 #endif	// _AKARI_IRQSOURCE_H
@@ -42,6 +42,9 @@ struct PAGE
 {
 	PAGE *Next;
 	u8 Blockno;
+	u8 Order;	// order of the allocation this page heads
+	uint Refcnt;	// number of mappings sharing this page
+	u16 nPte;	// valid entries if this is a page table
 };
 
 struct PAGEBLOCK
@@ -113,6 +116,14 @@ PAGE *AllocPages(uint order);
 void *AllocZeroPagesVa(uint order);
 void FreePages(PAGE *page, uint order);
 
+static inline void
+PageGet(PAGE *page)
+{
+	page->Refcnt++;
+}
+
+void PagePut(PAGE *page);
+
 #define Zalloc()		AllocZeroPagesVa(0)
 #define Alloc()			Page2Va(AllocPages(0))
 #define Free(_addr)		FreePages(Va2Page(_addr), 0)
@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2024, akarilab.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _AKARI_LIST_H
+#define _AKARI_LIST_H
+
+#include <akari/types.h>
+#include <akari/compiler.h>
+
+typedef struct LIST	LIST;
+
+/*
+ *  Circular doubly linked list, embedded in its entries
+ */
+struct LIST
+{
+	LIST *Next;
+	LIST *Prev;
+};
+
+#define LIST_ENTRY(_ptr, _st, _m)	container_of(_ptr, _st, _m)
+
+#define LIST_FOREACH(_l, _head)	\
+	for ((_l) = (_head)->Next; (_l) != (_head); (_l) = (_l)->Next)
+
+static inline void
+ListInit(LIST *head)
+{
+	head->Next = head;
+	head->Prev = head;
+}
+
+static inline bool
+ListEmpty(LIST *head)
+{
+	return head->Next == head;
+}
+
+static inline void
+__ListAdd(LIST *new, LIST *prev, LIST *next)
+{
+	next->Prev = new;
+	new->Next = next;
+	new->Prev = prev;
+	prev->Next = new;
+}
+
+static inline void
+ListAdd(LIST *head, LIST *new)
+{
+	__ListAdd(new, head, head->Next);
+}
+
+static inline void
+ListAddTail(LIST *head, LIST *new)
+{
+	__ListAdd(new, head->Prev, head);
+}
+
+/*
+ *  Unlink @l.  An unlinked entry has NULL links.
+ */
+static inline void
+ListDel(LIST *l)
+{
+	l->Prev->Next = l->Next;
+	l->Next->Prev = l->Prev;
+
+	l->Next = NULL;
+	l->Prev = NULL;
+}
+
+static inline bool
+ListLinked(LIST *l)
+{
+	return l->Next != NULL;
+}
+
+/*
+ *  Move every entry of @from to @head, leaving @from empty
+ */
+static inline void
+ListReplace(LIST *head, LIST *from)
+{
+	if (ListEmpty(from))
+	{
+		ListInit(head);
+		return;
+	}
+
+	head->Next = from->Next;
+	head->Prev = from->Prev;
+	head->Next->Prev = head;
+	head->Prev->Next = head;
+
+	ListInit(from);
+}
+
+#endif	// _AKARI_LIST_H
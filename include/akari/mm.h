@@ -31,9 +31,25 @@
 #define _MM_H
 
 #include <akari/types.h>
+#include <akari/pteflags.h>
 #include <arch/mm.h>
 
-typedef struct VAS	VAS;
+typedef struct VAS		VAS;
+typedef struct VMAREA		VMAREA;
+typedef struct HUGEPAGESTAT	HUGEPAGESTAT;
+typedef struct PAGE		PAGE;
+
+/*
+ *  Anonymous memory area of a user address space: [Start, End)
+ */
+struct VMAREA
+{
+	ulong Start;
+	ulong End;
+	PTEFLAGS Flags;
+};
+
+#define NVMAREA		32
 
 /*
  *  Virtual Address Space
@@ -44,11 +60,43 @@ struct VAS
 	uint Level;
 	uint LowestLevel;
 	bool User;
+
+	ulong nPgt;		// pages used by page tables
+	PAGE *PgtFree;		// unlinked tables waiting for a TLB flush
+
+	uint nArea;
+	VMAREA Area[NVMAREA];	// sorted by address
+};
+
+struct HUGEPAGESTAT
+{
+	ulong nFault;		// huge pages installed by the fault path
+	ulong nFallback;	// no free huge page, 4K used instead
+	ulong nCollapse;	// 4K ranges collapsed into huge pages
+	ulong nSplit;		// huge pages split into 4K entries
 };
 
+extern bool HugepageEnabled;
+extern HUGEPAGESTAT HugepageStat;
+
 void __InitKernelAs(VAS *vas);
 void *KIOmap(PHYSADDR pa, ulong nbytes);
 
+VAS *NewVas(void);
+void FreeVas(VAS *vas);
+VAS *VasClone(VAS *parent);
+int VasMapAnon(VAS *vas, ulong va, ulong size, PTEFLAGS flags);
+int VasPopulate(VAS *vas, ulong va, ulong size);
+int VasUnmap(VAS *vas, ulong va, ulong size);
+int VasProtect(VAS *vas, ulong va, ulong size, PTEFLAGS flags);
+int VasCollapseHuge(VAS *vas, int budget);
+int VasAnonFault(VAS *vas, ulong va);
+int VasCowFault(VAS *vas, ulong va);
+
+void SwitchVas(VAS *vas);
+void SwitchKvas(void);
+VAS *CurrentVas(void);
+
 #define ALIGN(p, align)		(((ulong)(p) + (align)-1) & ~((align)-1))
 #define ALIGNDOWN(p, align)	((ulong)(p) & ~((align)-1))
 
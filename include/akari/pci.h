@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2024, akarilab.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _AKARI_PCI_H
+#define _AKARI_PCI_H
+
+#include <akari/types.h>
+#include <akari/compiler.h>
+#include <akari/irqchip.h>
+#include <akari/irqsource.h>
+
+typedef struct PCIDEV		PCIDEV;
+
+#define PCI_VENDOR_ID		0x00
+#define PCI_DEVICE_ID		0x02
+#define PCI_COMMAND		0x04
+#define PCI_COMMAND_MEMORY		0x2
+#define PCI_COMMAND_MASTER		0x4
+#define PCI_COMMAND_INTX_DISABLE	0x400
+#define PCI_STATUS		0x06
+#define PCI_STATUS_CAP_LIST		0x10
+#define PCI_CLASS_REVISION	0x08
+#define PCI_HEADER_TYPE		0x0e
+#define PCI_HEADER_MULTIFUNC		0x80
+#define PCI_BAR0		0x10
+#define PCI_SECONDARY_BUS	0x19	// bridges
+#define PCI_CAP_PTR		0x34
+
+#define PCI_CAP_MSI		0x05
+#define PCI_CAP_MSIX		0x11
+
+// PCIDEV Flags
+#define PCI_MSI_ENABLED		0x1
+#define PCI_MSIX_ENABLED	0x2
+
+#define PCI_MAX_DEV		64
+
+struct PCIDEV
+{
+	u8 Bus;
+	u8 Dev;
+	u8 Func;
+	u16 Vendor;
+	u16 Device;
+	u8 Class;
+	u8 Subclass;
+
+	uint Flags;
+
+	u8 MsiCap;		// capability offsets, 0 if absent
+	u8 MsixCap;
+	uint MsixSize;		// MSI-X table entries
+	volatile void *MsixTable;
+
+	// one IRQCHIP per device: the vector table lives in the device
+	IRQCHIP Chip;
+};
+
+u32 ArchPciRead32(uint bus, uint dev, uint func, uint off);
+void ArchPciWrite32(uint bus, uint dev, uint func, uint off, u32 val);
+
+u32 PciRead32(PCIDEV *pdev, uint off);
+u16 PciRead16(PCIDEV *pdev, uint off);
+u8 PciRead8(PCIDEV *pdev, uint off);
+void PciWrite32(PCIDEV *pdev, uint off, u32 val);
+void PciWrite16(PCIDEV *pdev, uint off, u16 val);
+
+PCIDEV *PciFindDevice(u16 vendor, u16 device, PCIDEV *from);
+PHYSADDR PciBar(PCIDEV *pdev, int bar);
+
+int PciEnableMsi(PCIDEV *pdev, int nvec);
+IRQSOURCE *PciRequestVector(PCIDEV *pdev, int idx, int cpu, void *device,
+			    int (*handler)(IRQSOURCE *));
+int PciRequestQueueVectors(PCIDEV *pdev, int nqueue, void **devices,
+			   int (*handler)(IRQSOURCE *), IRQSOURCE **out);
+
+void PciInit(void) INIT;
+
+#endif	// _AKARI_PCI_H
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2024, akarilab.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _AKARI_SMPCALL_H
+#define _AKARI_SMPCALL_H
+
+#include <akari/types.h>
+#include <akari/compiler.h>
+
+typedef struct SMPCALL		SMPCALL;
+
+/*
+ *  A function to run on another CPU.  It runs in that CPU's interrupt
+ *  handler, with interrupts off.
+ */
+struct SMPCALL
+{
+	SMPCALL *Next;		// call queue link
+
+	void (*Func)(void *arg);
+	void *Arg;
+
+	volatile uint Done;	// set once Func returned
+};
+
+static inline void
+SmpCallInit(SMPCALL *c, void (*func)(void *), void *arg)
+{
+	c->Next = NULL;
+	c->Func = func;
+	c->Arg = arg;
+	c->Done = 0;
+}
+
+static inline bool
+SmpCallDone(SMPCALL *c)
+{
+	return __atomic_load_n(&c->Done, __ATOMIC_ACQUIRE);
+}
+
+int SmpCallAsync(int cpu, SMPCALL *c);
+int SmpCallAsyncMask(ulong mask, SMPCALL *calls);
+void SmpCallWait(SMPCALL *c);
+int SmpCall(int cpu, void (*func)(void *), void *arg);
+int SmpCallMask(ulong mask, void (*func)(void *), void *arg);
+void SmpCallReport(void);
+void SmpCallInitCpu(void) INIT;
+
+#endif	// _AKARI_SMPCALL_H
@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2024, akarilab.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _AKARI_SOFTIRQ_H
+#define _AKARI_SOFTIRQ_H
+
+#include <akari/types.h>
+#include <akari/compiler.h>
+
+// softirq numbers, lower runs first
+#define SOFTIRQ_TIMER		0	// timeout wheel
+#define SOFTIRQ_HRTIMER		1	// HRTIMER_DEFERRED callbacks
+#define SOFTIRQ_IO		2	// device completions, polled IRQs
+#define NSOFTIRQ		3
+
+// per pass on interrupt exit, the rest is handed to the idle loop
+#define SOFTIRQ_MAX_RESTART	8
+#define SOFTIRQ_MAX_NSEC	2000000
+
+void SoftirqSetAction(int nr, void (*action)(void));
+void SoftirqRaise(int nr);
+bool SoftirqPending(void);
+void SoftirqRunPending(void);
+void IrqExit(void);
+void SoftirqReport(void);
+
+#endif	// _AKARI_SOFTIRQ_H
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2024, akarilab.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _AKARI_SPINLOCK_H
+#define _AKARI_SPINLOCK_H
+
+#include <akari/types.h>
+#include <akari/compiler.h>
+#include <akari/atomic.h>
+#include <arch/cpu.h>
+
+typedef struct SPINLOCK		SPINLOCK;
+
+struct SPINLOCK
+{
+	int Locked;
+};
+
+#define SPINLOCK_INIT		{ .Locked = 0 }
+
+static inline void
+SpinLock(SPINLOCK *lk)
+{
+	while (AtomicXchg(&lk->Locked, 1))
+	{
+		// wait on a plain read, not on the bus
+		while (AtomicLoad(&lk->Locked))
+		{
+			ArchCpuRelax();
+		}
+	}
+}
+
+static inline void
+SpinUnlock(SPINLOCK *lk)
+{
+	AtomicStore(&lk->Locked, 0);
+}
+
+/*
+ *  For locks also taken from interrupt handlers
+ */
+static inline ulong
+SpinLockIrqSave(SPINLOCK *lk)
+{
+	ulong flags = ArchIntrSave();
+
+	SpinLock(lk);
+
+	return flags;
+}
+
+static inline void
+SpinUnlockIrqRestore(SPINLOCK *lk, ulong flags)
+{
+	SpinUnlock(lk);
+
+	ArchIntrRestore(flags);
+}
+
+#endif	// _AKARI_SPINLOCK_H
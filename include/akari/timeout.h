@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2024, akarilab.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _AKARI_TIMEOUT_H
+#define _AKARI_TIMEOUT_H
+
+#include <akari/types.h>
+#include <akari/compiler.h>
+#include <akari/list.h>
+#include <akari/spinlock.h>
+
+typedef struct TIMEOUT		TIMEOUT;
+typedef struct TIMERWHEEL	TIMERWHEEL;
+typedef struct WHEELSTAT	WHEELSTAT;
+
+/*
+ *  Hierarchical timing wheel: 256 slots of one tick, then 4 levels of 64
+ *  slots each covering 64 times the range of the level below.
+ */
+#define WHEEL_ROOT_BITS		8
+#define WHEEL_LEVEL_BITS	6
+#define WHEEL_NLEVEL		4
+#define WHEEL_ROOT_SIZE		(1 << WHEEL_ROOT_BITS)
+#define WHEEL_LEVEL_SIZE	(1 << WHEEL_LEVEL_BITS)
+#define WHEEL_MAX_TICKS		(1ul << (WHEEL_ROOT_BITS + WHEEL_NLEVEL * WHEEL_LEVEL_BITS))
+
+struct TIMEOUT
+{
+	LIST Entry;
+	ulong Expires;		// in wheel ticks
+
+	void (*Func)(TIMEOUT *t);
+	void *Arg;
+
+	TIMERWHEEL *Wheel;
+};
+
+struct WHEELSTAT
+{
+	ulong nArm;
+	ulong nCancel;
+	ulong nExpire;
+	ulong nCascade;		// timeouts moved down a level
+};
+
+/*
+ *  Lock protects the slots, @Clk and @nPending.  WheelAdd() and WheelDel()
+ *  expect it held unless the wheel is private to the caller; WheelAdvance()
+ *  takes it and drops it around callbacks.
+ */
+struct TIMERWHEEL
+{
+	SPINLOCK Lock;
+
+	ulong Clk;		// next tick to process
+	ulong nPending;
+
+	LIST Root[WHEEL_ROOT_SIZE];
+	LIST Level[WHEEL_NLEVEL][WHEEL_LEVEL_SIZE];
+
+	WHEELSTAT Stat;
+};
+
+void WheelInit(TIMERWHEEL *w);
+void WheelAdd(TIMERWHEEL *w, TIMEOUT *t, ulong ticks);
+bool WheelDel(TIMEOUT *t);
+void WheelAdvance(TIMERWHEEL *w, ulong now);
+
+void TimeoutInit(TIMEOUT *t, void (*func)(TIMEOUT *), void *arg);
+void TimeoutArm(TIMEOUT *t, ulong ticks);
+bool TimeoutCancel(TIMEOUT *t);
+void TimeoutRun(ulong now);
+bool TimeoutIdle(void);
+void TimeoutInitCpu(void) INIT;
+
+static inline bool
+TimeoutPending(TIMEOUT *t)
+{
+	return ListLinked(&t->Entry);
+}
+
+#endif	// _AKARI_TIMEOUT_H
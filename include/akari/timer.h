@@ -36,17 +36,41 @@
 
 typedef struct TIMER		TIMER;
 typedef struct EVENTTIMER	EVENTTIMER;
+typedef struct TICKSTAT		TICKSTAT;
+typedef struct PAGE		PAGE;
+
+#define HZ		100
+#define TICK_USEC	(1000000 / HZ)
+#define TICK_NSEC	(1000000000ul / HZ)
+
+// EVENTTIMER Features
+#define ET_FEAT_PERIODIC	0x1
+#define ET_FEAT_ONESHOT		0x2
+#define ET_FEAT_DEADLINE	0x4	// one-shot against an absolute deadline
+
+// EVENTTIMER Mode
+#define ET_MODE_OFF		0
+#define ET_MODE_PERIODIC	1
+#define ET_MODE_ONESHOT		2
 
 struct TIMER
 {
 	void *Device;
 	char Name[16];
 	bool Global;
+	bool UserReadable;	// counter can back the user clock page
+	bool Unstable;
+	int Rating;		// the best rated stable timer keeps time
+
+	ulong Freq;		// Hz, set by Probe through TimerSetFreq()
+	u32 Mult;		// counts to ns: (c * Mult) >> Shift
+	u32 Shift;
+	u32 RevMult;		// ns to counts: (ns * RevMult) >> RevShift
+	u32 RevShift;
 
 	int (*Probe)(TIMER *tm);
 	void (*Disable)(TIMER *tm);
 
-	ulong (*uSec2Period)(TIMER *tm, uint usec);
 	ulong (*ReadCounterRaw)(TIMER *tm);
 };
 
@@ -55,12 +79,19 @@ struct EVENTTIMER
 	void *Device;
 	char Name[16];
 	bool Global;
+	int Rating;		// the best rated event timer runs the tick
+	uint Features;
+	int Mode;
 
 	int (*Probe)(EVENTTIMER *et);
 
 	uint (*GetPeriod)(EVENTTIMER *et);
 	void (*SetPeriod)(EVENTTIMER *et, uint ms);
 
+	int (*SetMode)(EVENTTIMER *et, int mode);
+	// one-shot: fire once @ns from now
+	int (*SetNextEvent)(EVENTTIMER *et, ulong ns);
+
 	void (*On)(EVENTTIMER *et);
 	void (*Off)(EVENTTIMER *et);
 
@@ -69,10 +100,63 @@ struct EVENTTIMER
 	IRQSOURCE *Irq;
 };
 
+struct TICKSTAT
+{
+	ulong nTick;		// tick interrupts taken
+	ulong nStop;		// tick stopped on idle entry
+	ulong nSkipped;		// ticks not taken while stopped
+};
+
+extern TIMER *STimer;
+extern volatile ulong Ticks;
+
+static inline ulong
+TimerCycles2Ns(TIMER *tm, ulong cycles)
+{
+	return ((unsigned __int128)cycles * tm->Mult) >> tm->Shift;
+}
+
+static inline ulong
+Ns2Cycles(ulong ns, u32 revmult, u32 revshift)
+{
+	return ((unsigned __int128)ns * revmult) >> revshift;
+}
+
+static inline ulong
+TimerNs2Cycles(TIMER *tm, ulong ns)
+{
+	return Ns2Cycles(ns, tm->RevMult, tm->RevShift);
+}
+
+static inline ulong
+TimerUsec2Period(TIMER *tm, uint usec)
+{
+	return TimerNs2Cycles(tm, (ulong)usec * 1000);
+}
+
 void mSleep(uint msec);
 void uSleep(uint usec);
 
+void TimerSetFreq(TIMER *tm, ulong freq);
+void TimerCalcRevMult(ulong freq, u32 *revmult, u32 *revshift);
+void TimerMarkUnstable(TIMER *tm, const char *reason);
+ulong KtimeGetNs(void);
+TIMER *TimekeepingClock(void);
+void TimekeepingAddClock(TIMER *tm) INIT;
+void TimekeepingInit(void) INIT;
+void TimekeepingUpdate(void);
+
+void TimerEvent(EVENTTIMER *et);
+void TimerIdleEnter(void);
+void TimerIdleExit(void);
+void TickReport(void);
+
+void ClockPageInit(void) INIT;
+void ClockPageUpdate(TIMER *tm, ulong cycles, ulong ns);
+PAGE *ClockPage(void);
+
 void TimerInit(void) INIT;
+void TimerInitCpu(void) INIT;
 void NewTimer(TIMER *tm) INIT;
 void NewEventTimer(EVENTTIMER *et) INIT;
 